@@ -0,0 +1,108 @@
+#include "arena.h"
+
+static Arena* arena_active = NULL;
+
+void ArenaInit(Arena* a, void* base, size_t size) {
+	a->base = (uint8_t*)base;
+	a->size = size;
+	a->used = 0;
+	a->high = 0;
+	a->spilled = 0;
+}
+
+static size_t ArenaRound(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void* ArenaAlloc(Arena* a, size_t size) {
+	size = ArenaRound(size);
+	if( size > a->size - a->used ) {
+		return NULL;
+	}
+	void* p = a->base + a->used;
+	a->used += size;
+	if( a->used > a->high ) {
+		a->high = a->used;
+	}
+	return p;
+}
+
+void ArenaReset(Arena* a) {
+	a->used = 0;
+	a->spilled = 0;
+}
+
+void ArenaSet(Arena* a) {
+	arena_active = a;
+}
+
+Arena* ArenaActive(void) {
+	return arena_active;
+}
+
+void* ArenaMalloc(size_t size) {
+	if( arena_active ) {
+		void* p = ArenaAlloc(arena_active, size);
+		if( p ) {
+			return p;
+		}
+		++arena_active->spilled;
+	}
+	return malloc(size);
+}
+
+void ArenaFree(void* p) {
+	const Arena* a = arena_active;
+	if( a && (uint8_t*)p >= a->base && (uint8_t*)p < a->base + a->size ) {
+		return;
+	}
+	free(p);
+}
+
+// the offset of p in the active arena when it is the last block, -1 otherwise
+static ptrdiff_t ArenaTop(const void* p, size_t size) {
+	const Arena* a = arena_active;
+	if( a == NULL || p == NULL || (const uint8_t*)p + ArenaRound(size) != a->base + a->used ) {
+		return -1;
+	}
+	return (const uint8_t*)p - a->base;
+}
+
+void* ArenaResize(void* p, size_t old_size, size_t size) {
+	Arena* a = arena_active;
+	const ptrdiff_t at = ArenaTop(p, old_size);
+	if( at >= 0 ) {
+		if( ArenaRound(size) <= a->size - at ) {
+			a->used = at + ArenaRound(size);
+			if( a->used > a->high ) {
+				a->high = a->used;
+			}
+			return p;
+		}
+		// the heap copy is made before anything overwrites the top
+		a->used = at;
+	} else if( size <= old_size ) {
+		return p;
+	}
+	void* q = ArenaMalloc(size);
+	if( q == NULL ) {
+		if( at >= 0 ) {
+			a->used = at + ArenaRound(old_size);
+		}
+		return NULL;
+	}
+	if( old_size ) {
+		memcpy(q, p, old_size < size ? old_size : size);
+	}
+	ArenaFree(p);
+	return q;
+}
+
+void ArenaRelease(void* p, size_t size) {
+	const ptrdiff_t at = ArenaTop(p, size);
+	if( at >= 0 ) {
+		arena_active->used = at;
+		return;
+	}
+	ArenaFree(p);
+}
@@ -0,0 +1,47 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bump allocator for the memory that lives as long as a Gerber job: the
+ * context, the apertures with their cached fills and the macro
+ * definitions. gerber_start hands it a static region and gerber_finish
+ * releases all of it at once, so an allocation is a pointer increment and
+ * no job leaves holes in the heap behind. The paths recorded for macro
+ * apertures and step and repeat blocks grow in place at the top of it and
+ * give the room back when they go while still on top. Scratch memory of a
+ * single command (region edges) and the coverage tiles stay on the heap.
+ */
+#define ARENA_ALIGN 8
+
+typedef struct Arena {
+	uint8_t* base;
+	size_t size;
+	size_t used;
+	size_t high; // the most used at once since ArenaInit
+	unsigned spilled; // allocations since the reset that did not fit and went to the heap
+} Arena;
+
+void ArenaInit(Arena* a, void* base, size_t size);
+// NULL when it does not fit
+void* ArenaAlloc(Arena* a, size_t size);
+void ArenaReset(Arena* a);
+
+// while set, ArenaMalloc takes from it, from the heap otherwise or when it is full
+void ArenaSet(Arena* a);
+Arena* ArenaActive(void);
+void* ArenaMalloc(size_t size);
+// heap blocks are freed, arena blocks go with ArenaReset
+void ArenaFree(void* p);
+/*
+ * Block of size bytes with the first ones of p, which has old_size, in
+ * place while p is the last block of the active arena. NULL when it does
+ * not fit, p stays then.
+ */
+void* ArenaResize(void* p, size_t old_size, size_t size);
+// ArenaFree that gives the room back while p is the last block
+void ArenaRelease(void* p, size_t size);
+
+#endif // _ARENA_H
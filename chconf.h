@@ -451,9 +451,14 @@
  * @brief   ISR exit hook.
  */
 #define CH_CFG_IRQ_EPILOGUE_HOOK() {                                        \
-  /* IRQ epilogue code here.*/                                              \
+  /* Real-time override bytes of the serial line, see override.h.*/         \
+  OverrideServeI();                                                         \
 }
 
+#if !defined(_FROM_ASM_)
+void OverrideServeI(void);
+#endif
+
 /**
  * @brief   Idle thread enter hook.
  * @note    This hook is invoked within a critical zone, no OS functions
@@ -0,0 +1,213 @@
+#include "checkpoint.h"
+#include "motor.h"
+#include "gerber.h"
+
+#define CHECKPOINT_TAG 0xC500
+// DR1..DR10, 16 bits each a word apart
+#define CHECKPOINT_DR(i) (*(volatile uint32_t*)((uintptr_t)&BKP->DR1 + 4 * (i)))
+#define CHECKPOINT_WORDS 10
+
+typedef struct CheckpointCandidate {
+	Checkpoint c;
+	uint32_t steps; // made by the motion before it, from the start
+} CheckpointCandidate;
+
+static CheckpointCandidate checkpoint_candidates[CHECKPOINT_CANDIDATES];
+static unsigned checkpoint_put, checkpoint_taken; // running on
+static CheckpointState checkpoint_state = NULL;
+static unsigned checkpoint_kind;
+static uint32_t checkpoint_segment; // counted so far
+static int32_t checkpoint_x, checkpoint_y; // where the next one starts
+static uint32_t checkpoint_steps; // of the segments made
+static uint32_t checkpoint_base; // MotorSteps at the start
+static Checkpoint checkpoint_resume;
+static int checkpoint_mismatch;
+static int checkpoint_origin_known;
+static int checkpoint_origin_x, checkpoint_origin_y;
+static virtual_timer_t checkpoint_vt;
+
+static void CheckpointPack(const Checkpoint* c, uint16_t* w) {
+	w[0] = CHECKPOINT_TAG | c->kind;
+	w[1] = c->segment;
+	w[2] = c->segment >> 16;
+	w[3] = c->line;
+	w[4] = c->line >> 16;
+	w[5] = c->x;
+	w[6] = c->y;
+	w[7] = c->aperture;
+	w[8] = c->modal;
+	w[9] = 0;
+	for( unsigned i = 0; i < CHECKPOINT_WORDS - 1; ++i ) {
+		w[9] += w[i];
+	}
+	w[9] = ~w[9];
+}
+
+static void CheckpointStoreI(const Checkpoint* c) {
+	uint16_t w[CHECKPOINT_WORDS];
+	CheckpointPack(c, w);
+	// the tag last, a reset while writing leaves no checkpoint
+	CHECKPOINT_DR(0) = 0;
+	for( unsigned i = 1; i < CHECKPOINT_WORDS; ++i ) {
+		CHECKPOINT_DR(i) = w[i];
+	}
+	CHECKPOINT_DR(0) = w[0];
+}
+
+void CheckpointInit(void) {
+	rccEnableBKPInterface(FALSE);
+	PWR->CR |= PWR_CR_DBP;
+	chVTObjectInit(&checkpoint_vt);
+}
+
+int CheckpointLoad(Checkpoint* c) {
+	uint16_t w[CHECKPOINT_WORDS];
+	for( unsigned i = 0; i < CHECKPOINT_WORDS; ++i ) {
+		w[i] = CHECKPOINT_DR(i);
+	}
+	if( (w[0] & 0xFF00) != CHECKPOINT_TAG ) {
+		return 0;
+	}
+	c->kind = w[0] & 0xFF;
+	c->segment = w[1] | (uint32_t)w[2] << 16;
+	c->line = w[3] | (uint32_t)w[4] << 16;
+	c->x = (int16_t)w[5];
+	c->y = (int16_t)w[6];
+	c->aperture = w[7];
+	c->modal = w[8];
+	uint16_t check[CHECKPOINT_WORDS];
+	CheckpointPack(c, check);
+	return check[9] == w[9];
+}
+
+void CheckpointClear(void) {
+	CHECKPOINT_DR(0) = 0;
+}
+
+// stores the last candidate the motion has passed
+static void CheckpointUpdateI(void) {
+	const uint32_t made = MotorSteps() - checkpoint_base;
+	const CheckpointCandidate* passed = NULL;
+	while( checkpoint_taken != checkpoint_put ) {
+		const CheckpointCandidate* next = &checkpoint_candidates[checkpoint_taken % CHECKPOINT_CANDIDATES];
+		if( next->steps > made ) {
+			break;
+		}
+		passed = next;
+		++checkpoint_taken;
+	}
+	if( passed ) {
+		CheckpointStoreI(&passed->c);
+	}
+}
+
+static void CheckpointTick(void* arg) {
+	(void)arg;
+	chSysLockFromISR();
+	CheckpointUpdateI();
+	chVTSetI(&checkpoint_vt, MS2ST(CHECKPOINT_PERIOD_MS), CheckpointTick, NULL);
+	chSysUnlockFromISR();
+}
+
+void CheckpointStart(unsigned kind, CheckpointState state, const Checkpoint* resume) {
+	chSysLock();
+	checkpoint_put = checkpoint_taken = 0;
+	checkpoint_state = state;
+	checkpoint_kind = kind;
+	checkpoint_segment = 0;
+	checkpoint_x = checkpoint_y = 0;
+	checkpoint_steps = 0;
+	checkpoint_base = MotorSteps();
+	checkpoint_mismatch = 0;
+	if( !resume || !checkpoint_origin_known ) {
+		checkpoint_origin_known = 1;
+		checkpoint_origin_x = CUR_X;
+		checkpoint_origin_y = CUR_Y;
+	}
+	if( resume ) {
+		// kept until the motion passes a newer one
+		checkpoint_resume = *resume;
+	} else {
+		checkpoint_resume.kind = CHECKPOINT_NONE;
+		CheckpointClear();
+	}
+	chVTSetI(&checkpoint_vt, MS2ST(CHECKPOINT_PERIOD_MS), CheckpointTick, NULL);
+	chSysUnlock();
+}
+
+void CheckpointStop(void) {
+	chSysLock();
+	chVTResetI(&checkpoint_vt);
+	// after MotorGroupWait or MotorAbort the motion stands
+	CheckpointUpdateI();
+	checkpoint_state = NULL;
+	chSysUnlock();
+}
+
+int CheckpointOrigin(int* x, int* y) {
+	*x = checkpoint_origin_x;
+	*y = checkpoint_origin_y;
+	return checkpoint_origin_known;
+}
+
+static void CheckpointFill(Checkpoint* c, uint32_t segment) {
+	checkpoint_state(c);
+	c->kind = checkpoint_kind;
+	c->segment = segment;
+	c->x = checkpoint_x;
+	c->y = checkpoint_y;
+}
+
+static uint32_t CheckpointSteps(int dx, int dy) {
+	dx = abs(dx);
+	dy = abs(dy);
+	return dx > dy ? dx : dy;
+}
+
+void CheckpointMoved(int dx, int dy) {
+	checkpoint_steps += CheckpointSteps(dx, dy);
+}
+
+int CheckpointSegment(const Segment* s) {
+	if( checkpoint_state == NULL ) {
+		return CHECKPOINT_MAKE;
+	}
+	if( checkpoint_mismatch ) {
+		return CHECKPOINT_MISMATCH;
+	}
+	const uint32_t i = checkpoint_segment++;
+	int make = CHECKPOINT_MAKE;
+	Checkpoint c;
+	if( checkpoint_resume.kind != CHECKPOINT_NONE ) {
+		if( i < checkpoint_resume.segment ) {
+			checkpoint_x += s->dx;
+			checkpoint_y += s->dy;
+			return CHECKPOINT_SKIP;
+		}
+		CheckpointFill(&c, i);
+		if( memcmp(&c, &checkpoint_resume, sizeof(c)) != 0 ) {
+			checkpoint_mismatch = 1;
+			return CHECKPOINT_MISMATCH;
+		}
+		checkpoint_resume.kind = CHECKPOINT_NONE;
+		make = CHECKPOINT_RESUME;
+	}
+	if( i % CHECKPOINT_EVERY == 0 && checkpoint_put - checkpoint_taken < CHECKPOINT_CANDIDATES ) {
+		if( make != CHECKPOINT_RESUME ) {
+			CheckpointFill(&c, i);
+		}
+		// out of the registers the checkpoint before stays
+		if( c.x == (int16_t)c.x && c.y == (int16_t)c.y ) {
+			chSysLock();
+			CheckpointCandidate* next = &checkpoint_candidates[checkpoint_put % CHECKPOINT_CANDIDATES];
+			next->c = c;
+			next->steps = checkpoint_steps;
+			++checkpoint_put;
+			chSysUnlock();
+		}
+	}
+	checkpoint_x += s->dx;
+	checkpoint_y += s->dy;
+	checkpoint_steps += CheckpointSteps(s->dx, s->dy);
+	return make;
+}
@@ -0,0 +1,82 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdint.h>
+#include "segment.h"
+
+/*
+ * Checkpoints of a running job, to go on after an abort or a reset
+ * without burning again what is done. The segments of a job are counted
+ * in their order as they are handed to the motion; every
+ * CHECKPOINT_EVERY segments the state at the start of the next one is
+ * kept as a candidate with the full steps (motor.h) the motion makes up
+ * to it. A virtual timer stores the last candidate the step count has
+ * passed in the backup registers, which keep it over a reset and, with a
+ * battery on VBAT, a power loss. Writing the flash would stop the step
+ * ISR.
+ *
+ * A job resumed from a checkpoint runs the same segments again: the ones
+ * before it are skipped without motion, the head moves from where it
+ * stands to the position of the checkpoint from the job origin and the
+ * job goes on. The origin is kept in RAM, CUR_X and CUR_Y start again at
+ * a reset: after one the head has to stand at the origin. A Gerber job
+ * is sent again from its first line, the parser runs through the lines
+ * before the checkpoint and its state there is compared with the one
+ * kept.
+ */
+
+#define CHECKPOINT_EVERY 16 // segments
+#define CHECKPOINT_CANDIDATES 16
+#define CHECKPOINT_PERIOD_MS 500
+
+#define CHECKPOINT_NONE 0
+#define CHECKPOINT_GERBER 1
+#define CHECKPOINT_CACHED 2
+
+// GerberContext modal state in Checkpoint.modal
+#define CHECKPOINT_MM (1u << 0)
+#define CHECKPOINT_ABSOLUTE (1u << 1)
+#define CHECKPOINT_LINEAR (1u << 2)
+#define CHECKPOINT_CLOCKWISE (1u << 3)
+#define CHECKPOINT_QUADRANT(q) ((q) << 4) // is_single_quadrant, 0..2
+
+typedef struct Checkpoint {
+	unsigned kind;
+	uint32_t segment; // the segments made before it
+	uint32_t line; // of a Gerber job, the cache offset of a cached one
+	int32_t x, y; // where its segment starts, from the job origin, kept in 16 bits
+	uint16_t aperture;
+	uint16_t modal;
+} Checkpoint;
+
+// the state of the job at the next segment: line, aperture and modal
+typedef void (*CheckpointState)(Checkpoint* c);
+
+void CheckpointInit(void);
+// the checkpoint kept, returns 0 without one
+int CheckpointLoad(Checkpoint* c);
+void CheckpointClear(void);
+
+/*
+ * Counting starts for a job, the kept checkpoint is cleared. With resume
+ * it stays and the segments before it are skipped.
+ */
+void CheckpointStart(unsigned kind, CheckpointState state, const Checkpoint* resume);
+void CheckpointStop(void);
+/*
+ * The origin of the job counted last, CUR_X and CUR_Y at its start.
+ * Returns 0 when no job was counted since the reset, a job resumed then
+ * takes the head position as its origin.
+ */
+int CheckpointOrigin(int* x, int* y);
+
+#define CHECKPOINT_SKIP 0
+#define CHECKPOINT_MAKE 1
+#define CHECKPOINT_RESUME 2 // the first one made, the head goes to the checkpoint first
+#define CHECKPOINT_MISMATCH 3 // the job is not the one of the checkpoint
+// the next segment of the job, returns what to do with it
+int CheckpointSegment(const Segment* s);
+// a move of the motion that is not a segment of the job
+void CheckpointMoved(int dx, int dy);
+
+#endif // _CHECKPOINT_H
@@ -0,0 +1,208 @@
+#include "coverage.h"
+
+static Coverage* coverage_active = NULL;
+
+Coverage* CoverageNew(float radius) {
+	Coverage* c = (Coverage*)malloc(sizeof(Coverage));
+	if( c == NULL ) {
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
+	c->radius = radius;
+	return c;
+}
+
+void CoverageFree(Coverage* c) {
+	for( unsigned b = 0; b < COVERAGE_BUCKETS; ++b ) {
+		while( c->buckets[b] ) {
+			CoverageTile* next = c->buckets[b]->next;
+			free(c->buckets[b]);
+			c->buckets[b] = next;
+		}
+	}
+	free(c);
+}
+
+void CoverageSet(Coverage* c) {
+	coverage_active = c;
+}
+
+Coverage* CoverageActive(void) {
+	return coverage_active;
+}
+
+int CoveragePoints(int dx, int dy) {
+	dx = abs(dx);
+	dy = abs(dy);
+	return dx > dy ? dx : dy;
+}
+
+void CoveragePoint(int x, int y, int dx, int dy, int i, int* px, int* py) {
+	const int n = CoveragePoints(dx, dy);
+	*px = x + dx * i / n;
+	*py = y + dy * i / n;
+}
+
+static unsigned CoverageBucket(int tx, int ty) {
+	return ((unsigned)tx * 31 + (unsigned)ty * 17) % COVERAGE_BUCKETS;
+}
+
+// the least recently touched tile, taken out of its bucket
+static CoverageTile* CoverageDrop(Coverage* c) {
+	CoverageTile** oldest = NULL;
+	for( unsigned b = 0; b < COVERAGE_BUCKETS; ++b ) {
+		for( CoverageTile** t = &c->buckets[b]; *t; t = &(*t)->next ) {
+			if( oldest == NULL || (*t)->stamp < (*oldest)->stamp ) {
+				oldest = t;
+			}
+		}
+	}
+	if( oldest == NULL ) {
+		return NULL;
+	}
+	CoverageTile* tile = *oldest;
+	*oldest = tile->next;
+	++c->dropped;
+	return tile;
+}
+
+static CoverageTile* CoverageTileAt(Coverage* c, int tx, int ty, int create) {
+	if( c->last && c->last->tx == tx && c->last->ty == ty ) {
+		c->last->stamp = c->stamp;
+		return c->last;
+	}
+	const unsigned b = CoverageBucket(tx, ty);
+	for( CoverageTile* t = c->buckets[b]; t; t = t->next ) {
+		if( t->tx == tx && t->ty == ty ) {
+			t->stamp = c->stamp;
+			c->last = t;
+			return t;
+		}
+	}
+	if( !create ) {
+		return NULL;
+	}
+	CoverageTile* t = c->tiles < COVERAGE_TILES_MAX ? (CoverageTile*)malloc(sizeof(CoverageTile)) : NULL;
+	if( t ) {
+		++c->tiles;
+	} else if( (t = CoverageDrop(c)) == NULL ) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(*t));
+	t->tx = tx;
+	t->ty = ty;
+	t->stamp = c->stamp;
+	t->next = c->buckets[b];
+	c->buckets[b] = t;
+	c->last = t;
+	return t;
+}
+
+static int CoverageGet(Coverage* c, int x, int y) {
+	const CoverageTile* t = CoverageTileAt(c, x >> 5, y >> 5, 0);
+	return t && (t->rows[y & (COVERAGE_TILE - 1)] >> (x & (COVERAGE_TILE - 1)) & 1);
+}
+
+static void CoverageSetCell(Coverage* c, int x, int y) {
+	CoverageTile* t = CoverageTileAt(c, x >> 5, y >> 5, 1);
+	if( t ) {
+		t->rows[y & (COVERAGE_TILE - 1)] |= 1u << (x & (COVERAGE_TILE - 1));
+	}
+}
+
+/*
+ * Whether the tool circle at (x, y) only reaches set cells. The circle
+ * is grown by the distance to the move between two points, so that the
+ * whole stretch between covered points is covered.
+ */
+static int CoverageCovered(Coverage* c, int x, int y) {
+	const float reach = c->radius + 0.75f;
+	const int k = (int)(reach + 0.5f);
+	for( int j = -k; j <= k; ++j ) {
+		const float fy = abs(j) > 0 ? abs(j) - 0.5f : 0;
+		for( int i = -k; i <= k; ++i ) {
+			const float fx = abs(i) > 0 ? abs(i) - 0.5f : 0;
+			if( fx * fx + fy * fy < reach * reach && !CoverageGet(c, x + i, y + j) ) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int CoverageClip(Coverage* c, int x, int y, int dx, int dy, int from, int* to) {
+	const int n = CoveragePoints(dx, dy);
+	const int skip = (int)(COVERAGE_SKIP_MIN * c->radius);
+	++c->stamp;
+	int i = from;
+	while( i < n ) {
+		int px, py;
+		CoveragePoint(x, y, dx, dy, i, &px, &py);
+		if( !CoverageCovered(c, px, py) ) {
+			++i;
+			continue;
+		}
+		int j = i;
+		while( j < n ) {
+			CoveragePoint(x, y, dx, dy, j + 1, &px, &py);
+			if( !CoverageCovered(c, px, py) ) {
+				break;
+			}
+			++j;
+		}
+		if( j - i >= skip ) {
+			if( i > from ) {
+				*to = i;
+				return 1;
+			}
+			*to = j;
+			c->saved += sqrtf((float)dx * dx + (float)dy * dy) * (j - i) / n;
+			return 0;
+		}
+		i = j + 1;
+	}
+	*to = n;
+	return 1;
+}
+
+static float CoverageDistance2(float px, float py, float x, float y, float dx, float dy) {
+	const float length2 = dx * dx + dy * dy;
+	float t = ((px - x) * dx + (py - y) * dy) / length2;
+	if( t < 0 ) {
+		t = 0;
+	} else if( t > 1 ) {
+		t = 1;
+	}
+	const float ex = x + t * dx - px;
+	const float ey = y + t * dy - py;
+	return ex * ex + ey * ey;
+}
+
+void CoverageMark(Coverage* c, int x, int y, int dx, int dy) {
+	const int n = CoveragePoints(dx, dy);
+	if( n == 0 ) {
+		return;
+	}
+	c->burn += sqrtf((float)dx * dx + (float)dy * dy);
+	++c->stamp;
+	// a cell is inside the swept circle when its four corners are
+	const float r2 = c->radius * c->radius + 1e-3f;
+	const int k = (int)c->radius + 1;
+	for( int i = 0; i <= n; ++i ) {
+		int px, py;
+		CoveragePoint(x, y, dx, dy, i, &px, &py);
+		for( int cy = py - k; cy <= py + k; ++cy ) {
+			for( int cx = px - k; cx <= px + k; ++cx ) {
+				if( CoverageGet(c, cx, cy) || CoverageDistance2(cx, cy, x, y, dx, dy) > r2 ) {
+					continue;
+				}
+				if( CoverageDistance2(cx - 0.5f, cy - 0.5f, x, y, dx, dy) <= r2 &&
+					CoverageDistance2(cx + 0.5f, cy - 0.5f, x, y, dx, dy) <= r2 &&
+					CoverageDistance2(cx - 0.5f, cy + 0.5f, x, y, dx, dy) <= r2 &&
+					CoverageDistance2(cx + 0.5f, cy + 0.5f, x, y, dx, dy) <= r2 ) {
+					CoverageSetCell(c, cx, cy);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef _COVERAGE_H
+#define _COVERAGE_H
+
+#include <stdint.h>
+
+/*
+ * Coverage of the burned copper. Traces end where pads are flashed and
+ * wide lines flash their ends again, so the same area would be burned two
+ * or three times. While a coverage is set, a burning move crosses the
+ * stretches where the tool would only burn copper that is burned already
+ * with the laser off (gerber.c).
+ *
+ * Cells are one step, centred on the step positions. A cell is set when
+ * the tool circle swept along one burned move covers all of it, and a
+ * point of a move is skipped when every cell its tool circle reaches is
+ * set, so the exposed area is the same as without the coverage. The cells
+ * are kept in tiles allocated as they are touched. With COVERAGE_TILES_MAX
+ * tiles in use the least recently touched one is dropped, which only costs
+ * a second burn there.
+ */
+#define COVERAGE_TILE 32 // cells per tile side, one word per row
+#define COVERAGE_BUCKETS 64
+// the heap is shared with the shell, the region fills and the repeats
+#ifndef COVERAGE_TILES_MAX
+#define COVERAGE_TILES_MAX 16 // 2.3 KB
+#endif
+#define COVERAGE_SKIP_MIN 2 // tool radii, shorter covered stretches are burned anyway
+
+typedef struct CoverageTile {
+	struct CoverageTile* next;
+	int tx, ty;
+	unsigned stamp;
+	uint32_t rows[COVERAGE_TILE];
+} CoverageTile;
+
+typedef struct Coverage {
+	float radius; // tool radius in steps
+	unsigned tiles;
+	unsigned dropped;
+	unsigned stamp;
+	float burn;  // length of the burning moves in steps
+	float saved; // of it crossed with the laser off
+	CoverageTile* last;
+	CoverageTile* buckets[COVERAGE_BUCKETS];
+} Coverage;
+
+// NULL when the heap is out
+Coverage* CoverageNew(float radius);
+void CoverageFree(Coverage* c);
+
+// while set, burning moves are clipped against it
+void CoverageSet(Coverage* c);
+Coverage* CoverageActive(void);
+
+/*
+ * A move by (dx, dy) from (x, y) is looked at in points 0..n, one step
+ * apart along its longer axis.
+ */
+int CoveragePoints(int dx, int dy);
+void CoveragePoint(int x, int y, int dx, int dy, int i, int* px, int* py);
+
+/*
+ * Returns whether the move burns from its point from up to *to, where the
+ * next stretch starts.
+ */
+int CoverageClip(Coverage* c, int x, int y, int dx, int dy, int from, int* to);
+// sets the cells the burned move covers
+void CoverageMark(Coverage* c, int x, int y, int dx, int dy);
+
+#endif // _COVERAGE_H
@@ -0,0 +1,61 @@
+#include "flash.h"
+
+#define FLASH_START 0x08000000u
+#define FLASH_SIZE_KB (*(const volatile uint16_t*)0x1FFFF7E0) // set in the factory
+#define FLASH_UNLOCK_KEY1 0x45670123u
+#define FLASH_UNLOCK_KEY2 0xCDEF89ABu
+
+// the image ends with the initial values of .data, placed after the code
+extern uint8_t __textdata_base__[], __data_base__[], __data_end__[];
+
+const uint8_t* FlashSpare(void) {
+	const uint8_t* end = (const uint8_t*)FLASH_START + FLASH_SIZE_KB * 1024u;
+	const uint8_t* spare = end - FLASH_SPARE_PAGES * FLASH_PAGE_SIZE;
+	const uint8_t* image_end = __textdata_base__ + (__data_end__ - __data_base__);
+	return image_end <= spare ? spare : NULL;
+}
+
+static void FlashUnlock(void) {
+	if( FLASH->CR & FLASH_CR_LOCK ) {
+		FLASH->KEYR = FLASH_UNLOCK_KEY1;
+		FLASH->KEYR = FLASH_UNLOCK_KEY2;
+	}
+}
+
+// waits for the operation and clears its flags, returns 0 on an error
+static int FlashDone(void) {
+	while( FLASH->SR & FLASH_SR_BSY ) {
+	}
+	const uint32_t sr = FLASH->SR;
+	FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+	return !(sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR));
+}
+
+int FlashErase(const uint8_t* page) {
+	FlashUnlock();
+	FLASH->CR |= FLASH_CR_PER;
+	FLASH->AR = (uint32_t)page;
+	FLASH->CR |= FLASH_CR_STRT;
+	int ok = FlashDone();
+	FLASH->CR &= ~FLASH_CR_PER;
+	FLASH->CR |= FLASH_CR_LOCK;
+	for( unsigned i = 0; ok && i < FLASH_PAGE_SIZE; i += 4 ) {
+		ok = *(const volatile uint32_t*)(page + i) == 0xFFFFFFFF;
+	}
+	return ok;
+}
+
+int FlashProgram(const uint8_t* at, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	int ok = 1;
+	FlashUnlock();
+	FLASH->CR |= FLASH_CR_PG;
+	for( size_t i = 0; ok && i < size; i += 2 ) {
+		const uint16_t v = bytes[i] | (bytes[i + 1] << 8);
+		*(volatile uint16_t*)(at + i) = v;
+		ok = FlashDone() && *(const volatile uint16_t*)(at + i) == v;
+	}
+	FLASH->CR &= ~FLASH_CR_PG;
+	FLASH->CR |= FLASH_CR_LOCK;
+	return ok;
+}
@@ -0,0 +1,26 @@
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The spare pages at the end of the internal flash, after the firmware
+ * image. Pages are erased to 0xFF and programmed a halfword at a time.
+ * The CPU stalls on flash reads while a page is erased (20 ms) or a
+ * halfword programmed, the step ISR with it, so the motors must stand
+ * still meanwhile.
+ */
+#define FLASH_PAGE_SIZE 1024
+#ifndef FLASH_SPARE_PAGES
+#define FLASH_SPARE_PAGES 8 // the job cache (job.h)
+#endif
+
+// NULL when the firmware image reaches into the spare pages
+const uint8_t* FlashSpare(void);
+// return 0 when the flash does not read back as erased or programmed
+int FlashErase(const uint8_t* page);
+// at and size even, the halfwords at must be erased
+int FlashProgram(const uint8_t* at, const void* data, size_t size);
+
+#endif // _FLASH_H
@@ -3,6 +3,11 @@
 #include "motor.h"
 #include "gerber.h"
 #include "laser.h"
+#include "segment.h"
+#include "region.h"
+#include "coverage.h"
+#include "macro.h"
+#include "arena.h"
 
 #define HERE() //(chp, "here %d\r\n", __LINE__)
 
@@ -26,10 +31,69 @@ typedef struct ApertureO {
 	unsigned w,h;
 } ApertureO;
 
+typedef struct ApertureM {
+	Aperture a;
+	SegmentPath path; // the fill, trimmed
+	int sx, sy; // where it starts from the flash position
+} ApertureM;
+
+static int GerberFillRegion(GerberContext* ctx, Region* r);
+
+// steps per unit of the file, for macro and step and repeat sizes
+static float GerberUnitSteps(const GerberContext* ctx) {
+	return (ctx->is_mm ? 100.0f : 2540.0f) / ctx->step_accuracy;
+}
+
+static void GerberScaleSet(GerberScale* s, unsigned fraction, unsigned is_mm, unsigned step_accuracy) {
+	s->unit = is_mm ? 10000000 : 254000000;
+	for( unsigned i = 0; i < fraction && i < 6; ++i ) {
+		s->unit /= 10;
+	}
+	s->step = step_accuracy * 100000;
+	s->shift = 0;
+	while( (((uint64_t)s->unit << (s->shift + 1)) + s->step - 1) / s->step < 0x80000000u ) {
+		++s->shift;
+	}
+	s->mul = (((uint64_t)s->unit << s->shift) + s->step / 2) / s->step;
+}
+
+/*
+ * 32x32 bit multiplies only, coordinates are within 2^31 file units. The
+ * product with the reciprocal is off by one step at most next to the
+ * halves of a step, the exact remainder tells which way.
+ */
+static int GerberScaleApply(const GerberScale* s, long long in) {
+	const uint32_t v = in < 0 ? (uint32_t)-in : (uint32_t)in;
+	uint32_t steps = (uint32_t)(((uint64_t)v * s->mul + (1ull << (s->shift - 1))) >> s->shift);
+	// in [0, 2 * step) when steps is v * unit / step rounded
+	const int64_t rem = 2 * ((int64_t)((uint64_t)v * s->unit) - (int64_t)((uint64_t)steps * s->step)) + s->step;
+	if( rem < 0 ) {
+		--steps;
+	} else if( rem >= 2 * (int64_t)s->step ) {
+		++steps;
+	}
+	return in < 0 ? -(int)steps : (int)steps;
+}
+
+/*
+ * Called when the format, the unit or the step change. The position in
+ * file units starts again from the one in steps.
+ */
+static void GerberScaleUpdate(GerberContext* ctx) {
+	GerberScaleSet(&ctx->scale_x, ctx->coords_x_fraq, ctx->is_mm, ctx->step_accuracy);
+	GerberScaleSet(&ctx->scale_y, ctx->coords_y_fraq, ctx->is_mm, ctx->step_accuracy);
+	ctx->fx = (long long)ctx->x * ctx->scale_x.step / ctx->scale_x.unit;
+	ctx->fy = (long long)ctx->y * ctx->scale_y.step / ctx->scale_y.unit;
+}
+
+/*
+ * Incremental coordinates are added up in file units and the sum is
+ * converted, so the sub-step remainders never drift.
+ */
 static int GerberInterpretCoords(GerberContext *ctx, long long in, long long is_x) {
-	// TODO use ctx->coords_x_fraq and ctx->coords_y_fraq
-	(void)is_x;
-	return in / (1000* ctx->step_accuracy);
+	long long* pos = is_x ? &ctx->fx : &ctx->fy;
+	*pos = ctx->is_absolute_coords ? in : *pos + in;
+	return GerberScaleApply(is_x ? &ctx->scale_x : &ctx->scale_y, *pos);
 }
 
 static void ApertureCFlash(GerberContext *ctx, ApertureC *a, int xpos, int ypos) {
@@ -69,6 +133,12 @@ static void ApertureCFlash(GerberContext *ctx, ApertureC *a, int xpos, int ypos)
 	}
 }
 
+/*
+ * Hatch of a stroke as one zig-zag polyline with the laser on: a pass of
+ * (xlen, ylen) from every offset on the line from (x1, y1) to (x2, y2),
+ * the first one straight and every other one running across from the
+ * offset before on the way, so there is no move between the passes.
+ */
 static void FillRectangle(int x1, int y1, int x2, int y2, int xlen, int ylen) {
 	const int deltaX = abs(x2 - x1);
 	const int deltaY = abs(y2 - y1);
@@ -76,50 +146,161 @@ static void FillRectangle(int x1, int y1, int x2, int y2, int xlen, int ylen) {
 	const int signY = y1 < y2 ? 1 : -1;
 	
 	int error = deltaX - deltaY;
-	int reverse = 0;
+	int reverse = 1;
 	
 	//chprintf(chp, "(%d,%d) to (%d,%d) %d %d\r\n", x1, y1, x2, y2, xlen, ylen);
 	
 	MoveTo(x1, y1, 1);
 	LaserEnable();
+	MoveTo(x1 + xlen, y1 + ylen, 0);
 	while(x1 != x2 || y1 != y2) {
-		if( reverse ) {
-			MoveTo(x1, y1, 0);
-		} else {
-			MoveTo(x1 + xlen, y1 + ylen, 0);
-		}
-		reverse = !reverse;
 		const int error2 = error * 2;
-		int adj_x = 0;
-		int adj_y = 0;
-
 		if(error2 > -deltaY) {
 			error -= deltaY;
 			x1 += signX;
-			adj_x = signX;
 		}
 		if(error2 < deltaX) {
 			error += deltaX;
 			y1 += signY;
-			adj_y = signY;
 		}
-		// ajust few pixels
-		if( adj_x || adj_y ) {
-			MoveToRelative(adj_x, adj_y, 0);
-		}
-	}
-	// final line
-	if( deltaX > 1 || deltaY > 1 ) {
 		if( reverse ) {
 			MoveTo(x1, y1, 0);
 		} else {
 			MoveTo(x1 + xlen, y1 + ylen, 0);
 		}
+		reverse = !reverse;
 	}
 
 	LaserDisable();
 }
 
+/*
+ * Convex apertures swept along a stroke, or flashed as a stroke of length
+ * zero, are filled with hatch lines along the stroke one step apart. The
+ * lines run in alternating directions with the laser kept on, a convex
+ * shape holds the short moves between their ends.
+ */
+typedef struct HatchShape {
+	float w, h; // half sizes in steps, inset by the tool radius
+	int round; // obround: semicircles on the short sides
+} HatchShape;
+
+// the part [*a, *b] of the line s * u + t * n within |x| <= w, |y| <= h
+static int HatchSpanBox(float w, float h, float ux, float uy, float t, float* a, float* b) {
+	const float nx = -uy, ny = ux;
+	float lo = -1e9f, hi = 1e9f;
+	const float axis[2][3] = { { ux, t * nx, w }, { uy, t * ny, h } };
+	for( int i = 0; i < 2; ++i ) {
+		const float u = axis[i][0], c = axis[i][1], half = axis[i][2];
+		if( fabsf(u) < 1e-6f ) {
+			if( fabsf(c) > half + 1e-3f ) {
+				return 0;
+			}
+			continue;
+		}
+		float s0 = (-half - c) / u, s1 = (half - c) / u;
+		if( s0 > s1 ) {
+			const float tmp = s0; s0 = s1; s1 = tmp;
+		}
+		lo = s0 > lo ? s0 : lo;
+		hi = s1 < hi ? s1 : hi;
+	}
+	*a = lo;
+	*b = hi;
+	return lo <= hi + 1e-3f;
+}
+
+static int HatchSpanCircle(float cx, float cy, float r, float ux, float uy, float t, float* a, float* b) {
+	const float off = t - (cx * -uy + cy * ux);
+	if( fabsf(off) > r ) {
+		return 0;
+	}
+	const float along = cx * ux + cy * uy;
+	const float half = sqrtf(r * r - off * off);
+	*a = along - half;
+	*b = along + half;
+	return 1;
+}
+
+static int HatchSpan(const HatchShape* sh, float ux, float uy, float t, float* a, float* b) {
+	if( !sh->round ) {
+		return HatchSpanBox(sh->w, sh->h, ux, uy, t, a, b);
+	}
+	// the box between the centres of the semicircles and the two of them
+	const float r = sh->w < sh->h ? sh->w : sh->h;
+	const float ex = sh->w - r, ey = sh->h - r;
+	float lo = 1e9f, hi = -1e9f, sa, sb;
+	if( (ex > 0 || ey > 0) && HatchSpanBox(ex > 0 ? ex : r, ey > 0 ? ey : r, ux, uy, t, &sa, &sb) ) {
+		lo = sa;
+		hi = sb;
+	}
+	for( int side = -1; side <= 1; side += 2 ) {
+		if( HatchSpanCircle(side * ex, side * ey, r, ux, uy, t, &sa, &sb) ) {
+			lo = sa < lo ? sa : lo;
+			hi = sb > hi ? sb : hi;
+		}
+	}
+	*a = lo;
+	*b = hi;
+	return lo <= hi;
+}
+
+// half the width of the shape across the direction u
+static float HatchReach(const HatchShape* sh, float ux, float uy) {
+	const float nx = fabsf(uy), ny = fabsf(ux);
+	if( !sh->round ) {
+		return sh->w * nx + sh->h * ny;
+	}
+	const float r = sh->w < sh->h ? sh->w : sh->h;
+	return r + (sh->w - r) * nx + (sh->h - r) * ny;
+}
+
+static void FillHatch(const HatchShape* sh, int x0, int y0, int x1, int y1) {
+	const float dx = x1 - x0, dy = y1 - y0;
+	const float length = sqrtf(dx * dx + dy * dy);
+	// a flash is hatched along its longer side
+	const float ux = length > 0 ? dx / length : sh->w >= sh->h ? 1 : 0;
+	const float uy = length > 0 ? dy / length : sh->w >= sh->h ? 0 : 1;
+	const float reach = HatchReach(sh, ux, uy);
+	const int n = (int)ceilf(2 * reach) + 1;
+
+	int started = 0, reverse = 0;
+	for( int k = 0; k < n; ++k ) {
+		const float t = n > 1 ? -reach + 2 * reach * k / (n - 1) : 0;
+		float a, b;
+		if( !HatchSpan(sh, ux, uy, t, &a, &b) ) {
+			continue;
+		}
+		b += length;
+		const float sa = reverse ? b : a, sb = reverse ? a : b;
+		// rounded the same way on both sides, lines half a step off the grid stay one step apart
+		const int xa = x0 + (int)floorf(sa * ux - t * uy + 0.5f), ya = y0 + (int)floorf(sa * uy + t * ux + 0.5f);
+		const int xb = x0 + (int)floorf(sb * ux - t * uy + 0.5f), yb = y0 + (int)floorf(sb * uy + t * ux + 0.5f);
+		if( started ) {
+			MoveTo(xa, ya, 0);
+		} else {
+			MoveTo(xa, ya, 1);
+			LaserEnable();
+			started = 1;
+		}
+		MoveTo(xb, yb, 0);
+		reverse = !reverse;
+	}
+	if( started ) {
+		LaserDisable();
+	}
+}
+
+static void HatchShapeInset(GerberContext* ctx, HatchShape* sh, unsigned w, unsigned h, int round) {
+	const unsigned half_accuracy = 2 * ctx->step_accuracy;
+	const float tool = (float)((ctx->tool_width + half_accuracy - 1) / half_accuracy);
+	sh->w = (float)w / half_accuracy - tool;
+	sh->h = (float)h / half_accuracy - tool;
+	sh->w = sh->w > 0 ? sh->w : 0;
+	sh->h = sh->h > 0 ? sh->h : 0;
+	sh->round = round;
+}
+
 static void ApertureCLine(GerberContext *ctx, ApertureC *a, int x, int y) {
 	
 	const unsigned half_accuracy = 2 * ctx->step_accuracy;
@@ -140,9 +321,10 @@ static void ApertureCLine(GerberContext *ctx, ApertureC *a, int x, int y) {
 	const int deltay = (y - ctx->y);
 	const float L = sqrtf(deltax*deltax + deltay*deltay);
 
-	const int A_x_pos = round(radix_in_steps * deltax / L);
+	// the passes along the stroke are walked across it
+	const int A_x_pos = round(-radix_in_steps * deltay / L);
 	const int B_x_pos = -A_x_pos;
-	const int A_y_pos = round(radix_in_steps * deltay / L);
+	const int A_y_pos = round(radix_in_steps * deltax / L);
 	const int B_y_pos = -A_y_pos;
 
 	FillRectangle(ctx->x + A_x_pos, ctx->y + A_y_pos, ctx->x + B_x_pos, ctx->y + B_y_pos, deltax, deltay);
@@ -152,17 +334,21 @@ static void ApertureCLine(GerberContext *ctx, ApertureC *a, int x, int y) {
 	}
 }
 
-static Aperture* ApertureCNew(unsigned code, const char* data) {
-	ApertureC* a = (ApertureC*)malloc(sizeof(ApertureC));
+// sizes in file units, mm millimetres each
+static Aperture* ApertureCNew(unsigned code, const char* data, float mm) {
+	ApertureC* a = (ApertureC*)ArenaMalloc(sizeof(ApertureC));
+	if( a == NULL ) {
+		return NULL;
+	}
 	a->a.code = code;
 	a->a.flash = (ApertureFlash)ApertureCFlash;
 	a->a.line = (ApertureLineTo)ApertureCLine;
-	a->a.dtor = free;
+	a->a.dtor = ArenaFree;
 	a->a.next = NULL;
 	a->a.name = "circle";
 	float radix;
 	if( sscanf(data, "%f", &radix) ) {
-		a->radix = radix * 50; // (100/2)
+		a->radix = radix * mm * 50; // (100/2)
 	} else {
 		a->radix = 0;
 	}
@@ -214,18 +400,27 @@ static void ApertureRFlash(GerberContext *ctx, ApertureR *a, int xpos, int ypos)
 	LaserDisable();
 }
 
-static Aperture* ApertureRNew(unsigned code, const char* data) {
-	ApertureR* a = (ApertureR*)malloc(sizeof(ApertureR));
+static void ApertureRLine(GerberContext *ctx, ApertureR *a, int x, int y) {
+	HatchShape sh;
+	HatchShapeInset(ctx, &sh, a->w, a->h, 0);
+	FillHatch(&sh, ctx->x, ctx->y, x, y);
+}
+
+static Aperture* ApertureRNew(unsigned code, const char* data, float mm) {
+	ApertureR* a = (ApertureR*)ArenaMalloc(sizeof(ApertureR));
+	if( a == NULL ) {
+		return NULL;
+	}
 	a->a.code = code;
 	a->a.flash = (ApertureFlash)ApertureRFlash;
-	a->a.line = NULL;
-	a->a.dtor = free;
+	a->a.line = (ApertureLineTo)ApertureRLine;
+	a->a.dtor = ArenaFree;
 	a->a.next = NULL;
 	a->a.name = "rectangle";
 	float w,h;
 	if( sscanf(data, "%fX%f", &w, &h) == 2 ) {
-		a->w = w *100;
-		a->h = h *100;
+		a->w = w * mm * 100;
+		a->h = h * mm * 100;
 	} else {
 		a->w = 0;
 		a->h = 0;
@@ -233,25 +428,33 @@ static Aperture* ApertureRNew(unsigned code, const char* data) {
 	return (Aperture*)a;
 }
 
-static void ApertureOFlash(GerberContext *ctx, ApertureC *a, int xpos, int ypos) {
-	(void)ctx;
-	(void)a;
-	(void)xpos;
-	(void)ypos;
+static void ApertureOFlash(GerberContext *ctx, ApertureO *a, int xpos, int ypos) {
+	HatchShape sh;
+	HatchShapeInset(ctx, &sh, a->w, a->h, 1);
+	FillHatch(&sh, xpos, ypos, xpos, ypos);
+}
+
+static void ApertureOLine(GerberContext *ctx, ApertureO *a, int x, int y) {
+	HatchShape sh;
+	HatchShapeInset(ctx, &sh, a->w, a->h, 1);
+	FillHatch(&sh, ctx->x, ctx->y, x, y);
 }
 
-static Aperture* ApertureONew(unsigned code, const char* data) {
-	ApertureO* a = (ApertureO*)malloc(sizeof(ApertureO));
+static Aperture* ApertureONew(unsigned code, const char* data, float mm) {
+	ApertureO* a = (ApertureO*)ArenaMalloc(sizeof(ApertureO));
+	if( a == NULL ) {
+		return NULL;
+	}
 	a->a.code = code;
 	a->a.flash = (ApertureFlash)ApertureOFlash;
-	a->a.line = NULL;
-	a->a.dtor = free;
+	a->a.line = (ApertureLineTo)ApertureOLine;
+	a->a.dtor = ArenaFree;
 	a->a.next = NULL;
 	a->a.name = "obround";
 	float w,h;
 	if( sscanf(data, "%fX%f", &w, &h) == 2 ) {
-		a->w = w *100;
-		a->h = h *100;
+		a->w = w * mm * 100;
+		a->h = h * mm * 100;
 	} else {
 		a->w = 0;
 		a->h = 0;
@@ -259,8 +462,170 @@ static Aperture* ApertureONew(unsigned code, const char* data) {
 	return (Aperture*)a;
 }
 
+/*
+ * Moves are recorded into a path instead of being made, for replaying
+ * them later. The position and the coverage are put back when it stops.
+ */
+typedef struct GerberRecording {
+	SegmentSink sink;
+	void* sink_arg;
+	Coverage* coverage;
+	int x, y;
+} GerberRecording;
+
+static void GerberRecordStart(GerberRecording* r, SegmentPath* path) {
+	SegmentSinkGet(&r->sink, &r->sink_arg);
+	r->coverage = CoverageActive();
+	r->x = CUR_X;
+	r->y = CUR_Y;
+	CoverageSet(NULL);
+	SegmentSinkSet(SegmentPathPush, path);
+}
+
+static void GerberRecordStop(GerberRecording* r) {
+	SegmentSinkSet(r->sink, r->sink_arg);
+	CoverageSet(r->coverage);
+	CUR_X = r->x;
+	CUR_Y = r->y;
+}
+
+/*
+ * Drops the laser-off moves before the first burn and after the last one.
+ * (sx, sy) and (ex, ey) are where the path then starts and ends, from
+ * where the recording started.
+ */
+static void GerberPathTrim(SegmentPath* p, int* sx, int* sy, int* ex, int* ey) {
+	unsigned first = 0, last = p->count;
+	*sx = *sy = 0;
+	for( ; first < last && !(p->items[first].flags & SEGMENT_LASER); ++first ) {
+		*sx += p->items[first].dx;
+		*sy += p->items[first].dy;
+	}
+	while( last > first && !(p->items[last - 1].flags & SEGMENT_LASER) ) {
+		--last;
+	}
+	p->count = last - first;
+	if( first && p->count ) {
+		memmove(p->items, p->items + first, p->count * sizeof(Segment));
+	}
+	*ex = *sx;
+	*ey = *sy;
+	for( unsigned i = 0; i < p->count; ++i ) {
+		*ex += p->items[i].dx;
+		*ey += p->items[i].dy;
+	}
+}
+
+// runs a trimmed path from the head position, backwards from its end if reverse
+static void GerberReplay(const SegmentPath* p, int reverse) {
+	int laser = 0;
+	for( unsigned i = 0; i < p->count; ++i ) {
+		const Segment* s = &p->items[reverse ? p->count - 1 - i : i];
+		const int on = (s->flags & SEGMENT_LASER) != 0;
+		if( on != laser ) {
+			if( on ) {
+				LaserEnable();
+			} else {
+				LaserDisable();
+			}
+			laser = on;
+		}
+		MoveToRelative(reverse ? -s->dx : s->dx, reverse ? -s->dy : s->dy, (s->flags & SEGMENT_RAPID) != 0);
+	}
+	if( laser ) {
+		LaserDisable();
+	}
+}
+
+static void ApertureMFlash(GerberContext *ctx, ApertureM *a, int xpos, int ypos) {
+	(void)ctx;
+	MoveTo(xpos + a->sx, ypos + a->sy, 1);
+	GerberReplay(&a->path, 0);
+}
+
+static void ApertureMFree(void* p) {
+	ApertureM* a = (ApertureM*)p;
+	ArenaFree(a->path.items);
+	ArenaFree(a);
+}
+
+// the recorded fill cut to its final size, in place on top of the arena
+static void ApertureMKeep(ApertureM* a) {
+	SegmentPath* p = &a->path;
+	if( p->count == 0 ) {
+		SegmentPathFree(p);
+		return;
+	}
+	Segment* items = (Segment*)ArenaResize(p->items, p->capacity * sizeof(Segment), p->count * sizeof(Segment));
+	if( items ) {
+		p->items = items;
+		p->capacity = p->count;
+	}
+}
+
+static Aperture* ApertureMNew(GerberContext* ctx, unsigned code, const Macro* m, char* data) {
+	ApertureM* a = (ApertureM*)ArenaMalloc(sizeof(ApertureM));
+	if( a == NULL ) {
+		chprintf(chp, "no memory for macro %s\r\n", m->name);
+		return NULL;
+	}
+	memset(a, 0, sizeof(*a));
+	a->a.code = code;
+	a->a.flash = (ApertureFlash)ApertureMFlash;
+	a->a.line = NULL;
+	a->a.dtor = ApertureMFree;
+	a->a.next = NULL;
+	a->a.name = m->name;
+
+	// parameters are separated by 'X', which strtof would take for hex
+	float params[MACRO_VARS - 1];
+	unsigned count = 0;
+	for( char* p = data; *p; ++p ) {
+		if( *p == 'X' || *p == 'x' ) {
+			*p = ' ';
+		}
+	}
+	for( char* p = data; count < MACRO_VARS - 1; ) {
+		char* end;
+		const float v = strtof(p, &end);
+		if( end == p ) {
+			break;
+		}
+		params[count++] = v;
+		p = end;
+	}
+
+	Region* r = RegionNew();
+	if( r == NULL ) {
+		chprintf(chp, "no memory for macro %s, the aperture is left empty\r\n", m->name);
+		ApertureMKeep(a);
+		return (Aperture*)a;
+	}
+	if( !MacroDraw(m, params, count, GerberUnitSteps(ctx), r) ) {
+		chprintf(chp, "macro %s: unsupported primitive\r\n", m->name);
+	}
+	// the fill is recorded once around the origin and replayed on every flash
+	GerberRecording recording;
+	GerberRecordStart(&recording, &a->path);
+	CUR_X = CUR_Y = 0;
+	const int ok = GerberFillRegion(ctx, r);
+	GerberRecordStop(&recording);
+	RegionFree(r);
+	int ex, ey;
+	GerberPathTrim(&a->path, &a->sx, &a->sy, &ex, &ey);
+	if( !ok || a->path.failed ) {
+		chprintf(chp, "macro aperture is too large\r\n");
+		a->path.count = 0;
+	}
+	ApertureMKeep(a);
+	return (Aperture*)a;
+}
+
 GerberContext* GerberContextNew(void) {
-	GerberContext *ctx = (GerberContext*)malloc(sizeof(GerberContext));
+	GerberContext *ctx = (GerberContext*)ArenaMalloc(sizeof(GerberContext));
+	if( ctx == NULL ) {
+		return NULL;
+	}
 	ctx->apertures = NULL;
 	ctx->current_aperture = NULL;
 	ctx->is_absolute_coords = 1;
@@ -270,22 +635,73 @@ GerberContext* GerberContextNew(void) {
 	ctx->coords_x_fraq = 5;
 	ctx->coords_y_fraq = 5;
 	ctx->step_accuracy = 4;
+	GerberScaleUpdate(ctx);
 	
 	ctx->is_linear_interpolation = 1;
 	ctx->is_single_quadrant = 1;
 	ctx->is_clockwise = 1;
 	ctx->tool_width = TOOL_W;
 	ctx->line_counter = 0;
+	ctx->region = NULL;
+	ctx->region_skipped = 0;
+	ctx->macros = NULL;
+	ctx->macro = NULL;
+	ctx->macro_skipped = 0;
+	ctx->repeat = NULL;
 	return ctx;
 }
 
+static void GerberRepeatEnd(GerberContext* ctx, int run);
+
 void GerberContextFree(GerberContext* ctx) {
+	if( ctx->repeat ) {
+		GerberRepeatEnd(ctx, 0);
+	}
+	MotorGroupWait();
 	while( ctx->apertures ) {
 		Aperture *next = (Aperture *)ctx->apertures->next;
 		ctx->apertures->dtor(ctx->apertures);
 		ctx->apertures = next;
 	}
-	free(ctx);
+	if( ctx->region ) {
+		RegionFree(ctx->region);
+	}
+	while( ctx->macros ) {
+		Macro* next = ctx->macros->next;
+		MacroFree(ctx->macros);
+		ctx->macros = next;
+	}
+	ArenaFree(ctx);
+}
+
+// the macro an %ADD names, with its parameters
+static const Macro* GerberContextMacro(GerberContext* ctx, char *data, char** params) {
+	char* name = data;
+	while( *name >= '0' && *name <= '9' ) {
+		++name;
+	}
+	const size_t length = strcspn(name, ",");
+	for( Macro* m = ctx->macros; m; m = m->next ) {
+		if( strlen(m->name) == length && strncmp(m->name, name, length) == 0 ) {
+			*params = name[length] ? name + length + 1 : name + length;
+			return m;
+		}
+	}
+	return NULL;
+}
+
+static void GerberContextAppendAperture(GerberContext* ctx, Aperture* a) {
+	Aperture *prev = NULL;
+	Aperture *current = ctx->apertures;
+	while( current != NULL ) {
+		prev = current;
+		current = (Aperture*)current->next;
+	}
+	if( prev == NULL ) {
+		ctx->apertures = a;
+	} else {
+		prev->next = a;
+	}
 }
 
 static void GerberContextAddAperture(GerberContext* ctx, char *data) {
@@ -293,45 +709,81 @@ static void GerberContextAddAperture(GerberContext* ctx, char *data) {
 	char buf[20];
 	char type;
 
+	char* params;
+	const Macro* m = GerberContextMacro(ctx, data, &params);
+	Aperture* a;
+	if( m ) {
+		a = ApertureMNew(ctx, strtoul(data, NULL, 10), m, params);
+		if( a ) {
+			GerberContextAppendAperture(ctx, a);
+		}
+		return;
+	}
+
 	int ret = sscanf(data, "%d%c,%s", &code, &type, buf);
 	if( ret != 3 ) {
 		chprintf(chp, "Failed to parse aperture: %s", data);
 		return;
 	}
 
-	Aperture* a = NULL;
+	const float mm = ctx->is_mm ? 1.0f : 25.4f;
 	switch( type ) {
 	case 'C':
-		a = ApertureCNew(code, buf);
+		a = ApertureCNew(code, buf, mm);
 		break;
 		
 	case 'R':
-		a = ApertureRNew(code, buf);
+		a = ApertureRNew(code, buf, mm);
 		break;
 
 	case 'O':
-		a = ApertureONew(code, buf);
+		a = ApertureONew(code, buf, mm);
 		break;
 
 	default:
 		chprintf(chp, "Failed to add unknown aperture: %c", type);
 		return;
 	}
-	
-	Aperture *prev = NULL;
-	Aperture *current = ctx->apertures;
-	while( current != NULL ) {
-		prev = current;
-		current = (Aperture*)current->next;
+	if( a == NULL ) {
+		chprintf(chp, "no memory for aperture D%u\r\n", code);
+		return;
 	}
-	if( prev == NULL ) {
-		ctx->apertures = a;
-	} else {
-		prev->next = a;
+	GerberContextAppendAperture(ctx, a);
+}
+
+static int GerberFillRegion(GerberContext* ctx, Region* r) {
+	// tool radius rounded up as the aperture fills do, one tool width between scanlines
+	const unsigned half_accuracy = 2 * ctx->step_accuracy;
+	const int tool = (ctx->tool_width + half_accuracy - 1) / half_accuracy;
+	return RegionFill(r, tool, ctx->tool_width / ctx->step_accuracy);
+}
+
+static void GerberRegionEnd(GerberContext* ctx) {
+	if( !GerberFillRegion(ctx, ctx->region) ) {
+		chprintf(chp, "region is too large\r\n");
 	}
+	RegionFree(ctx->region);
+	ctx->region = NULL;
 }
 
 static void GerberExecuteD(GerberContext* ctx, unsigned code, int x, int y) {
+	if( ctx->region_skipped ) {
+		ctx->x = x;
+		ctx->y = y;
+		return;
+	}
+	if( ctx->region ) {
+		if( code == 1 ) {
+			RegionLineTo(ctx->region, x, y);
+		} else if( code == 2 ) {
+			RegionMoveTo(ctx->region, x, y);
+		} else {
+			chprintf(chp, "D%02u is not allowed in a region\r\n", code);
+		}
+		ctx->x = x;
+		ctx->y = y;
+		return;
+	}
 	switch(code) {
 	case 1: //D1
 		if( ctx->current_aperture ) {
@@ -379,7 +831,139 @@ static void GerberLoadAperture(GerberContext* ctx, unsigned code) {
 	}
 }
 
+/*
+ * %SR step and repeat. The block is recorded once as it arrives and its
+ * path is run for every copy when the block ends.
+ */
+typedef struct GerberRepeat {
+	GerberRecording recording;
+	SegmentPath path;
+	unsigned nx, ny;
+	int dx, dy; // distance between the copies in steps
+} GerberRepeat;
+
+// what a silent move costs, the axes run together
+static int GerberTravel(int dx, int dy) {
+	dx = abs(dx);
+	dy = abs(dy);
+	return dx > dy ? dx : dy;
+}
+
+static void GerberRepeatEnd(GerberContext* ctx, int run) {
+	GerberRepeat* r = ctx->repeat;
+	ctx->repeat = NULL;
+	GerberRecordStop(&r->recording);
+	if( r->path.failed ) {
+		chprintf(chp, "step and repeat block is too large\r\n");
+	}
+	int sx, sy, ex, ey;
+	GerberPathTrim(&r->path, &sx, &sy, &ex, &ey);
+
+	// rows in alternating directions, each copy run from the nearer end
+	const int x0 = CUR_X, y0 = CUR_Y;
+	for( unsigned j = 0; run && r->path.count && j < r->ny; ++j ) {
+		for( unsigned k = 0; k < r->nx; ++k ) {
+			const unsigned i = j % 2 ? r->nx - 1 - k : k;
+			const int ox = x0 + (int)i * r->dx, oy = y0 + (int)j * r->dy;
+			const int to_start = GerberTravel(ox + sx - CUR_X, oy + sy - CUR_Y);
+			const int to_end = GerberTravel(ox + ex - CUR_X, oy + ey - CUR_Y);
+			const int reverse = to_end < to_start;
+			MoveTo(ox + (reverse ? ex : sx), oy + (reverse ? ey : sy), 1);
+			GerberReplay(&r->path, reverse);
+		}
+	}
+	// the path was taken after the block, both give their room back on top of the arena
+	SegmentPathFree(&r->path);
+	ArenaRelease(r, sizeof(*r));
+}
+
+static void GerberRepeatStart(GerberContext* ctx, const char* data) {
+	if( ctx->repeat ) {
+		GerberRepeatEnd(ctx, 1);
+	}
+	unsigned nx, ny;
+	float i, j;
+	if( sscanf(data, "X%uY%uI%fJ%f", &nx, &ny, &i, &j) != 4 ) {
+		if( data[0] != '\0' ) {
+			chprintf(chp, "SR failed: %s\r\n", data);
+		}
+		return; // %SR* alone ends the block
+	}
+	if( nx * ny <= 1 ) {
+		return;
+	}
+	GerberRepeat* r = (GerberRepeat*)ArenaMalloc(sizeof(GerberRepeat));
+	if( r == NULL ) {
+		chprintf(chp, "step and repeat block is too large\r\n");
+		return;
+	}
+	memset(r, 0, sizeof(*r));
+	r->nx = nx;
+	r->ny = ny;
+	r->dx = lroundf(i * GerberUnitSteps(ctx));
+	r->dy = lroundf(j * GerberUnitSteps(ctx));
+	GerberRecordStart(&r->recording, &r->path);
+	ctx->repeat = r;
+}
+
+/*
+ * Statements of an %AM definition, which ends with the block at a '%'.
+ * They are taken whole, a comment may come split into words.
+ */
+static void GerberMacroDefine(GerberContext* ctx, int argc, char* argv[]) {
+	char* last = argv[argc - 1];
+	const size_t length = strlen(last);
+	const int end = length && last[length - 1] == '%';
+	if( end ) {
+		last[length - 1] = '\0';
+	}
+	char* text = argv[0];
+	if( ctx->macro == NULL && !ctx->macro_skipped ) {
+		text += 3;
+		char* star = strchr(text, '*');
+		if( star ) {
+			*star++ = '\0';
+		} else {
+			star = text + strlen(text);
+		}
+		Macro* m = MacroNew(text);
+		if( m ) {
+			m->next = ctx->macros;
+			ctx->macros = m;
+			ctx->macro = m;
+		} else {
+			chprintf(chp, "no memory for macro %s\r\n", text);
+			ctx->macro_skipped = 1;
+		}
+		text = star;
+	}
+	if( ctx->macro_skipped ) {
+		text += strlen(text);
+	}
+	while( *text ) {
+		char* star = strchr(text, '*');
+		if( star ) {
+			*star = '\0';
+		}
+		if( *text && !MacroAdd(ctx->macro, text) ) {
+			chprintf(chp, "macro %s: bad statement: %s\r\n", ctx->macro->name, text);
+		}
+		if( star == NULL ) {
+			break;
+		}
+		text = star + 1;
+	}
+	if( end ) {
+		ctx->macro = NULL;
+		ctx->macro_skipped = 0;
+	}
+}
+
 void GerberAcceptCommand(GerberContext* ctx, int argc, char* argv[]) {
+	if( ctx->macro || ctx->macro_skipped || strncmp(argv[0], "%AM", 3) == 0 ) {
+		chprintf(chp, "executing line: %u\r\n", ++ctx->line_counter);
+		return GerberMacroDefine(ctx, argc, argv);
+	}
 	for( int i = 0; argv[0][i] != '\0'; ++i ) {
 		if( argv[0][i] == '*' ) {
 			// set command end
@@ -393,22 +977,47 @@ void GerberAcceptCommand(GerberContext* ctx, int argc, char* argv[]) {
 		// ignore comments
 	} else if ( strncmp(argv[0], "%ADD", 4) == 0 ) {
 		GerberContextAddAperture(ctx, argv[0] + 4);
+	} else if ( strncmp(argv[0], "%SR", 3) == 0 ) {
+		GerberRepeatStart(ctx, argv[0] + 3);
 	} else if ( strncmp(argv[0], "%LPD", 4) == 0 ) {
 		// dark polarity, never mind
 	} else if ( strncmp(argv[0], "%MOMM", 5) == 0 ) {
 		ctx->is_mm = 1;
-	} else if ( strncmp(argv[0], "%FSLA", 5) == 0 ) {
+		GerberScaleUpdate(ctx);
+	} else if ( strncmp(argv[0], "%MOIN", 5) == 0 ) {
+		ctx->is_mm = 0;
+		GerberScaleUpdate(ctx);
+	} else if ( strncmp(argv[0], "%FSLA", 5) == 0 || strncmp(argv[0], "%FSLI", 5) == 0 ) {
 		unsigned x, y;
 		if( sscanf(argv[0] + 5, "X%uY%u", &x, &y) == 2 ) {
 			ctx->coords_x_fraq = x % 10;
 			ctx->coords_y_fraq = y % 10;
+			ctx->is_absolute_coords = argv[0][4] == 'A';
+			GerberScaleUpdate(ctx);
 		} else {
-			chprintf(chp, "FSLA failed: %s\r\n", argv[0] + 5);
+			chprintf(chp, "FS failed: %s\r\n", argv[0] + 5);
 		}
+	} else if ( strncmp(argv[0], "G36", 3) == 0 ) {
+		if( ctx->region == NULL && !ctx->region_skipped ) {
+			ctx->region = RegionNew();
+			if( ctx->region ) {
+				RegionMoveTo(ctx->region, ctx->x, ctx->y);
+			} else {
+				chprintf(chp, "no memory for the region, it is skipped\r\n");
+				ctx->region_skipped = 1;
+			}
+		}
+	} else if ( strncmp(argv[0], "G37", 3) == 0 ) {
+		if( ctx->region ) {
+			GerberRegionEnd(ctx);
+		}
+		ctx->region_skipped = 0;
 	} else if ( strncmp(argv[0], "G70", 3) == 0 ) {
 		ctx->is_mm = 0;
+		GerberScaleUpdate(ctx);
 	} else if ( strncmp(argv[0], "G71", 3) == 0 ) {
 		ctx->is_mm = 1;
+		GerberScaleUpdate(ctx);
 	} else if ( strncmp(argv[0], "G74", 3) == 0 ) {
 		ctx->is_single_quadrant = 1;
 	} else if ( strncmp(argv[0], "G75", 3) == 0 ) {
@@ -425,6 +1034,9 @@ void GerberAcceptCommand(GerberContext* ctx, int argc, char* argv[]) {
 	} else if ( strncmp(argv[0], "G03", 3) == 0 ) {
 		ctx->is_clockwise = 0;
 	} else if ( strncmp(argv[0], "M02", 3) == 0 ) {
+		if( ctx->repeat ) {
+			GerberRepeatEnd(ctx, 1);
+		}
 		MoveTo(0,0,1); //return to the origin
 	} else {
 		long long x = 0, y = 0;
@@ -454,27 +1066,63 @@ void MoveTo(const int xpos, const int ypos, int silent) {
 }
 
 
+static void MoveToRelativeEmit(const int xpos, const int ypos, int silent);
+
+/*
+ * A burning move with a coverage set: the stretches over copper that is
+ * burned already are crossed with the laser off.
+ */
+static void MoveCovered(Coverage* c, const int dx, const int dy) {
+	const int x = CUR_X;
+	const int y = CUR_Y;
+	const int n = CoveragePoints(dx, dy);
+	int from = 0;
+	while( from < n ) {
+		int to, px, py;
+		const int burn = CoverageClip(c, x, y, dx, dy, from, &to);
+		CoveragePoint(x, y, dx, dy, to, &px, &py);
+		if( !burn ) {
+			LaserDisable();
+		}
+		MoveToRelativeEmit(px - CUR_X, py - CUR_Y, !burn);
+		if( !burn ) {
+			LaserEnable();
+		}
+		from = to;
+	}
+	CoverageMark(c, x, y, dx, dy);
+}
+
+// made by the next MotorGroupWait at the latest, merged with the moves after it
 void MoveToRelative(const int xpos, const int ypos, int silent) {
+	Coverage* coverage = CoverageActive();
+	if( coverage && !silent && LaserEnabled() && (xpos || ypos) ) {
+		MoveCovered(coverage, xpos, ypos);
+		return;
+	}
+	MoveToRelativeEmit(xpos, ypos, silent);
+}
+
+void MoveToRelativeStart(const int xpos, const int ypos, int silent) {
+	MoveToRelative(xpos, ypos, silent);
+	MotorGroupFlush();
+}
+
+static void MoveToRelativeEmit(const int xpos, const int ypos, int silent) {
 	int x_delta = xpos;
 	int y_delta = ypos;
 	//chprintf(chp, "CUR_X=%d CUR_Y=%d deltax=%d deltay=%d\r\n", CUR_X, CUR_Y, x_delta, y_delta);
-	
-	if( x_delta >= 0 ) {
-		MotorDriverSetDirection(MOTOR_X, MOTOR_X_DIRECTION_PLUS);
-	} else {
-		MotorDriverSetDirection(MOTOR_X, MOTOR_X_DIRECTION_MINUS);
-		x_delta = - x_delta;
-	}
-	if( y_delta >= 0 ) {
-		MotorDriverSetDirection(MOTOR_Y, MOTOR_Y_DIRECTION_PLUS);
-	} else {
-		MotorDriverSetDirection(MOTOR_Y, MOTOR_Y_DIRECTION_MINUS);
-		y_delta = - y_delta;
+
+	if( SegmentSinkActive() ) {
+		if( x_delta || y_delta ) {
+			SegmentSinkMove(x_delta, y_delta, silent);
+			CUR_X += xpos;
+			CUR_Y += ypos;
+		}
+		return;
 	}
 	
-	if( x_delta || y_delta ) {
-		MotorGroupMakeSteps(x_delta, y_delta, silent);
-		CUR_X += xpos;
-		CUR_Y += ypos;
-	}
+	MotorGroupQueueSteps(x_delta, y_delta, silent);
+	CUR_X += xpos;
+	CUR_Y += ypos;
 }
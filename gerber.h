@@ -21,6 +21,18 @@ typedef struct Aperture {
 	const char* name;
 } Aperture;
 
+/*
+ * File coordinates to steps, rounded half away from zero: (value * mul)
+ * >> shift, mul the reciprocal of the step in file units as large as fits
+ * in 31 bits, corrected with the exact remainder of value * unit / step.
+ */
+typedef struct GerberScale {
+	uint32_t mul;
+	unsigned shift;
+	uint32_t unit; // one file unit and one step in 0.1 nm
+	uint32_t step;
+} GerberScale;
+
 typedef struct GerberContext {
 	Aperture* apertures;
 	Aperture* current_aperture;
@@ -30,22 +42,34 @@ typedef struct GerberContext {
 	int y;
 	unsigned coords_x_fraq;
 	unsigned coords_y_fraq;
+	GerberScale scale_x, scale_y; // from %FS, the unit and step_accuracy
+	long long fx, fy; // the position in file units, incremental coordinates add up here
 	unsigned step_accuracy; // 0.04 mm = 4
 	unsigned is_linear_interpolation;
 	unsigned is_single_quadrant;
 	unsigned is_clockwise;
 	unsigned tool_width; // 0.04mm = 4
 	unsigned line_counter;
+	struct Region* region; // between G36 and G37
+	unsigned region_skipped; // G36 got no memory, the contours up to G37 are dropped
+	struct Macro* macros;
+	struct Macro* macro; // being defined, until the block ends
+	unsigned macro_skipped; // %AM got no memory, the statements up to the block end are dropped
+	struct GerberRepeat* repeat; // %SR block being recorded
 } GerberContext;
 
 
 
+// NULL when there is no memory for it
 GerberContext* GerberContextNew(void);
 void GerberContextFree(GerberContext* ctx);
 
 void GerberAcceptCommand(GerberContext* ctx, int argc, char* argv[]);
+// queued (motor.h), MotorGroupWait makes the moves
 void MoveTo(const int x, const int y, int silent);
 void MoveToRelative(const int x, const int y, int silent);
+// starts the move and returns, MotorGroupWait ends it
+void MoveToRelativeStart(const int x, const int y, int silent);
 
 #endif // _GERBER_H
 
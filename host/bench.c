@@ -0,0 +1,476 @@
+/*
+ * Gerber throughput benchmark.
+ *
+ * Runs every layer given on the command line through the firmware Gerber
+ * interpreter twice: a dry pass (geometry only, motion completes at once)
+ * to time the parser, and a simulated pass where the step ISR is driven
+ * by the host timer to count steps and machine time. Results are written
+ * as JSON.
+ *
+ * The strokes section draws one stroke of every aperture kind at a few
+ * angles and reports the steps the fill takes per millimetre of stroke,
+ * and the moves the step timer is started for and the machine time when
+ * it is simulated.
+ *
+ * The coords section checks the coordinate conversion against exact
+ * rounding for every unit, number of decimals and a few step sizes, and
+ * times it against the 64 bit division it replaced.
+ */
+
+#include <time.h>
+#include <ch.h>
+#include <hal.h>
+#include <chprintf.h>
+
+#include "../segment.c"
+#include "../laser.c"
+#include "../perf.c"
+#include "../motor.c"
+#include "../gerber.c"
+#include "../region.c"
+#include "../coverage.c"
+#include "../macro.c"
+#include "../arena.c"
+
+#define BENCH_LINE_MAX 256
+#define BENCH_LOOKUP_ROUNDS 20000
+#define BENCH_STROKE_MM 10
+#define BENCH_COORDS 4096 // values per format
+#define BENCH_COORD_ROUNDS 256
+#define BENCH_ARENA_SIZE 4096 // as gerber_start on the firmware
+
+static const GPTConfig gpt_motor = {
+	1000000,
+	MotorCallback,
+	0,
+	0
+};
+
+typedef struct BenchResult {
+	const char* layer;
+	unsigned lines;
+	double parse_seconds;
+	unsigned apertures;
+	double lookups_per_s;
+	uint64_t segments;
+	MotorMergeStats merge;
+	uint64_t step_pulses_x;
+	uint64_t step_pulses_y;
+	uint64_t burn_pulses;
+	uint64_t interrupts;
+	uint64_t ticks;
+	size_t peak_heap;
+	size_t arena_high;
+	unsigned arena_spilled;
+	unsigned queue_high;
+} BenchResult;
+
+static BenchResult* bench_current;
+
+typedef struct BenchStroke {
+	const char* aperture;
+	int angle;
+	unsigned segments;
+	uint64_t steps;
+	uint64_t burn_steps;
+	uint64_t timer_moves;
+	uint64_t ticks;
+} BenchStroke;
+
+static const char* const bench_stroke_apertures[] = {
+	"C,0.800000",
+	"R,0.800000X0.500000",
+	"O,1.200000X0.600000",
+};
+static const int bench_stroke_angles[] = { 0, 30, 45, 90 };
+
+#define BENCH_STROKES (sizeof(bench_stroke_apertures) / sizeof(bench_stroke_apertures[0]) * \
+	sizeof(bench_stroke_angles) / sizeof(bench_stroke_angles[0]))
+
+static double BenchNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void BenchPadHook(GPIO_TypeDef* port, uint32_t pad, int val) {
+	if( !val || bench_current == NULL ) {
+		return;
+	}
+	const Pad* x = &MOTOR_X->m_pads[PadStep];
+	const Pad* y = &MOTOR_Y->m_pads[PadStep];
+	int is_step = 0;
+	if( port == x->m_port && pad == x->m_pad ) {
+		++bench_current->step_pulses_x;
+		is_step = 1;
+	} else if( port == y->m_port && pad == y->m_pad ) {
+		++bench_current->step_pulses_y;
+		is_step = 1;
+	}
+	if( is_step && (PWMD2.enabled & 2) ) {
+		++bench_current->burn_pulses;
+	}
+}
+
+static unsigned BenchRunFile(FILE* f, GerberContext* ctx) {
+	char line[BENCH_LINE_MAX];
+	unsigned lines = 0;
+	rewind(f);
+	while( fgets(line, sizeof(line), f) ) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if( line[0] == '\0' ) {
+			continue;
+		}
+		char* argv[1] = { line };
+		GerberAcceptCommand(ctx, 1, argv);
+		++lines;
+	}
+	return lines;
+}
+
+static void BenchMeasureLookups(GerberContext* ctx, BenchResult* r) {
+	unsigned codes[256];
+	unsigned count = 0;
+	for( Aperture* a = ctx->apertures; a != NULL && count < 256; a = a->next ) {
+		codes[count++] = a->code;
+	}
+	r->apertures = count;
+	if( count == 0 ) {
+		return;
+	}
+	Aperture* saved = ctx->current_aperture;
+	const double start = BenchNow();
+	for( unsigned round = 0; round < BENCH_LOOKUP_ROUNDS; ++round ) {
+		for( unsigned i = 0; i < count; ++i ) {
+			GerberLoadAperture(ctx, codes[i]);
+		}
+	}
+	const double elapsed = BenchNow() - start;
+	ctx->current_aperture = saved;
+	r->lookups_per_s = elapsed > 0 ? (double)BENCH_LOOKUP_ROUNDS * count / elapsed : 0;
+}
+
+static void BenchDropSink(void* arg, const Segment* s) {
+	(void)arg;
+	(void)s;
+}
+
+static int BenchLayer(const char* path, BenchResult* r) {
+	FILE* f = fopen(path, "r");
+	if( f == NULL ) {
+		fprintf(stderr, "bench: cannot open %s\n", path);
+		return 0;
+	}
+	memset(r, 0, sizeof(*r));
+	r->layer = path;
+
+	// dry pass: interpreter and fill generation only, the moves are dropped
+	// in a sink and the job memory is taken from an arena
+	static uint64_t arena_buf[BENCH_ARENA_SIZE / sizeof(uint64_t)];
+	Arena arena;
+	ArenaInit(&arena, arena_buf, sizeof(arena_buf));
+	ArenaSet(&arena);
+	HostSimDry = 1;
+	HostHeapPeak = HostHeapUsed;
+	CUR_X = CUR_Y = 0;
+	SegmentSinkSet(BenchDropSink, NULL);
+	GerberContext* ctx = GerberContextNew();
+	if( ctx == NULL ) {
+		SegmentSinkSet(NULL, NULL);
+		ArenaSet(NULL);
+		fclose(f);
+		fprintf(stderr, "bench: no memory for the Gerber job of %s\n", path);
+		return 0;
+	}
+	const double start = BenchNow();
+	r->lines = BenchRunFile(f, ctx);
+	r->parse_seconds = BenchNow() - start;
+	BenchMeasureLookups(ctx, r);
+	GerberContextFree(ctx);
+	SegmentSinkSet(NULL, NULL);
+	ArenaSet(NULL);
+	r->peak_heap = HostHeapPeak;
+	r->arena_high = arena.high;
+	r->arena_spilled = arena.spilled;
+
+	// simulated pass: the step ISR runs against the host timer
+	HostSimDry = 0;
+	HostSimTicks = 0;
+	HostSimInterrupts = 0;
+	HostSimMoves = 0;
+	CUR_X = CUR_Y = 0;
+	bench_current = r;
+	memset(&motor_merge_stats, 0, sizeof(motor_merge_stats));
+	motor_queue.high = 0;
+	ctx = GerberContextNew();
+	if( ctx == NULL ) {
+		bench_current = NULL;
+		fclose(f);
+		fprintf(stderr, "bench: no memory for the Gerber job of %s\n", path);
+		return 0;
+	}
+	BenchRunFile(f, ctx);
+	GerberContextFree(ctx);
+	bench_current = NULL;
+	r->merge = motor_merge_stats;
+	r->queue_high = motor_queue.high;
+	r->segments = HostSimMoves + motor_merge_stats.chained;
+	r->ticks = HostSimTicks;
+	r->interrupts = HostSimInterrupts;
+
+	fclose(f);
+	return 1;
+}
+
+static void BenchStrokeSink(void* arg, const Segment* s) {
+	BenchStroke* b = (BenchStroke*)arg;
+	const unsigned steps = CoveragePoints(s->dx, s->dy);
+	++b->segments;
+	b->steps += steps;
+	if( s->flags & SEGMENT_LASER ) {
+		b->burn_steps += steps;
+	}
+}
+
+static void BenchCommand(GerberContext* ctx, const char* command) {
+	char line[BENCH_LINE_MAX];
+	snprintf(line, sizeof(line), "%s", command);
+	char* argv[1] = { line };
+	GerberAcceptCommand(ctx, 1, argv);
+}
+
+// recorded into the sink if one is given, simulated otherwise
+static void BenchStrokeDraw(const char* aperture, int angle, SegmentSink sink, BenchStroke* b) {
+	char line[BENCH_LINE_MAX];
+	HostSimDry = sink != NULL;
+	CUR_X = CUR_Y = 0;
+	GerberContext* ctx = GerberContextNew();
+	if( ctx == NULL ) {
+		fprintf(stderr, "bench: no memory for the %s stroke\n", aperture);
+		return;
+	}
+	BenchCommand(ctx, "%FSLAX45Y45*%");
+	BenchCommand(ctx, "%MOMM*%");
+	snprintf(line, sizeof(line), "%%ADD10%s*%%", aperture);
+	BenchCommand(ctx, line);
+	BenchCommand(ctx, "D10*");
+	if( sink ) {
+		// the dry simulation does not run the motion queue
+		SegmentSinkSet(BenchDropSink, NULL);
+	}
+	BenchCommand(ctx, "X2000000Y2000000D02*");
+	const double a = angle * M_PI / 180;
+	snprintf(line, sizeof(line), "X%ldY%ldD01*",
+		2000000 + lround(BENCH_STROKE_MM * 100000 * cos(a)),
+		2000000 + lround(BENCH_STROKE_MM * 100000 * sin(a)));
+	SegmentSinkSet(sink, b);
+	const uint64_t moves = HostSimMoves, ticks = HostSimTicks;
+	BenchCommand(ctx, line);
+	// the moves are queued, they are made here
+	MotorGroupWait();
+	b->timer_moves = HostSimMoves - moves;
+	b->ticks = HostSimTicks - ticks;
+	SegmentSinkSet(NULL, NULL);
+	GerberContextFree(ctx);
+}
+
+static void BenchStrokeRun(const char* aperture, int angle, BenchStroke* b) {
+	memset(b, 0, sizeof(*b));
+	b->aperture = aperture;
+	b->angle = angle;
+	BenchStrokeDraw(aperture, angle, BenchStrokeSink, b);
+	BenchStrokeDraw(aperture, angle, NULL, b);
+}
+
+typedef struct BenchCoords {
+	unsigned formats;
+	unsigned long values;
+	unsigned long mismatches;
+	double max_error; // steps, against the exact value
+	double divide_ns;
+	double multiply_ns;
+} BenchCoords;
+
+static const unsigned bench_step_accuracies[] = { 1, 2, 4, 5, 8, 10, 25 };
+
+// exact, half away from zero
+static int BenchCoordExact(const GerberScale* s, long long v) {
+	const unsigned long long n = (unsigned long long)(v < 0 ? -v : v) * s->unit;
+	const int steps = (int)((2 * n + s->step) / (2ull * s->step));
+	return v < 0 ? -steps : steps;
+}
+
+static void BenchCoordsRun(BenchCoords* c) {
+	memset(c, 0, sizeof(*c));
+	static long long values[BENCH_COORDS];
+	unsigned seed = 1;
+	for( unsigned is_mm = 0; is_mm < 2; ++is_mm ) {
+		for( unsigned fraction = 1; fraction <= 6; ++fraction ) {
+			for( unsigned a = 0; a < sizeof(bench_step_accuracies) / sizeof(bench_step_accuracies[0]); ++a ) {
+				GerberScale s;
+				GerberScaleSet(&s, fraction, is_mm, bench_step_accuracies[a]);
+				// up to 1 m, half of them next to the halves of a step
+				const long long range = is_mm ? 1000 : 40;
+				long long limit = range;
+				for( unsigned i = 0; i < fraction; ++i ) {
+					limit *= 10;
+				}
+				for( unsigned i = 0; i < BENCH_COORDS; ++i ) {
+					seed = seed * 1103515245 + 12345;
+					long long v = (long long)(((unsigned long long)seed << 16 ^ seed) % (2 * limit + 1)) - limit;
+					if( i & 1 ) {
+						const long long k = (v * s.unit) / s.step;
+						v = ((2 * k + 1) * s.step / 2) / s.unit + (long long)(seed >> 30) - 1;
+					}
+					const int got = GerberScaleApply(&s, v);
+					const double error = fabs(got - (double)v * s.unit / s.step);
+					c->max_error = error > c->max_error ? error : c->max_error;
+					c->mismatches += got != BenchCoordExact(&s, v);
+					++c->values;
+				}
+				++c->formats;
+			}
+		}
+	}
+
+	// the default format: 4.5 mm at 0.04 mm steps
+	GerberScale s;
+	GerberScaleSet(&s, 5, 1, 4);
+	for( unsigned i = 0; i < BENCH_COORDS; ++i ) {
+		seed = seed * 1103515245 + 12345;
+		values[i] = (long long)(seed % 20000001) - 10000000;
+	}
+	volatile long long divisor = 1000 * 4;
+	volatile long long sink = 0;
+	double start = BenchNow();
+	for( unsigned round = 0; round < BENCH_COORD_ROUNDS; ++round ) {
+		for( unsigned i = 0; i < BENCH_COORDS; ++i ) {
+			sink += values[i] / divisor;
+		}
+	}
+	c->divide_ns = (BenchNow() - start) * 1e9 / ((double)BENCH_COORD_ROUNDS * BENCH_COORDS);
+	start = BenchNow();
+	for( unsigned round = 0; round < BENCH_COORD_ROUNDS; ++round ) {
+		for( unsigned i = 0; i < BENCH_COORDS; ++i ) {
+			sink += GerberScaleApply(&s, values[i]);
+		}
+	}
+	c->multiply_ns = (BenchNow() - start) * 1e9 / ((double)BENCH_COORD_ROUNDS * BENCH_COORDS);
+}
+
+static void BenchWriteJson(FILE* out, const BenchResult* r, unsigned count, const BenchStroke* s, const BenchCoords* c) {
+	fprintf(out, "{\n  \"microstepping\": %d,\n  \"layers\": [\n", MOTOR_MICROSTEPPING);
+	for( unsigned i = 0; i < count; ++i, ++r ) {
+		const uint64_t steps = (r->step_pulses_x + r->step_pulses_y) / MOTOR_MICROSTEPPING;
+		fprintf(out,
+			"    {\n"
+			"      \"layer\": \"%s\",\n"
+			"      \"lines\": %u,\n"
+			"      \"parser_lines_per_s\": %.0f,\n"
+			"      \"apertures\": %u,\n"
+			"      \"aperture_lookups_per_s\": %.0f,\n"
+			"      \"segments\": %llu,\n"
+			"      \"queued_moves\": %u,\n"
+			"      \"merged_moves\": %u,\n"
+			"      \"dropped_moves\": %u,\n"
+			"      \"held_moves_high\": %u,\n"
+			"      \"chained_moves\": %u,\n"
+			"      \"queue_high_records\": %u,\n"
+			"      \"steps\": %llu,\n"
+			"      \"burn_steps\": %llu,\n"
+			"      \"step_interrupts\": %llu,\n"
+			"      \"machine_time_s\": %.3f,\n"
+			"      \"peak_heap_bytes\": %zu,\n"
+			"      \"arena_high_bytes\": %zu,\n"
+			"      \"arena_spilled\": %u\n"
+			"    }%s\n",
+			r->layer,
+			r->lines,
+			r->parse_seconds > 0 ? r->lines / r->parse_seconds : 0,
+			r->apertures,
+			r->lookups_per_s,
+			(unsigned long long)r->segments,
+			r->merge.queued,
+			r->merge.merged,
+			r->merge.dropped,
+			r->merge.held_high,
+			r->merge.chained,
+			r->queue_high,
+			(unsigned long long)steps,
+			(unsigned long long)(r->burn_pulses / MOTOR_MICROSTEPPING),
+			(unsigned long long)r->interrupts,
+			r->ticks / (double)gpt_motor.frequency,
+			r->peak_heap,
+			r->arena_high,
+			r->arena_spilled,
+			i + 1 < count ? "," : "");
+	}
+	fprintf(out, "  ],\n  \"strokes\": [\n");
+	for( unsigned i = 0; i < BENCH_STROKES; ++i, ++s ) {
+		fprintf(out,
+			"    { \"aperture\": \"%s\", \"angle\": %d, \"segments\": %u, "
+			"\"steps_per_mm\": %.1f, \"burn_steps_per_mm\": %.1f, "
+			"\"timer_moves\": %llu, \"machine_time_s\": %.3f }%s\n",
+			s->aperture,
+			s->angle,
+			s->segments,
+			(double)s->steps / BENCH_STROKE_MM,
+			(double)s->burn_steps / BENCH_STROKE_MM,
+			(unsigned long long)s->timer_moves,
+			s->ticks / (double)gpt_motor.frequency,
+			i + 1 < BENCH_STROKES ? "," : "");
+	}
+	fprintf(out,
+		"  ],\n"
+		"  \"coords\": { \"formats\": %u, \"values\": %lu, \"mismatches\": %lu, \"max_error_steps\": %.6f, "
+		"\"divide_ns\": %.2f, \"multiply_ns\": %.2f }\n}\n",
+		c->formats, c->values, c->mismatches, c->max_error, c->divide_ns, c->multiply_ns);
+}
+
+int main(int argc, char* argv[]) {
+	const char* out_path = NULL;
+	int first = 1;
+	if( argc > 2 && strcmp(argv[1], "-o") == 0 ) {
+		out_path = argv[2];
+		first = 3;
+	}
+	if( first >= argc ) {
+		fprintf(stderr, "usage: bench [-o result.json] layer.gbr...\n");
+		return 2;
+	}
+
+	gptStart(MOTOR_TIMER, &gpt_motor);
+	HostPadHook = BenchPadHook;
+
+	const unsigned count = argc - first;
+	BenchResult* results = (BenchResult*)malloc(count * sizeof(BenchResult));
+	unsigned done = 0;
+	for( int i = first; i < argc; ++i ) {
+		if( BenchLayer(argv[i], &results[done]) ) {
+			++done;
+		}
+	}
+
+	BenchStroke strokes[BENCH_STROKES];
+	BenchStroke* stroke = strokes;
+	for( unsigned i = 0; i < sizeof(bench_stroke_apertures) / sizeof(bench_stroke_apertures[0]); ++i ) {
+		for( unsigned j = 0; j < sizeof(bench_stroke_angles) / sizeof(bench_stroke_angles[0]); ++j ) {
+			BenchStrokeRun(bench_stroke_apertures[i], bench_stroke_angles[j], stroke++);
+		}
+	}
+
+	BenchCoords coords;
+	BenchCoordsRun(&coords);
+
+	FILE* out = stdout;
+	if( out_path && (out = fopen(out_path, "w")) == NULL ) {
+		fprintf(stderr, "bench: cannot write %s\n", out_path);
+		return 1;
+	}
+	BenchWriteJson(out, results, done, strokes, &coords);
+	if( out != stdout ) {
+		fclose(out);
+	}
+	free(results);
+	return done == count ? 0 : 1;
+}
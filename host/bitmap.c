@@ -0,0 +1,169 @@
+
+#include "bitmap.h"
+
+void BitmapInit(Bitmap* b, int x0, int y0, int w, int h) {
+	b->x0 = x0;
+	b->y0 = y0;
+	b->w = w > 0 ? w : 0;
+	b->h = h > 0 ? h : 0;
+	b->stride = (b->w + 7) / 8;
+	b->bits = (uint8_t*)malloc(b->stride * b->h + 1);
+	memset(b->bits, 0, b->stride * b->h + 1);
+}
+
+void BitmapFree(Bitmap* b) {
+	free(b->bits);
+	b->bits = NULL;
+}
+
+int BitmapGet(const Bitmap* b, int x, int y) {
+	x -= b->x0;
+	y -= b->y0;
+	if( x < 0 || y < 0 || x >= b->w || y >= b->h ) {
+		return 0;
+	}
+	return (b->bits[y * b->stride + x / 8] >> (x & 7)) & 1;
+}
+
+void BitmapSet(Bitmap* b, int x, int y) {
+	x -= b->x0;
+	y -= b->y0;
+	if( x >= 0 && y >= 0 && x < b->w && y < b->h ) {
+		b->bits[y * b->stride + x / 8] |= 1 << (x & 7);
+	}
+}
+
+void BitmapClear(Bitmap* b, int x, int y) {
+	x -= b->x0;
+	y -= b->y0;
+	if( x >= 0 && y >= 0 && x < b->w && y < b->h ) {
+		b->bits[y * b->stride + x / 8] &= ~(1 << (x & 7));
+	}
+}
+
+unsigned long BitmapCount(const Bitmap* b) {
+	unsigned long count = 0;
+	for( unsigned i = 0; i < b->stride * b->h; ++i ) {
+		count += __builtin_popcount(b->bits[i]);
+	}
+	return count;
+}
+
+unsigned long long BitmapHash(const Bitmap* b) {
+	unsigned long long hash = 1469598103934665603ULL;
+	for( int y = 0; y < b->h; ++y ) {
+		for( int x = 0; x < b->w; ++x ) {
+			if( BitmapGet(b, b->x0 + x, b->y0 + y) ) {
+				hash = (hash ^ (unsigned)(b->x0 + x)) * 1099511628211ULL;
+				hash = (hash ^ (unsigned)(b->y0 + y)) * 1099511628211ULL;
+			}
+		}
+	}
+	return hash;
+}
+
+unsigned long long BitmapCellHash(int x, int y, unsigned value) {
+	unsigned long long hash = 1469598103934665603ULL;
+	hash = (hash ^ (unsigned)x) * 1099511628211ULL;
+	hash = (hash ^ (unsigned)y) * 1099511628211ULL;
+	hash = (hash ^ value) * 1099511628211ULL;
+	return hash ^ (hash >> 29);
+}
+
+int BitmapWritePbm(const Bitmap* b, const char* path) {
+	FILE* f = fopen(path, "wb");
+	if( f == NULL ) {
+		return 0;
+	}
+	fprintf(f, "P4\n%d %d\n", b->w, b->h);
+	// PBM is MSB first and top row first, +Y is up on the machine
+	for( int y = b->h - 1; y >= 0; --y ) {
+		for( unsigned i = 0; i < b->stride; ++i ) {
+			const uint8_t v = b->bits[y * b->stride + i];
+			uint8_t r = 0;
+			for( int k = 0; k < 8; ++k ) {
+				r |= ((v >> k) & 1) << (7 - k);
+			}
+			fputc(r, f);
+		}
+	}
+	return fclose(f) == 0;
+}
+
+typedef void (*BitmapVisit)(void* arg, int x, int y);
+
+/*
+ * Walks a move the way the step engine does: Bresenham for burns
+ * (MotorStepStagePrepareFullStep), both axes at once for rapids.
+ */
+static void BitmapWalk(const Segment* s, int x, int y, BitmapVisit visit, void* arg) {
+	const int sx = s->dx < 0 ? -1 : 1;
+	const int sy = s->dy < 0 ? -1 : 1;
+	const int dx = abs(s->dx);
+	const int dy = abs(s->dy);
+	int x1 = 0, y1 = 0;
+	int error = dx - dy;
+
+	visit(arg, x, y);
+	while( x1 != dx || y1 != dy ) {
+		if( s->flags & SEGMENT_RAPID ) {
+			x1 += x1 != dx;
+			y1 += y1 != dy;
+		} else {
+			const int error2 = error * 2;
+			if( error2 > -dy ) {
+				error -= dy;
+				++x1;
+			}
+			if( error2 < dx ) {
+				error += dx;
+				++y1;
+			}
+		}
+		visit(arg, x + sx * x1, y + sy * y1);
+	}
+}
+
+typedef struct BitmapBounds {
+	int x0, y0, x1, y1;
+	int any;
+} BitmapBounds;
+
+static void BitmapVisitBounds(void* arg, int x, int y) {
+	BitmapBounds* bb = (BitmapBounds*)arg;
+	if( !bb->any ) {
+		bb->x0 = bb->x1 = x;
+		bb->y0 = bb->y1 = y;
+		bb->any = 1;
+	}
+	bb->x0 = x < bb->x0 ? x : bb->x0;
+	bb->x1 = x > bb->x1 ? x : bb->x1;
+	bb->y0 = y < bb->y0 ? y : bb->y0;
+	bb->y1 = y > bb->y1 ? y : bb->y1;
+}
+
+static void BitmapVisitSet(void* arg, int x, int y) {
+	BitmapSet((Bitmap*)arg, x, y);
+}
+
+void BitmapFromSegments(Bitmap* b, const SegmentList* list) {
+	BitmapBounds bb = { 0, 0, 0, 0, 0 };
+	for( int pass = 0; pass < 2; ++pass ) {
+		int x = 0, y = 0;
+		for( unsigned i = 0; i < list->count; ++i ) {
+			const Segment* s = &list->items[i];
+			if( s->flags & SEGMENT_LASER ) {
+				if( pass == 0 ) {
+					BitmapWalk(s, x, y, BitmapVisitBounds, &bb);
+				} else {
+					BitmapWalk(s, x, y, BitmapVisitSet, b);
+				}
+			}
+			x += s->dx;
+			y += s->dy;
+		}
+		if( pass == 0 ) {
+			BitmapInit(b, bb.x0, bb.y0, bb.any ? bb.x1 - bb.x0 + 1 : 0, bb.any ? bb.y1 - bb.y0 + 1 : 0);
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef _HOST_BITMAP_H
+#define _HOST_BITMAP_H
+
+#include <stdint.h>
+#include "seglist.h"
+
+/*
+ * 1-bit bitmap at the step pitch, addressed in absolute step coordinates.
+ */
+
+typedef struct Bitmap {
+	int x0, y0; // step coordinates of pixel (0, 0)
+	int w, h;
+	unsigned stride; // bytes per row
+	uint8_t* bits;
+} Bitmap;
+
+void BitmapInit(Bitmap* b, int x0, int y0, int w, int h);
+void BitmapFree(Bitmap* b);
+int BitmapGet(const Bitmap* b, int x, int y);
+void BitmapSet(Bitmap* b, int x, int y);
+void BitmapClear(Bitmap* b, int x, int y);
+unsigned long BitmapCount(const Bitmap* b);
+// FNV-1a over the coordinates of the set pixels, to compare renderings
+unsigned long long BitmapHash(const Bitmap* b);
+int BitmapWritePbm(const Bitmap* b, const char* path);
+
+/*
+ * Hash of one cell and a value burned into it. Summed over the cells it
+ * gives an order independent fingerprint of a grayscale burn.
+ */
+unsigned long long BitmapCellHash(int x, int y, unsigned value);
+
+/*
+ * Renders the positions the head visits with the laser on, replaying the
+ * step engine's interpolation exactly, into a bitmap sized to fit.
+ */
+void BitmapFromSegments(Bitmap* b, const SegmentList* list);
+
+#endif // _HOST_BITMAP_H
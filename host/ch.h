@@ -0,0 +1,34 @@
+#ifndef _HOST_CH_H
+#define _HOST_CH_H
+
+/*
+ * Minimal ChibiOS/RT surface used by the firmware modules, so they can be
+ * compiled and driven on a workstation. Semaphore waits run the simulated
+ * timers (see sim.c) until the waited object is signalled.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRUE 1
+#define FALSE 0
+
+typedef struct {
+	volatile int taken;
+} binary_semaphore_t;
+
+#define BSEMAPHORE_DECL(name, taken) binary_semaphore_t name = { taken }
+
+void chBSemWait(binary_semaphore_t* bsp);
+void chBSemSignalI(binary_semaphore_t* bsp);
+
+#define chSysLock()
+#define chSysUnlock()
+#define chSchRescheduleS()
+#define osalSysLockFromISR()
+#define osalSysUnlockFromISR()
+
+#define chThdSleepSeconds(n) ((void)(n))
+#define chThdSleepMilliseconds(n) ((void)(n))
+
+#endif // _HOST_CH_H
@@ -0,0 +1,8 @@
+#ifndef _HOST_CHPRINTF_H
+#define _HOST_CHPRINTF_H
+
+#include <hal.h>
+
+int chprintf(BaseSequentialStream* chp, const char* fmt, ...);
+
+#endif // _HOST_CHPRINTF_H
@@ -0,0 +1,644 @@
+/*
+ * Host Gerber-to-toolpath compiler.
+ *
+ * Reads a complete RS-274X file, normalises it into the one-command-per-
+ * line form the firmware interpreter accepts (extended blocks, modal
+ * coordinates, G54 prefixes, circular interpolation into chords) and runs
+ * it through gerber.c with a segment sink attached, so the aperture fill
+ * semantics are exactly the firmware ones. The recorded motion is then
+ * optimised and written as a job program for the firmware "job" command,
+ * or rendered into a bitmap and written as a raster program (-R). In
+ * isolation mode (-I) only contours around the copper are burned.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <ch.h>
+#include <hal.h>
+#include <chprintf.h>
+
+#define COVERAGE_TILES_MAX 65536 // the whole layer on a workstation
+
+#include "../segment.c"
+#include "../laser.c"
+#include "../perf.c"
+#include "../motor.c"
+#include "../gerber.c"
+#include "../region.c"
+#include "../coverage.c"
+#include "../macro.c"
+#include "../arena.c"
+#include "../preflight.c"
+#include "../job.h"
+#include "../raster.c"
+#include "seglist.c"
+#include "order.c"
+#include "bitmap.c"
+#include "scanline.c"
+#include "outline.c"
+
+#define GBRC_LINE_MAX 256
+#define GBRC_ARC_TOLERANCE_MM 0.005
+#define GBRC_ARC_CHORDS_MAX 1024
+#define GBRC_ORDER_BUDGET_MS 2000
+
+typedef struct Gbrc {
+	GerberContext* ctx;
+	unsigned commands;
+	// coordinate state in file units, for modal words and arcs
+	long long x, y;
+	unsigned last_d;
+	unsigned interpolation; // 1 linear, 2 clockwise, 3 counterclockwise
+	unsigned multi_quadrant;
+	unsigned decimals;
+	unsigned is_inch;
+	// features for travel ordering
+	const SegmentList* recorded;
+	Feature* features;
+	unsigned feature_count;
+	unsigned feature_capacity;
+	unsigned block;
+	int stroke_open;
+} Gbrc;
+
+static void GbrcFeed(Gbrc* c, const char* text) {
+	char line[GBRC_LINE_MAX + 4];
+	snprintf(line, sizeof(line), "%s", text);
+	char* argv[1] = { line };
+	GerberAcceptCommand(c->ctx, 1, argv);
+	++c->commands;
+}
+
+/*
+ * Every flash is a feature of its own, connected strokes are kept
+ * together as one feature.
+ */
+static void GbrcFeature(Gbrc* c, unsigned first, unsigned d) {
+	const unsigned count = c->recorded->count - first;
+	if( d == 1 && c->stroke_open && c->feature_count ) {
+		Feature* last = &c->features[c->feature_count - 1];
+		if( last->first + last->count == first ) {
+			last->count += count;
+			return;
+		}
+	}
+	c->stroke_open = d == 1;
+	if( (d != 1 && d != 3) || count == 0 ) {
+		return;
+	}
+	if( c->feature_count == c->feature_capacity ) {
+		c->feature_capacity = c->feature_capacity ? c->feature_capacity * 2 : 256;
+		Feature* features = (Feature*)malloc(c->feature_capacity * sizeof(Feature));
+		if( c->feature_count ) {
+			memcpy(features, c->features, c->feature_count * sizeof(Feature));
+		}
+		free(c->features);
+		c->features = features;
+	}
+	Feature* f = &c->features[c->feature_count++];
+	memset(f, 0, sizeof(*f));
+	f->first = first;
+	f->count = count;
+	f->block = c->block;
+}
+
+static void GbrcEmitD(Gbrc* c, long long x, long long y, unsigned d) {
+	char line[GBRC_LINE_MAX];
+	const unsigned first = c->recorded->count;
+	snprintf(line, sizeof(line), "X%lldY%lldD%02u*", x, y, d);
+	GbrcFeed(c, line);
+	GbrcFeature(c, first, d);
+}
+
+static void GbrcArc(Gbrc* c, long long ex, long long ey, long long i, long long j) {
+	const int cw = c->interpolation == 2;
+	double cx = c->x + i;
+	double cy = c->y + j;
+
+	if( !c->multi_quadrant ) {
+		// single quadrant offsets are unsigned, pick the matching centre
+		double best = -1;
+		for( int k = 0; k < 4; ++k ) {
+			const double tx = c->x + ((k & 1) ? -llabs(i) : llabs(i));
+			const double ty = c->y + ((k & 2) ? -llabs(j) : llabs(j));
+			const double r0 = hypot(c->x - tx, c->y - ty);
+			const double r1 = hypot(ex - tx, ey - ty);
+			double a0 = atan2(c->y - ty, c->x - tx);
+			double a1 = atan2(ey - ty, ex - tx);
+			double sweep = cw ? a0 - a1 : a1 - a0;
+			while( sweep < 0 ) {
+				sweep += 2 * M_PI;
+			}
+			if( sweep > M_PI / 2 + 1e-6 ) {
+				continue;
+			}
+			const double err = fabs(r0 - r1);
+			if( best < 0 || err < best ) {
+				best = err;
+				cx = tx;
+				cy = ty;
+			}
+		}
+	}
+
+	const double r = hypot(c->x - cx, c->y - cy);
+	const double a0 = atan2(c->y - cy, c->x - cx);
+	const double a1 = atan2(ey - cy, ex - cx);
+	double sweep = cw ? a0 - a1 : a1 - a0;
+	while( sweep <= 1e-9 ) {
+		sweep += 2 * M_PI; // equal end points make a full circle
+	}
+
+	double tolerance = GBRC_ARC_TOLERANCE_MM * pow(10, c->decimals);
+	if( c->is_inch ) {
+		tolerance /= 25.4;
+	}
+	unsigned chords = 1;
+	if( r > tolerance ) {
+		const double step = 2 * acos(1 - tolerance / r);
+		chords = (unsigned)ceil(sweep / step);
+	}
+	if( chords < 1 ) {
+		chords = 1;
+	} else if( chords > GBRC_ARC_CHORDS_MAX ) {
+		chords = GBRC_ARC_CHORDS_MAX;
+	}
+
+	for( unsigned k = 1; k < chords; ++k ) {
+		const double a = cw ? a0 - sweep * k / chords : a0 + sweep * k / chords;
+		GbrcEmitD(c, llround(cx + r * cos(a)), llround(cy + r * sin(a)), 1);
+	}
+	GbrcEmitD(c, ex, ey, 1);
+}
+
+static void GbrcCoordinates(Gbrc* c, const char* w) {
+	long long x = c->x, y = c->y, i = 0, j = 0;
+	unsigned d = c->last_d;
+
+	while( *w ) {
+		const char letter = *w++;
+		char* end;
+		const long long value = strtoll(w, &end, 10);
+		if( end == w ) {
+			fprintf(stderr, "gbrc: malformed coordinates near '%s'\n", w);
+			return;
+		}
+		w = end;
+		switch( letter ) {
+		case 'X': x = value; break;
+		case 'Y': y = value; break;
+		case 'I': i = value; break;
+		case 'J': j = value; break;
+		case 'D': d = (unsigned)value; break;
+		default:
+			fprintf(stderr, "gbrc: unknown coordinate word '%c'\n", letter);
+			return;
+		}
+	}
+
+	if( d == 1 && c->interpolation != 1 ) {
+		GbrcArc(c, x, y, i, j);
+	} else {
+		GbrcEmitD(c, x, y, d);
+	}
+	c->x = x;
+	c->y = y;
+	c->last_d = d;
+}
+
+static void GbrcData(Gbrc* c, char* w) {
+	char text[GBRC_LINE_MAX + 2];
+
+	if( w[0] == '\0' ) {
+		return;
+	}
+	if( strncmp(w, "G04", 3) == 0 || strncmp(w, "G4", 2) == 0 ) {
+		return; // comment
+	}
+	if( strncmp(w, "G54", 3) == 0 || strncmp(w, "G55", 3) == 0 ) {
+		w += 3; // deprecated aperture select/flash prefixes
+	}
+	if( w[0] == 'G' ) {
+		char* end;
+		const unsigned g = strtoul(w + 1, &end, 10);
+		switch( g ) {
+		case 1:
+		case 2:
+		case 3:
+			c->interpolation = g;
+			if( g == 1 ) {
+				GbrcFeed(c, "G01*");
+			}
+			break;
+		case 74:
+		case 75:
+			c->multi_quadrant = g == 75;
+			break;
+		case 37: {
+			// the region is filled at its end, the fill is one feature
+			const unsigned first = c->recorded->count;
+			GbrcFeed(c, "G37*");
+			GbrcFeature(c, first, 3);
+			break;
+		}
+		case 70:
+		case 71:
+			c->is_inch = g == 70;
+			/* fall through */
+		default:
+			snprintf(text, sizeof(text), "G%02u*", g);
+			GbrcFeed(c, text);
+		}
+		w = end;
+		if( w[0] == '\0' ) {
+			return;
+		}
+	}
+	if( w[0] == 'X' || w[0] == 'Y' || w[0] == 'I' || w[0] == 'J' ) {
+		GbrcCoordinates(c, w);
+		return;
+	}
+	if( w[0] == 'D' ) {
+		const unsigned d = strtoul(w + 1, NULL, 10);
+		if( d < 10 ) {
+			GbrcEmitD(c, c->x, c->y, d);
+			c->last_d = d;
+			return;
+		}
+	}
+	const unsigned at = c->recorded->count;
+	snprintf(text, sizeof(text), "%s*", w);
+	GbrcFeed(c, text);
+	if( strncmp(w, "M02", 3) == 0 ) {
+		GbrcFeature(c, at, 3); // it ends a step and repeat block
+	}
+}
+
+static void GbrcExtended(Gbrc* c, const char* w, int first, int last) {
+	char text[GBRC_LINE_MAX + 3];
+
+	if( first ) {
+		unsigned xi, xd, yi, yd;
+		if( sscanf(w, "FS%*c%*cX%1u%1uY%1u%1u", &xi, &xd, &yi, &yd) == 4 ) {
+			c->decimals = xd;
+		} else if( strncmp(w, "MOIN", 4) == 0 ) {
+			c->is_inch = 1;
+		} else if( strncmp(w, "MOMM", 4) == 0 ) {
+			c->is_inch = 0;
+		} else if( strncmp(w, "LP", 2) == 0 ) {
+			// features are never reordered across a polarity change
+			++c->block;
+			c->stroke_open = 0;
+		}
+	}
+	const unsigned at = c->recorded->count;
+	snprintf(text, sizeof(text), "%s%s*%s", first ? "%" : "", w, last ? "%" : "");
+	GbrcFeed(c, text);
+	if( first && strncmp(w, "SR", 2) == 0 ) {
+		// the copies of an ended step and repeat block run here, as one feature
+		GbrcFeature(c, at, 3);
+	}
+}
+
+static void GbrcParse(Gbrc* c, const char* data) {
+	char word[GBRC_LINE_MAX];
+	char pending[GBRC_LINE_MAX];
+	unsigned len = 0;
+	int in_extended = 0;
+	int has_pending = 0;
+	int pending_first = 0;
+
+	for( ; *data; ++data ) {
+		const char ch = *data;
+		if( ch == '\r' || ch == '\n' || ch == '\t' || ch == ' ' ) {
+			continue;
+		}
+		if( ch == '%' ) {
+			if( in_extended && has_pending ) {
+				GbrcExtended(c, pending, pending_first, 1);
+			}
+			in_extended = !in_extended;
+			has_pending = 0;
+			pending_first = 1;
+			len = 0;
+			continue;
+		}
+		if( ch != '*' ) {
+			if( len < sizeof(word) - 1 ) {
+				word[len++] = ch;
+			}
+			continue;
+		}
+		word[len] = '\0';
+		len = 0;
+		if( in_extended ) {
+			// the block's last command is only known at the closing '%'
+			if( has_pending ) {
+				GbrcExtended(c, pending, pending_first, 0);
+				pending_first = 0;
+			}
+			memcpy(pending, word, sizeof(word));
+			has_pending = 1;
+		} else {
+			GbrcData(c, word);
+		}
+	}
+}
+
+/*
+ * Laser-off moves become rapids and are merged, collinear burns with the
+ * same state are merged, empty moves are dropped.
+ */
+static void GbrcOptimise(const SegmentList* in, SegmentList* out) {
+	for( unsigned i = 0; i < in->count; ++i ) {
+		Segment s = in->items[i];
+		if( s.dx == 0 && s.dy == 0 ) {
+			continue;
+		}
+		if( !(s.flags & SEGMENT_LASER) ) {
+			s.flags = SEGMENT_RAPID;
+		}
+		if( out->count ) {
+			Segment* last = &out->items[out->count - 1];
+			const int dx = last->dx + s.dx;
+			const int dy = last->dy + s.dy;
+			const int fits = abs(dx) <= SEGMENT_DELTA_MAX && abs(dy) <= SEGMENT_DELTA_MAX;
+			const int collinear = last->dx * s.dy == last->dy * s.dx && last->dx * s.dx + last->dy * s.dy > 0;
+			if( fits && last->flags == s.flags && ((s.flags & SEGMENT_RAPID) || collinear) ) {
+				last->dx = dx;
+				last->dy = dy;
+				if( dx == 0 && dy == 0 ) {
+					--out->count;
+				}
+				continue;
+			}
+		}
+		SegmentListPush(out, &s);
+	}
+}
+
+typedef struct GbrcStats {
+	double burn;
+	double rapid;
+	double seconds;
+} GbrcStats;
+
+static void GbrcMeasure(const SegmentList* list, GbrcStats* st) {
+	memset(st, 0, sizeof(*st));
+	for( unsigned i = 0; i < list->count; ++i ) {
+		const Segment* s = &list->items[i];
+		const double len = hypot(s->dx, s->dy);
+		if( s->flags & SEGMENT_LASER ) {
+			st->burn += len;
+		} else {
+			st->rapid += len;
+		}
+		// one full step costs MOTOR_MICROSTEPPING pulses of the step engine
+		const unsigned steps = abs(s->dx) > abs(s->dy) ? abs(s->dx) : abs(s->dy);
+		st->seconds += steps * MOTOR_MICROSTEPPING * (STEP_MEANDR + STEP_WAIT) * 1e-6;
+	}
+}
+
+static int GbrcWriteJob(const char* path, const SegmentList* list) {
+	FILE* f = fopen(path, "wb");
+	if( f == NULL ) {
+		fprintf(stderr, "gbrc: cannot write %s\n", path);
+		return 0;
+	}
+	uint8_t header[JOB_HEADER_SIZE];
+	memcpy(header, JOB_MAGIC, 4);
+	for( int i = 0; i < 4; ++i ) {
+		header[4 + i] = (list->count >> (8 * i)) & 0xFF;
+	}
+	fwrite(header, 1, sizeof(header), f);
+	for( unsigned i = 0; i < list->count; ++i ) {
+		uint8_t rec[SEGMENT_WIRE_SIZE];
+		SegmentEncode(&list->items[i], rec);
+		fwrite(rec, 1, sizeof(rec), f);
+	}
+	return fclose(f) == 0;
+}
+
+static int GbrcWriteText(const char* path, const SegmentList* list) {
+	FILE* f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if( f == NULL ) {
+		fprintf(stderr, "gbrc: cannot write %s\n", path);
+		return 0;
+	}
+	for( unsigned i = 0; i < list->count; ++i ) {
+		const Segment* s = &list->items[i];
+		const char kind = (s->flags & SEGMENT_LASER) ? 'B' : (s->flags & SEGMENT_RAPID) ? 'R' : 'M';
+		fprintf(f, "%c %d %d\n", kind, s->dx, s->dy);
+	}
+	return f == stdout ? 1 : fclose(f) == 0;
+}
+
+static char* GbrcReadFile(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if( f == NULL ) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	const long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* data = (char*)malloc(size + 1);
+	data[fread(data, 1, size, f)] = '\0';
+	fclose(f);
+	return data;
+}
+
+static void GbrcUsage(void) {
+	fprintf(stderr,
+		"usage: gbrc [options] input.gbr\n"
+		"  -o FILE   write the job program (default: out.job)\n"
+		"  -t FILE   write a text listing of the segments ('-' for stdout)\n"
+		"  -R FILE   write a raster program of the whole layer\n"
+		"  -p FILE   write the rendered layer as a PBM image\n"
+		"  -I N      isolation mode: burn N contours around the copper, no fills\n"
+		"  -c        burn overlapping copper once (coverage.h)\n"
+		"  -r        keep the raw interpreter output, no optimisation\n"
+		"  -n        keep the file order of flashes and strokes\n"
+		"  -T MS     time budget of the travel ordering (default %d)\n"
+		"  -v        show interpreter messages\n", GBRC_ORDER_BUDGET_MS);
+}
+
+int main(int argc, char* argv[]) {
+	const char* out_path = "out.job";
+	const char* text_path = NULL;
+	const char* raster_path = NULL;
+	const char* pbm_path = NULL;
+	const char* in_path = NULL;
+	int raw = 0;
+	int keep_order = 0;
+	unsigned budget_ms = GBRC_ORDER_BUDGET_MS;
+	unsigned isolation = 0;
+	int cover = 0;
+
+	for( int i = 1; i < argc; ++i ) {
+		if( strcmp(argv[i], "-o") == 0 && i + 1 < argc ) {
+			out_path = argv[++i];
+		} else if( strcmp(argv[i], "-t") == 0 && i + 1 < argc ) {
+			text_path = argv[++i];
+		} else if( strcmp(argv[i], "-R") == 0 && i + 1 < argc ) {
+			raster_path = argv[++i];
+		} else if( strcmp(argv[i], "-p") == 0 && i + 1 < argc ) {
+			pbm_path = argv[++i];
+		} else if( strcmp(argv[i], "-I") == 0 && i + 1 < argc ) {
+			isolation = atoi(argv[++i]);
+		} else if( strcmp(argv[i], "-c") == 0 ) {
+			cover = 1;
+		} else if( strcmp(argv[i], "-r") == 0 ) {
+			raw = 1;
+		} else if( strcmp(argv[i], "-n") == 0 ) {
+			keep_order = 1;
+		} else if( strcmp(argv[i], "-T") == 0 && i + 1 < argc ) {
+			budget_ms = atoi(argv[++i]);
+		} else if( strcmp(argv[i], "-v") == 0 ) {
+			SD3.stream.out = stderr;
+		} else if( argv[i][0] != '-' && in_path == NULL ) {
+			in_path = argv[i];
+		} else {
+			GbrcUsage();
+			return 2;
+		}
+	}
+	if( in_path == NULL ) {
+		GbrcUsage();
+		return 2;
+	}
+
+	char* data = GbrcReadFile(in_path);
+	if( data == NULL ) {
+		fprintf(stderr, "gbrc: cannot open %s\n", in_path);
+		return 1;
+	}
+
+	(void)MotorCallback; // the step engine is not run by the compiler
+
+	const clock_t start = clock();
+	SegmentList recorded = { NULL, 0, 0 };
+	Gbrc c;
+	memset(&c, 0, sizeof(c));
+	c.interpolation = 1;
+	c.last_d = 2;
+	c.decimals = 5;
+	c.ctx = GerberContextNew();
+	if( c.ctx == NULL ) {
+		fprintf(stderr, "gbrc: no memory for the Gerber job\n");
+		free(data);
+		return 1;
+	}
+	c.recorded = &recorded;
+
+	Coverage* coverage = cover ? CoverageNew(c.ctx->tool_width / (2.0f * c.ctx->step_accuracy)) : NULL;
+	CoverageSet(coverage);
+	SegmentSinkSet(SegmentListPush, &recorded);
+	GbrcParse(&c, data);
+	SegmentSinkSet(NULL, NULL);
+	CoverageSet(NULL);
+	if( coverage ) {
+		fprintf(stderr, "%s: coverage %.0f of %.0f burn steps skipped over burned copper (%.1f%%), "
+			"%.1f mm saved, %u tiles\n",
+			in_path, coverage->saved, coverage->burn, coverage->burn > 0 ? 100 * coverage->saved / coverage->burn : 0.0,
+			coverage->saved * c.ctx->step_accuracy / 100, coverage->tiles);
+		CoverageFree(coverage);
+	}
+	// tool radius in steps, rounded up as the aperture fills do
+	const unsigned half_accuracy = 2 * c.ctx->step_accuracy;
+	const int tool_radius = (c.ctx->tool_width + half_accuracy - 1) / half_accuracy;
+	GerberContextFree(c.ctx);
+	free(data);
+
+	const SegmentList* source = &recorded;
+	Feature* features = c.features;
+	unsigned feature_count = c.feature_count;
+	SegmentList outline = { NULL, 0, 0 };
+	Feature* outline_features = NULL;
+	if( isolation ) {
+		Bitmap centres;
+		BitmapFromSegments(&centres, &recorded);
+		OutlineStats ls;
+		OutlineBuild(&centres, tool_radius, isolation, &outline, &outline_features, &feature_count, &ls);
+		BitmapFree(&centres);
+		GbrcStats fill;
+		GbrcMeasure(&recorded, &fill);
+		double burn = 0;
+		for( unsigned i = 0; i < outline.count; ++i ) {
+			if( outline.items[i].flags & SEGMENT_LASER ) {
+				burn += hypot(outline.items[i].dx, outline.items[i].dy);
+			}
+		}
+		fprintf(stderr, "%s: isolation %u passes at %d steps, %u contours, %lu pixels in %lu points, "
+			"burn %.0f -> %.0f steps (%.1fx less), %.3f s\n",
+			in_path, ls.passes, 2 * tool_radius, ls.contours, ls.pixels, ls.points,
+			fill.burn, burn, burn > 0 ? fill.burn / burn : 0.0, ls.seconds);
+		source = &outline;
+		features = outline_features;
+	}
+
+	SegmentList ordered = { NULL, 0, 0 };
+	SegmentList optimised = { NULL, 0, 0 };
+	const SegmentList* result = source;
+	if( !raw ) {
+		if( !keep_order ) {
+			OrderStats os;
+			OrderFeatures(source, features, feature_count, budget_ms, &ordered, &os);
+			fprintf(stderr, "%s: %u features, rapid travel %lld -> %lld steps (%u moves, %.3f s)\n",
+				in_path, os.features, os.before, os.after, os.moves, os.seconds);
+			result = &ordered;
+		}
+		GbrcOptimise(result, &optimised);
+		result = &optimised;
+	}
+	const double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	GbrcStats st;
+	GbrcMeasure(result, &st);
+	fprintf(stderr,
+		"%s: %u commands, %u recorded segments, %u emitted, burn %.0f steps, rapid %.0f steps, "
+		"estimated %.1f s, compiled in %.3f s\n",
+		in_path, c.commands, source->count, result->count, st.burn, st.rapid, st.seconds, elapsed);
+	// the bounds the machine checks against its soft limits (preflight.h)
+	Preflight pf;
+	PreflightReset(&pf, 0, 0);
+	for( unsigned i = 0; i < result->count; ++i ) {
+		PreflightSegment(&pf, &result->items[i]);
+	}
+	fprintf(stderr, "%s: travel x %d..%d y %d..%d, burn x %d..%d y %d..%d steps from the job origin\n",
+		in_path, pf.travel.xmin, pf.travel.xmax, pf.travel.ymin, pf.travel.ymax,
+		pf.burn.xmin, pf.burn.xmax, pf.burn.ymin, pf.burn.ymax);
+
+	int ok = 1;
+	if( raster_path || pbm_path ) {
+		Bitmap bitmap;
+		BitmapFromSegments(&bitmap, source);
+		fprintf(stderr, "%s: layer %dx%d steps at (%d,%d), %lu pixels, hash %016llx\n",
+			in_path, bitmap.w, bitmap.h, bitmap.x0, bitmap.y0, BitmapCount(&bitmap), BitmapHash(&bitmap));
+		if( raster_path ) {
+			ScanStats ss;
+			ok = ScanWriteRaster(raster_path, &bitmap, &ss);
+			fprintf(stderr, "%s: raster %u rows in %u records (%u xor), %lu bytes (%.2fx smaller than a bitmap), "
+				"travel %llu + %llu steps, estimated %.1f s (vector %.1f s)\n",
+				in_path, ss.rows, ss.records, ss.xor_records, ss.bytes,
+				ss.bytes ? (double)(ss.pixel_bytes + RASTER_HEADER_SIZE) / ss.bytes : 0.0,
+				ss.travel, ss.length, ss.seconds, st.seconds);
+		}
+		if( ok && pbm_path ) {
+			ok = BitmapWritePbm(&bitmap, pbm_path);
+		}
+		BitmapFree(&bitmap);
+	}
+	if( ok && !raster_path ) {
+		ok = GbrcWriteJob(out_path, result);
+	}
+	if( ok && text_path ) {
+		ok = GbrcWriteText(text_path, result);
+	}
+	SegmentListFree(&recorded);
+	SegmentListFree(&outline);
+	SegmentListFree(&ordered);
+	free(c.features);
+	free(outline_features);
+	SegmentListFree(&optimised);
+	return ok ? 0 : 1;
+}
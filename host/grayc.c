@@ -0,0 +1,227 @@
+/*
+ * Grayscale raster compiler.
+ *
+ * Reads a binary PGM image (P5) and writes a raster program of gray rows
+ * (raster.h, RASTER_ROW_GRAY) for the firmware "raster" command, one
+ * image pixel per step. Dark pixels burn: the level sent is 255 for black
+ * and 0 (laser off) for white, unless inverted. Rows run bidirectionally
+ * from the bottom of the image up, trimmed to their burned pixels.
+ *
+ * The power hash printed is what host/simrun reports when the program
+ * runs with the default power curve and every pixel gets its width on
+ * its own step.
+ */
+
+#include <ch.h>
+#include <hal.h>
+#include <chprintf.h>
+
+#include "../segment.c"
+#include "../laser.c"
+#include "../perf.c"
+#include "../motor.c"
+#include "../gerber.c"
+#include "../region.c"
+#include "../coverage.c"
+#include "../macro.c"
+#include "../arena.c"
+#include "../raster.c"
+#include "seglist.c"
+#include "bitmap.c"
+
+typedef struct GraycImage {
+	int w, h;
+	uint8_t* levels; // top row first, as in the file
+} GraycImage;
+
+typedef struct GraycStats {
+	unsigned rows, records;
+	unsigned long bytes, pixels;
+	unsigned long long travel, length;
+	unsigned long long power_hash;
+} GraycStats;
+
+static int GraycSkip(FILE* f) {
+	int c = fgetc(f);
+	while( c == '#' || (c != EOF && c <= ' ') ) {
+		if( c == '#' ) {
+			while( c != EOF && c != '\n' ) {
+				c = fgetc(f);
+			}
+		}
+		c = fgetc(f);
+	}
+	return c == EOF ? 0 : ungetc(c, f) != EOF;
+}
+
+static int GraycReadPgm(const char* path, GraycImage* img, int invert) {
+	FILE* f = fopen(path, "rb");
+	if( f == NULL ) {
+		fprintf(stderr, "grayc: cannot read %s\n", path);
+		return 0;
+	}
+	int maxval = 0;
+	if( fgetc(f) != 'P' || fgetc(f) != '5' || !GraycSkip(f) || fscanf(f, "%d", &img->w) != 1 ||
+		!GraycSkip(f) || fscanf(f, "%d", &img->h) != 1 || !GraycSkip(f) || fscanf(f, "%d", &maxval) != 1 ||
+		maxval <= 0 || maxval > 255 || img->w <= 0 || img->h <= 0 ) {
+		fprintf(stderr, "grayc: %s is not a binary PGM with 8 bit samples\n", path);
+		fclose(f);
+		return 0;
+	}
+	fgetc(f); // the single whitespace before the samples
+	const size_t size = (size_t)img->w * img->h;
+	img->levels = (uint8_t*)malloc(size);
+	if( fread(img->levels, 1, size, f) != size ) {
+		fprintf(stderr, "grayc: %s is truncated\n", path);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	for( size_t i = 0; i < size; ++i ) {
+		const unsigned v = invert ? img->levels[i] : maxval - img->levels[i];
+		img->levels[i] = (v * 255 + maxval / 2) / maxval;
+	}
+	return 1;
+}
+
+static void GraycWriteRow(FILE* f, GraycStats* st, int* hx, int* hy, const uint8_t* levels, int lo, int hi, int y, int reverse) {
+	uint8_t buf[RASTER_ROW_HEADER_SIZE + RASTER_PAYLOAD_MAX];
+	RasterRow row;
+	row.y = y;
+	row.x = reverse ? hi : lo;
+	row.length = hi - lo;
+	row.flags = RASTER_ROW_GRAY | (reverse ? RASTER_ROW_REVERSE : 0);
+	row.size = RasterEncodeGray(levels, hi - lo, buf + RASTER_ROW_HEADER_SIZE);
+	RasterEncodeRowHeader(&row, buf);
+	fwrite(buf, 1, RASTER_ROW_HEADER_SIZE + row.size, f);
+	st->bytes += RASTER_ROW_HEADER_SIZE + row.size;
+	++st->records;
+
+	const unsigned dx = abs(row.x - *hx), dy = abs(y - *hy);
+	st->travel += dx > dy ? dx : dy;
+	st->length += row.length;
+	*hx = reverse ? lo : hi;
+	*hy = y;
+}
+
+/*
+ * Emits the pixels lo..hi - 1 of a row, in records that fit the gray row
+ * limit and the payload limit.
+ */
+static void GraycEmitRow(FILE* f, GraycStats* st, int* hx, int* hy, const uint8_t* levels, int x0, int lo, int hi, int y, int reverse) {
+	static uint8_t payload[2 * RASTER_GRAY_MAX * 3];
+	while( lo < hi ) {
+		int len = hi - lo < RASTER_GRAY_MAX ? hi - lo : RASTER_GRAY_MAX;
+		const int at = reverse ? hi - len : lo;
+		while( RasterEncodeGray(levels + at - x0, len, payload) > RASTER_PAYLOAD_MAX ) {
+			len /= 2;
+		}
+		if( reverse ) {
+			GraycWriteRow(f, st, hx, hy, levels + hi - len - x0, hi - len, hi, y, 1);
+			hi -= len;
+		} else {
+			GraycWriteRow(f, st, hx, hy, levels + lo - x0, lo, lo + len, y, 0);
+			lo += len;
+		}
+	}
+}
+
+static void GraycUsage(void) {
+	fprintf(stderr,
+		"usage: grayc [options] image.pgm\n"
+		"  -o FILE   write the raster program (default: out.ras)\n"
+		"  -x STEPS  X of the left image edge (default 0)\n"
+		"  -y STEPS  Y of the bottom image edge (default 0)\n"
+		"  -i        burn the light pixels instead of the dark ones\n");
+}
+
+int main(int argc, char* argv[]) {
+	const char* out_path = "out.ras";
+	const char* in_path = NULL;
+	int x0 = 0, y0 = 0;
+	int invert = 0;
+
+	for( int i = 1; i < argc; ++i ) {
+		if( strcmp(argv[i], "-o") == 0 && i + 1 < argc ) {
+			out_path = argv[++i];
+		} else if( strcmp(argv[i], "-x") == 0 && i + 1 < argc ) {
+			x0 = atoi(argv[++i]);
+		} else if( strcmp(argv[i], "-y") == 0 && i + 1 < argc ) {
+			y0 = atoi(argv[++i]);
+		} else if( strcmp(argv[i], "-i") == 0 ) {
+			invert = 1;
+		} else if( argv[i][0] != '-' && in_path == NULL ) {
+			in_path = argv[i];
+		} else {
+			GraycUsage();
+			return 2;
+		}
+	}
+	if( in_path == NULL ) {
+		GraycUsage();
+		return 2;
+	}
+
+	GraycImage img;
+	if( !GraycReadPgm(in_path, &img, invert) ) {
+		return 1;
+	}
+	FILE* f = fopen(out_path, "wb");
+	if( f == NULL ) {
+		fprintf(stderr, "grayc: cannot write %s\n", out_path);
+		return 1;
+	}
+	uint8_t header[RASTER_HEADER_SIZE] = { 0 };
+	fwrite(header, 1, sizeof(header), f); // patched with the record count
+
+	// the widths the firmware makes of the levels, for the power hash
+	LaserGrayInit();
+	GraycStats st;
+	memset(&st, 0, sizeof(st));
+	int hx = 0, hy = 0, reverse = 0;
+	for( int r = img.h - 1; r >= 0; --r ) {
+		const uint8_t* levels = img.levels + (size_t)r * img.w;
+		const int y = y0 + img.h - 1 - r;
+		int lo = 0, hi = img.w;
+		while( lo < hi && levels[lo] == 0 ) {
+			++lo;
+		}
+		while( hi > lo && levels[hi - 1] == 0 ) {
+			--hi;
+		}
+		if( lo == hi ) {
+			continue;
+		}
+		for( int x = lo; x < hi; ++x ) {
+			if( laser_gray_table[levels[x]] ) {
+				st.power_hash += BitmapCellHash(x0 + x, y, laser_gray_table[levels[x]]);
+				++st.pixels;
+			}
+		}
+		GraycEmitRow(f, &st, &hx, &hy, levels, x0, x0 + lo, x0 + hi, y, reverse);
+		++st.rows;
+		reverse = !reverse;
+	}
+	st.travel += hx > hy ? hx : hy; // back to the origin
+	const double seconds = (st.travel + st.length) * MOTOR_MICROSTEPPING * (STEP_MEANDR + STEP_WAIT) * 1e-6;
+
+	memcpy(header, RASTER_MAGIC, 4);
+	for( int i = 0; i < 4; ++i ) {
+		header[4 + i] = (st.records >> (8 * i)) & 0xFF;
+	}
+	fseek(f, 0, SEEK_SET);
+	fwrite(header, 1, sizeof(header), f);
+	if( fclose(f) != 0 ) {
+		fprintf(stderr, "grayc: cannot write %s\n", out_path);
+		return 1;
+	}
+	(void)MotorCallback;
+
+	fprintf(stderr, "%s: %dx%d, %u rows in %u records, %lu bytes (%lu as bytes per pixel), "
+		"travel %llu + %llu steps, estimated %.1f s\n",
+		in_path, img.w, img.h, st.rows, st.records, st.bytes + RASTER_HEADER_SIZE,
+		(unsigned long)img.w * img.h, st.travel, st.length, seconds);
+	fprintf(stderr, "%s: %lu pixels burned, power hash %016llx\n", in_path, st.pixels, st.power_hash);
+	free(img.levels);
+	return 0;
+}
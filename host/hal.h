@@ -0,0 +1,188 @@
+#ifndef _HOST_HAL_H
+#define _HOST_HAL_H
+
+/*
+ * Host stand-ins for the HAL drivers the firmware touches: GPIO pads,
+ * the step GPT, the laser PWM, the timer and DMA registers behind the
+ * grayscale power stream, and the shell serial port.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ch.h>
+
+typedef struct {
+	volatile uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef HOST_GPIO[5];
+
+#define GPIOA (&HOST_GPIO[0])
+#define GPIOB (&HOST_GPIO[1])
+#define GPIOC (&HOST_GPIO[2])
+
+#define PAL_MODE_OUTPUT_PUSHPULL 0
+#define PAL_MODE_STM32_ALTERNATE_PUSHPULL 1
+
+void palSetPad(GPIO_TypeDef* port, uint32_t pad);
+void palClearPad(GPIO_TypeDef* port, uint32_t pad);
+#define palSetPadMode(port, pad, mode) ((void)(port), (void)(pad), (void)(mode))
+
+typedef struct GPTDriver GPTDriver;
+typedef void (*gptcallback_t)(GPTDriver*);
+
+typedef struct {
+	uint32_t frequency;
+	gptcallback_t callback;
+	uint32_t cr2;
+	uint32_t dier;
+} GPTConfig;
+
+struct GPTDriver {
+	const GPTConfig* config;
+	int running;
+	uint32_t interval;
+};
+
+extern GPTDriver GPTD1;
+
+typedef struct {
+	volatile uint32_t CR1, CR2, SMCR, DIER, CNT, ARR;
+	volatile uint32_t CCR[4];
+} stm32_tim_t;
+
+extern stm32_tim_t HOST_TIM2;
+extern stm32_tim_t HOST_TIM3;
+
+#define STM32_TIM3 (&HOST_TIM3)
+#define STM32_TIM_CR1_CEN (1u << 0)
+#define STM32_TIM_CR2_MMS(n) ((n) << 4)
+#define STM32_TIM_SMCR_SMS(n) ((n) << 0)
+#define STM32_TIM_SMCR_TS(n) ((n) << 4)
+#define STM32_TIM_DIER_UDE (1u << 8)
+#define rccEnableTIM3(lp) ((void)(lp))
+
+void gptStart(GPTDriver* gptp, const GPTConfig* config);
+void gptStartContinuous(GPTDriver* gptp, uint32_t interval);
+#define gptStartContinuousI gptStartContinuous
+void gptChangeIntervalI(GPTDriver* gptp, uint32_t interval);
+void gptStopTimerI(GPTDriver* gptp);
+#define gptGetIntervalX(gptp) ((gptp)->interval)
+// an interrupt runs at its update event, the timer has not counted yet
+#define gptGetCounterX(gptp) ((void)(gptp), 0u)
+
+/*
+ * The DWT cycle counter, run by the cycle model in sim.c: it follows the
+ * simulated time at STM32_SYSCLK and the stand-ins charge their cycles.
+ */
+#define STM32_SYSCLK 72000000
+
+typedef struct {
+	volatile uint32_t CTRL, CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type HOST_DWT;
+extern CoreDebug_Type HOST_COREDEBUG;
+
+#define DWT (&HOST_DWT)
+#define CoreDebug (&HOST_COREDEBUG)
+#define DWT_CTRL_CYCCNTENA_Msk (1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+
+typedef struct {
+	uint32_t period;
+	stm32_tim_t* tim;
+	unsigned enabled;
+} PWMDriver;
+
+extern PWMDriver PWMD2;
+
+#define PWM_PERCENTAGE_TO_WIDTH(pwmp, percentage) \
+	((uint32_t)(((uint64_t)(pwmp)->period * (percentage)) / 10000))
+
+void pwmEnableChannel(PWMDriver* pwmp, unsigned channel, uint32_t width);
+void pwmDisableChannel(PWMDriver* pwmp, unsigned channel);
+#define pwmEnableChannelI pwmEnableChannel
+#define pwmDisableChannelI pwmDisableChannel
+#define pwmIsChannelEnabledI(pwmp, channel) (((pwmp)->enabled >> (channel)) & 1)
+
+// one DMA channel, memory to a 32 bit register, transfers on TIM3 updates
+typedef struct {
+	volatile uint32_t* peripheral;
+	const uint8_t* memory;
+	uint32_t size;
+	uint32_t mode;
+	int enabled;
+} stm32_dma_stream_t;
+
+extern stm32_dma_stream_t HOST_DMA1_STREAM3;
+
+#define STM32_DMA1_STREAM3 (&HOST_DMA1_STREAM3)
+#define STM32_DMA_CR_DIR_M2P (1u << 4)
+#define STM32_DMA_CR_MINC (1u << 7)
+#define STM32_DMA_CR_PSIZE_HWORD (1u << 8)
+#define STM32_DMA_CR_MSIZE_BYTE 0
+#define STM32_DMA_CR_PL(n) ((n) << 12)
+
+static inline bool dmaStreamAllocate(stm32_dma_stream_t* stp, uint32_t priority, void* func, void* param) {
+	(void)stp;
+	(void)priority;
+	(void)func;
+	(void)param;
+	return false;
+}
+#define dmaStreamSetPeripheral(stp, addr) ((stp)->peripheral = (volatile uint32_t*)(addr))
+#define dmaStreamSetMemory0(stp, addr) ((stp)->memory = (const uint8_t*)(addr))
+#define dmaStreamSetTransactionSize(stp, n) ((stp)->size = (n))
+#define dmaStreamSetMode(stp, m) ((stp)->mode = (m))
+#define dmaStreamEnable(stp) ((stp)->enabled = 1)
+#define dmaStreamDisable(stp) ((stp)->enabled = 0)
+
+typedef struct {
+	FILE* out;
+	FILE* in;
+} BaseSequentialStream;
+
+typedef struct {
+	BaseSequentialStream stream;
+} SerialDriver;
+
+extern SerialDriver SD3;
+
+size_t streamRead(BaseSequentialStream* chp, uint8_t* bp, size_t n);
+
+/*
+ * Simulation state, shared by the host tools.
+ */
+
+// simulated time in GPT ticks (1 MHz for the motor timer)
+extern uint64_t HostSimTicks;
+// number of GPT callbacks (ISR invocations) executed
+extern uint64_t HostSimInterrupts;
+// number of timer starts, one per motion command
+extern uint64_t HostSimMoves;
+// when set, motion completes immediately without stepping; the motion
+// queue (motor.h) is not run then, dry moves go to a sink instead
+extern int HostSimDry;
+// called on every pad change, may be NULL
+extern void (*HostPadHook)(GPIO_TypeDef* port, uint32_t pad, int val);
+// called after every GPT callback, may be NULL
+extern void (*HostTickHook)(void);
+
+// heap accounting, firmware modules allocate through these on the host
+void* HostMalloc(size_t size);
+void HostFree(void* ptr);
+extern size_t HostHeapUsed;
+extern size_t HostHeapPeak;
+
+#define malloc HostMalloc
+#define free HostFree
+
+#endif // _HOST_HAL_H
@@ -0,0 +1,490 @@
+
+#include <time.h>
+#include "order.h"
+
+#define ORDER_NEIGHBOURS 8 // candidates per end point
+#define ORDER_CHAIN_MAX 3 // longest run moved by Or-opt
+
+typedef struct OrderGrid {
+	int x0, y0;
+	int cell;
+	int w, h;
+	unsigned* start; // per cell, first entry in 'items'
+	unsigned* items; // feature indexes, listed once per end point
+} OrderGrid;
+
+typedef struct OrderTour {
+	const Feature* f;
+	unsigned n;
+	unsigned* tour; // position -> feature
+	unsigned* pos; // feature -> position
+	unsigned char* rev; // feature is traversed backwards
+	unsigned* neigh; // 2 * ORDER_NEIGHBOURS candidates per feature
+	int px, py; // head position before the first feature
+	OrderGrid grid;
+} OrderTour;
+
+static long long OrderDist(int x0, int y0, int x1, int y1) {
+	const long long dx = llabs((long long)x1 - x0);
+	const long long dy = llabs((long long)y1 - y0);
+	return dx > dy ? dx : dy;
+}
+
+static void OrderStart(const OrderTour* t, unsigned f, int* x, int* y) {
+	*x = t->rev[f] ? t->f[f].ex : t->f[f].sx;
+	*y = t->rev[f] ? t->f[f].ey : t->f[f].sy;
+}
+
+static void OrderEnd(const OrderTour* t, unsigned f, int* x, int* y) {
+	*x = t->rev[f] ? t->f[f].sx : t->f[f].ex;
+	*y = t->rev[f] ? t->f[f].sy : t->f[f].ey;
+}
+
+// where the head is before tour position i
+static void OrderBefore(const OrderTour* t, unsigned i, int* x, int* y) {
+	if( i == 0 ) {
+		*x = t->px;
+		*y = t->py;
+	} else {
+		OrderEnd(t, t->tour[i - 1], x, y);
+	}
+}
+
+static int OrderGridCell(const OrderGrid* g, int x, int y, int* cx, int* cy) {
+	*cx = (x - g->x0) / g->cell;
+	*cy = (y - g->y0) / g->cell;
+	return *cy * g->w + *cx;
+}
+
+static void OrderGridBuild(OrderTour* t) {
+	OrderGrid* g = &t->grid;
+	int x1, y1;
+	g->x0 = x1 = t->f[0].sx;
+	g->y0 = y1 = t->f[0].sy;
+	for( unsigned i = 0; i < t->n; ++i ) {
+		const Feature* f = &t->f[i];
+		g->x0 = f->sx < g->x0 ? f->sx : g->x0;
+		g->x0 = f->ex < g->x0 ? f->ex : g->x0;
+		g->y0 = f->sy < g->y0 ? f->sy : g->y0;
+		g->y0 = f->ey < g->y0 ? f->ey : g->y0;
+		x1 = f->sx > x1 ? f->sx : x1;
+		x1 = f->ex > x1 ? f->ex : x1;
+		y1 = f->sy > y1 ? f->sy : y1;
+		y1 = f->ey > y1 ? f->ey : y1;
+	}
+	const double area = ((double)x1 - g->x0 + 1) * ((double)y1 - g->y0 + 1);
+	g->cell = (int)sqrt(area / t->n) + 1;
+	g->w = (x1 - g->x0) / g->cell + 1;
+	g->h = (y1 - g->y0) / g->cell + 1;
+
+	const unsigned cells = g->w * g->h;
+	g->start = (unsigned*)malloc((cells + 1) * sizeof(unsigned));
+	g->items = (unsigned*)malloc(2 * t->n * sizeof(unsigned));
+	memset(g->start, 0, (cells + 1) * sizeof(unsigned));
+
+	// counting sort of the end points into cells
+	int cx, cy;
+	for( unsigned i = 0; i < t->n; ++i ) {
+		const int a = OrderGridCell(g, t->f[i].sx, t->f[i].sy, &cx, &cy);
+		const int b = OrderGridCell(g, t->f[i].ex, t->f[i].ey, &cx, &cy);
+		++g->start[a + 1];
+		if( b != a ) {
+			++g->start[b + 1];
+		}
+	}
+	for( unsigned c = 0; c < cells; ++c ) {
+		g->start[c + 1] += g->start[c];
+	}
+	unsigned* fill = (unsigned*)malloc(cells * sizeof(unsigned));
+	memcpy(fill, g->start, cells * sizeof(unsigned));
+	for( unsigned i = 0; i < t->n; ++i ) {
+		const int a = OrderGridCell(g, t->f[i].sx, t->f[i].sy, &cx, &cy);
+		const int b = OrderGridCell(g, t->f[i].ex, t->f[i].ey, &cx, &cy);
+		g->items[fill[a]++] = i;
+		if( b != a ) {
+			g->items[fill[b]++] = i;
+		}
+	}
+	free(fill);
+}
+
+/*
+ * Visits the grid in rings around (x, y), keeping the 'k' nearest features
+ * not flagged in 'skip' (sorted, nearest first). Returns how many were found.
+ */
+static unsigned OrderGridNearest(const OrderTour* t, int x, int y, const unsigned char* skip,
+	unsigned k, unsigned* found, long long* dist, unsigned char* reversed) {
+
+	const OrderGrid* g = &t->grid;
+	int qx, qy;
+	const int max_ring = g->w > g->h ? g->w : g->h;
+	unsigned count = 0;
+
+	qx = x < g->x0 ? 0 : (x - g->x0) / g->cell;
+	qy = y < g->y0 ? 0 : (y - g->y0) / g->cell;
+	qx = qx >= g->w ? g->w - 1 : qx;
+	qy = qy >= g->h ? g->h - 1 : qy;
+
+	for( int r = 0; r <= max_ring; ++r ) {
+		for( int cy = qy - r; cy <= qy + r; ++cy ) {
+			if( cy < 0 || cy >= g->h ) {
+				continue;
+			}
+			const int on_edge = cy == qy - r || cy == qy + r;
+			for( int cx = qx - r; cx <= qx + r; cx += on_edge ? 1 : 2 * r ) {
+				if( cx >= 0 && cx < g->w ) {
+					const int c = cy * g->w + cx;
+					for( unsigned e = g->start[c]; e < g->start[c + 1]; ++e ) {
+						const unsigned f = g->items[e];
+						if( skip && skip[f] ) {
+							continue;
+						}
+						const long long ds = OrderDist(x, y, t->f[f].sx, t->f[f].sy);
+						const long long de = OrderDist(x, y, t->f[f].ex, t->f[f].ey);
+						const long long d = ds <= de ? ds : de;
+						unsigned at = count;
+						int dup = 0;
+						for( unsigned q = 0; q < count; ++q ) {
+							if( found[q] == f ) {
+								dup = 1;
+							}
+						}
+						if( dup ) {
+							continue;
+						}
+						while( at > 0 && dist[at - 1] > d ) {
+							--at;
+						}
+						if( at >= k ) {
+							continue;
+						}
+						const unsigned last = count < k ? count : k - 1;
+						for( unsigned q = last; q > at; --q ) {
+							found[q] = found[q - 1];
+							dist[q] = dist[q - 1];
+							if( reversed ) {
+								reversed[q] = reversed[q - 1];
+							}
+						}
+						found[at] = f;
+						dist[at] = d;
+						if( reversed ) {
+							reversed[at] = de < ds;
+						}
+						if( count < k ) {
+							++count;
+						}
+					}
+				}
+				if( r == 0 ) {
+					break;
+				}
+			}
+		}
+		// cells beyond ring r are at least r * cell away
+		if( count == k && dist[count - 1] <= (long long)r * g->cell ) {
+			break;
+		}
+	}
+	return count;
+}
+
+static void OrderNearestNeighbour(OrderTour* t) {
+	unsigned char* visited = (unsigned char*)malloc(t->n);
+	memset(visited, 0, t->n);
+	int x = t->px, y = t->py;
+	for( unsigned i = 0; i < t->n; ++i ) {
+		unsigned f;
+		long long d;
+		unsigned char reversed;
+		OrderGridNearest(t, x, y, visited, 1, &f, &d, &reversed);
+		visited[f] = 1;
+		t->rev[f] = reversed;
+		t->tour[i] = f;
+		t->pos[f] = i;
+		OrderEnd(t, f, &x, &y);
+	}
+	free(visited);
+}
+
+static void OrderNeighbours(OrderTour* t) {
+	t->neigh = (unsigned*)malloc(t->n * 2 * ORDER_NEIGHBOURS * sizeof(unsigned));
+	long long dist[ORDER_NEIGHBOURS + 1];
+	for( unsigned f = 0; f < t->n; ++f ) {
+		unsigned* out = &t->neigh[f * 2 * ORDER_NEIGHBOURS];
+		unsigned a = OrderGridNearest(t, t->f[f].sx, t->f[f].sy, NULL, ORDER_NEIGHBOURS, out, dist, NULL);
+		unsigned b = OrderGridNearest(t, t->f[f].ex, t->f[f].ey, NULL, ORDER_NEIGHBOURS, out + ORDER_NEIGHBOURS, dist, NULL);
+		for( unsigned q = a; q < ORDER_NEIGHBOURS; ++q ) {
+			out[q] = f;
+		}
+		for( unsigned q = b; q < ORDER_NEIGHBOURS; ++q ) {
+			out[ORDER_NEIGHBOURS + q] = f;
+		}
+	}
+}
+
+static void OrderReverse(OrderTour* t, unsigned i, unsigned j) {
+	while( i < j ) {
+		const unsigned a = t->tour[i];
+		t->tour[i] = t->tour[j];
+		t->tour[j] = a;
+		t->pos[t->tour[i]] = i;
+		t->pos[t->tour[j]] = j;
+		t->rev[t->tour[i]] ^= 1;
+		t->rev[t->tour[j]] ^= 1;
+		++i;
+		--j;
+	}
+	if( i == j ) {
+		t->rev[t->tour[i]] ^= 1;
+	}
+}
+
+static int OrderTwoOpt(OrderTour* t, unsigned i) {
+	int px, py, sx, sy, ex, ey, nx, ny;
+	OrderBefore(t, i, &px, &py);
+	OrderStart(t, t->tour[i], &sx, &sy);
+	const unsigned* cand = &t->neigh[(i ? t->tour[i - 1] : t->tour[0]) * 2 * ORDER_NEIGHBOURS];
+
+	for( unsigned c = 0; c < 2 * ORDER_NEIGHBOURS; ++c ) {
+		const unsigned j = t->pos[cand[c]];
+		if( j < i ) {
+			continue;
+		}
+		OrderEnd(t, t->tour[j], &ex, &ey);
+		long long old_cost = OrderDist(px, py, sx, sy);
+		long long new_cost = OrderDist(px, py, ex, ey);
+		if( j + 1 < t->n ) {
+			OrderStart(t, t->tour[j + 1], &nx, &ny);
+			old_cost += OrderDist(ex, ey, nx, ny);
+			new_cost += OrderDist(sx, sy, nx, ny);
+		}
+		if( new_cost < old_cost ) {
+			OrderReverse(t, i, j);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void OrderMoveChain(OrderTour* t, unsigned i, unsigned len, int after, int reversed) {
+	unsigned* tmp = (unsigned*)malloc(t->n * sizeof(unsigned));
+	unsigned out = 0;
+	if( after < 0 ) {
+		for( unsigned q = 0; q < len; ++q ) {
+			tmp[out++] = t->tour[reversed ? i + len - 1 - q : i + q];
+		}
+	}
+	for( unsigned p = 0; p < t->n; ++p ) {
+		if( p >= i && p < i + len ) {
+			continue;
+		}
+		tmp[out++] = t->tour[p];
+		if( (int)p == after ) {
+			for( unsigned q = 0; q < len; ++q ) {
+				tmp[out++] = t->tour[reversed ? i + len - 1 - q : i + q];
+			}
+		}
+	}
+	if( reversed ) {
+		for( unsigned q = 0; q < len; ++q ) {
+			t->rev[t->tour[i + q]] ^= 1;
+		}
+	}
+	memcpy(t->tour, tmp, t->n * sizeof(unsigned));
+	for( unsigned p = 0; p < t->n; ++p ) {
+		t->pos[t->tour[p]] = p;
+	}
+	free(tmp);
+}
+
+static int OrderOrOpt(OrderTour* t, unsigned i) {
+	int px, py, sx, sy, ex, ey, qx, qy, kx, ky, nx, ny;
+
+	for( unsigned len = 1; len <= ORDER_CHAIN_MAX && i + len <= t->n; ++len ) {
+		OrderBefore(t, i, &px, &py);
+		OrderStart(t, t->tour[i], &sx, &sy);
+		OrderEnd(t, t->tour[i + len - 1], &ex, &ey);
+		long long gain = OrderDist(px, py, sx, sy);
+		if( i + len < t->n ) {
+			OrderStart(t, t->tour[i + len], &qx, &qy);
+			gain += OrderDist(ex, ey, qx, qy) - OrderDist(px, py, qx, qy);
+		}
+
+		const unsigned* cand[2] = {
+			&t->neigh[t->tour[i] * 2 * ORDER_NEIGHBOURS],
+			&t->neigh[t->tour[i + len - 1] * 2 * ORDER_NEIGHBOURS]
+		};
+		for( int list = 0; list < 2; ++list ) {
+			for( unsigned c = 0; c < 2 * ORDER_NEIGHBOURS; ++c ) {
+				const int k = (int)t->pos[cand[list][c]];
+				if( k >= (int)i - 1 && k < (int)(i + len) ) {
+					continue;
+				}
+				OrderEnd(t, t->tour[k], &kx, &ky);
+				long long fwd = OrderDist(kx, ky, sx, sy);
+				long long rev = OrderDist(kx, ky, ex, ey);
+				if( k + 1 < (int)t->n ) {
+					OrderStart(t, t->tour[k + 1], &nx, &ny);
+					const long long base = OrderDist(kx, ky, nx, ny);
+					fwd += OrderDist(ex, ey, nx, ny) - base;
+					rev += OrderDist(sx, sy, nx, ny) - base;
+				}
+				if( fwd < gain || rev < gain ) {
+					OrderMoveChain(t, i, len, k, rev < fwd);
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static long long OrderCost(const OrderTour* t) {
+	long long cost = 0;
+	int x = t->px, y = t->py, sx, sy;
+	for( unsigned i = 0; i < t->n; ++i ) {
+		OrderStart(t, t->tour[i], &sx, &sy);
+		cost += OrderDist(x, y, sx, sy);
+		OrderEnd(t, t->tour[i], &x, &y);
+	}
+	return cost;
+}
+
+static void OrderEmit(const OrderTour* t, const SegmentList* in, SegmentList* out, int* x, int* y) {
+	for( unsigned i = 0; i < t->n; ++i ) {
+		const unsigned f = t->tour[i];
+		const Feature* ft = &t->f[f];
+		int sx, sy;
+		OrderStart(t, f, &sx, &sy);
+		SegmentListMove(out, sx - *x, sy - *y, SEGMENT_RAPID);
+		for( unsigned k = 0; k < ft->count; ++k ) {
+			Segment s = in->items[t->rev[f] ? ft->first + ft->count - 1 - k : ft->first + k];
+			if( t->rev[f] ) {
+				s.dx = -s.dx;
+				s.dy = -s.dy;
+			}
+			SegmentListPush(out, &s);
+		}
+		OrderEnd(t, f, x, y);
+	}
+}
+
+/*
+ * Fills in the feature end points and drops the leading and trailing
+ * positioning moves, which are regenerated as rapids. Returns the number
+ * of features left.
+ */
+static unsigned OrderPrepare(const SegmentList* in, Feature* features, unsigned count, int* final_x, int* final_y) {
+	int x = 0, y = 0;
+	unsigned at = 0, kept = 0;
+	for( unsigned i = 0; i < count; ++i ) {
+		Feature f = features[i];
+		for( ; at < f.first; ++at ) {
+			x += in->items[at].dx;
+			y += in->items[at].dy;
+		}
+		while( f.count && !(in->items[f.first].flags & SEGMENT_LASER) ) {
+			x += in->items[f.first].dx;
+			y += in->items[f.first].dy;
+			++f.first;
+			--f.count;
+		}
+		at = f.first;
+		f.sx = x;
+		f.sy = y;
+		while( f.count && !(in->items[f.first + f.count - 1].flags & SEGMENT_LASER) ) {
+			--f.count;
+		}
+		f.ex = x;
+		f.ey = y;
+		for( unsigned k = 0; k < f.count; ++k ) {
+			f.ex += in->items[f.first + k].dx;
+			f.ey += in->items[f.first + k].dy;
+		}
+		if( f.count ) {
+			features[kept++] = f;
+		}
+	}
+	for( ; at < in->count; ++at ) {
+		x += in->items[at].dx;
+		y += in->items[at].dy;
+	}
+	*final_x = x;
+	*final_y = y;
+	return kept;
+}
+
+void OrderFeatures(const SegmentList* in, Feature* features, unsigned count,
+	unsigned budget_ms, SegmentList* out, OrderStats* st) {
+
+	const clock_t started = clock();
+	const clock_t deadline = started + (clock_t)((double)budget_ms * CLOCKS_PER_SEC / 1000);
+	int final_x, final_y;
+
+	memset(st, 0, sizeof(*st));
+	count = OrderPrepare(in, features, count, &final_x, &final_y);
+	st->features = count;
+
+	int x = 0, y = 0, bx = 0, by = 0;
+	for( unsigned b = 0; b < count; ) {
+		unsigned e = b;
+		while( e < count && features[e].block == features[b].block ) {
+			++e;
+		}
+
+		OrderTour t;
+		memset(&t, 0, sizeof(t));
+		t.f = &features[b];
+		t.n = e - b;
+		t.tour = (unsigned*)malloc(t.n * sizeof(unsigned));
+		t.pos = (unsigned*)malloc(t.n * sizeof(unsigned));
+		t.rev = (unsigned char*)malloc(t.n);
+		memset(t.rev, 0, t.n);
+
+		// file order, for the report
+		t.px = bx;
+		t.py = by;
+		for( unsigned i = 0; i < t.n; ++i ) {
+			t.tour[i] = t.pos[i] = i;
+		}
+		st->before += OrderCost(&t);
+		OrderEnd(&t, t.tour[t.n - 1], &bx, &by);
+
+		t.px = x;
+		t.py = y;
+		OrderGridBuild(&t);
+		OrderNearestNeighbour(&t);
+		OrderNeighbours(&t);
+
+		int improved = 1;
+		while( improved && clock() < deadline ) {
+			improved = 0;
+			for( unsigned i = 0; i < t.n; ++i ) {
+				if( OrderTwoOpt(&t, i) || OrderOrOpt(&t, i) ) {
+					improved = 1;
+					++st->moves;
+				}
+				if( (i & 63) == 0 && clock() >= deadline ) {
+					break;
+				}
+			}
+		}
+
+		st->after += OrderCost(&t);
+		OrderEmit(&t, in, out, &x, &y);
+
+		free(t.tour);
+		free(t.pos);
+		free(t.rev);
+		free(t.neigh);
+		free(t.grid.start);
+		free(t.grid.items);
+		b = e;
+	}
+
+	st->before += OrderDist(bx, by, final_x, final_y);
+	st->after += OrderDist(x, y, final_x, final_y);
+	SegmentListMove(out, final_x - x, final_y - y, SEGMENT_RAPID);
+	st->seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+}
@@ -0,0 +1,40 @@
+#ifndef _HOST_ORDER_H
+#define _HOST_ORDER_H
+
+#include "seglist.h"
+
+/*
+ * Travel-order optimisation of recorded features.
+ *
+ * A feature is a flash or a chain of connected strokes: a run of recorded
+ * segments whose geometry does not depend on where the head came from.
+ * Features are reordered (and may be traversed backwards) to minimise the
+ * rapid travel between them. Features never move across blocks, blocks
+ * are started on polarity changes so the layer order is preserved.
+ */
+
+typedef struct Feature {
+	unsigned first; // index of the first recorded segment
+	unsigned count;
+	unsigned block;
+	int sx, sy; // absolute start, after the leading positioning moves
+	int ex, ey; // absolute end
+} Feature;
+
+typedef struct OrderStats {
+	unsigned features;
+	unsigned moves; // accepted 2-opt and Or-opt moves
+	long long before; // rapid travel in file order, steps
+	long long after;
+	double seconds;
+} OrderStats;
+
+/*
+ * Builds the reordered program into 'out': rapids between features and
+ * the features' own segments. Travel is measured as max(|dx|, |dy|),
+ * which is what a silent move costs the step engine.
+ */
+void OrderFeatures(const SegmentList* in, Feature* features, unsigned count,
+	unsigned budget_ms, SegmentList* out, OrderStats* st);
+
+#endif // _HOST_ORDER_H
@@ -0,0 +1,269 @@
+
+#include <time.h>
+#include "outline.h"
+
+// a contour point may be dropped when it is this close to the simplified line, steps
+#define OUTLINE_TOLERANCE 0.75
+
+typedef struct OutlinePoint {
+	int x, y;
+} OutlinePoint;
+
+typedef struct OutlineState {
+	int w, h; // grid, the centres bitmap with a margin
+	int x0, y0; // step coordinates of grid cell (0, 0)
+	uint32_t* dist; // squared distance to the nearest centre, capped
+	uint8_t* mark; // boundary cells not yet on a contour
+	OutlinePoint* chain;
+	unsigned chain_count, chain_capacity;
+	uint8_t* keep;
+	SegmentList* out;
+	int hx, hy; // head position at the end of 'out'
+	Feature* features;
+	unsigned feature_count, feature_capacity;
+	OutlineStats* st;
+} OutlineState;
+
+/*
+ * One dimension of the squared Euclidean distance transform (Felzenszwalb
+ * and Huttenlocher): lower envelope of the parabolas rooted at f.
+ */
+static void OutlineTransform1D(const int64_t* f, int n, int64_t* d, int* v, int64_t* z) {
+	int k = 0;
+	v[0] = 0;
+	z[0] = INT64_MIN;
+	z[1] = INT64_MAX;
+	for( int q = 1; q < n; ++q ) {
+		for( ;; ) {
+			const int p = v[k];
+			// intersection of the parabolas of q and p, rounded up
+			const int64_t num = (f[q] + (int64_t)q * q) - (f[p] + (int64_t)p * p);
+			const int64_t den = 2 * (q - p);
+			const int64_t s = num >= 0 ? (num + den - 1) / den : -((-num) / den);
+			if( s <= z[k] ) {
+				--k;
+				continue;
+			}
+			++k;
+			v[k] = q;
+			z[k] = s;
+			z[k + 1] = INT64_MAX;
+			break;
+		}
+	}
+	k = 0;
+	for( int q = 0; q < n; ++q ) {
+		while( z[k + 1] <= q ) {
+			++k;
+		}
+		const int64_t dq = q - v[k];
+		d[q] = dq * dq + f[v[k]];
+	}
+}
+
+static void OutlineDistance(OutlineState* s, const Bitmap* centres, uint32_t cap) {
+	const int n = s->w > s->h ? s->w : s->h;
+	// far enough not to win against any centre and not to overflow
+	const int64_t far = (int64_t)4 * n * n + 1;
+	int64_t* f = (int64_t*)malloc(n * sizeof(int64_t));
+	int64_t* d = (int64_t*)malloc(n * sizeof(int64_t));
+	int64_t* z = (int64_t*)malloc((n + 1) * sizeof(int64_t));
+	int* v = (int*)malloc(n * sizeof(int));
+	int64_t* column = (int64_t*)malloc((size_t)s->w * s->h * sizeof(int64_t));
+
+	for( int x = 0; x < s->w; ++x ) {
+		for( int y = 0; y < s->h; ++y ) {
+			f[y] = BitmapGet(centres, s->x0 + x, s->y0 + y) ? 0 : far;
+		}
+		OutlineTransform1D(f, s->h, d, v, z);
+		for( int y = 0; y < s->h; ++y ) {
+			column[(size_t)y * s->w + x] = d[y];
+		}
+	}
+	for( int y = 0; y < s->h; ++y ) {
+		OutlineTransform1D(column + (size_t)y * s->w, s->w, d, v, z);
+		for( int x = 0; x < s->w; ++x ) {
+			s->dist[(size_t)y * s->w + x] = d[x] < cap ? (uint32_t)d[x] : cap;
+		}
+	}
+	free(column);
+	free(v);
+	free(z);
+	free(d);
+	free(f);
+}
+
+static void OutlinePush(OutlineState* s, int x, int y) {
+	if( s->chain_count == s->chain_capacity ) {
+		s->chain_capacity = s->chain_capacity ? s->chain_capacity * 2 : 1024;
+		OutlinePoint* grown = (OutlinePoint*)malloc(s->chain_capacity * sizeof(OutlinePoint));
+		memcpy(grown, s->chain, s->chain_count * sizeof(OutlinePoint));
+		free(s->chain);
+		s->chain = grown;
+		free(s->keep);
+		s->keep = (uint8_t*)malloc(s->chain_capacity);
+	}
+	s->chain[s->chain_count].x = x;
+	s->chain[s->chain_count].y = y;
+	++s->chain_count;
+	s->mark[(size_t)y * s->w + x] = 0;
+}
+
+/*
+ * Follows unvisited boundary cells from the chain end, straight
+ * neighbours first so the walk keeps to the contour.
+ */
+static void OutlineFollow(OutlineState* s) {
+	static const int dx[8] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+	static const int dy[8] = { 0, 1, 0, -1, 1, 1, -1, -1 };
+	for( ;; ) {
+		const OutlinePoint p = s->chain[s->chain_count - 1];
+		int next = -1;
+		for( int k = 0; k < 8 && next < 0; ++k ) {
+			const int x = p.x + dx[k], y = p.y + dy[k];
+			if( x >= 0 && y >= 0 && x < s->w && y < s->h && s->mark[(size_t)y * s->w + x] ) {
+				next = k;
+			}
+		}
+		if( next < 0 ) {
+			return;
+		}
+		OutlinePush(s, p.x + dx[next], p.y + dy[next]);
+	}
+}
+
+// Douglas-Peucker over chain[a..b], both ends kept
+static void OutlineSimplify(OutlineState* s, unsigned a, unsigned b) {
+	while( b > a + 1 ) {
+		const OutlinePoint* pa = &s->chain[a];
+		const OutlinePoint* pb = &s->chain[b];
+		const double lx = pb->x - pa->x, ly = pb->y - pa->y;
+		const double len = hypot(lx, ly);
+		double worst = -1;
+		unsigned at = a;
+		for( unsigned i = a + 1; i < b; ++i ) {
+			const double px = s->chain[i].x - pa->x, py = s->chain[i].y - pa->y;
+			const double e = len > 0 ? fabs(px * ly - py * lx) / len : hypot(px, py);
+			if( e > worst ) {
+				worst = e;
+				at = i;
+			}
+		}
+		if( worst <= OUTLINE_TOLERANCE ) {
+			return;
+		}
+		s->keep[at] = 1;
+		OutlineSimplify(s, a, at);
+		a = at;
+	}
+}
+
+static void OutlineEmitChain(OutlineState* s) {
+	if( s->chain_count < 2 ) {
+		return; // a lone cell has no length to burn
+	}
+	// close the loop when the walk came back next to its start
+	const OutlinePoint first = s->chain[0], last = s->chain[s->chain_count - 1];
+	if( s->chain_count > 2 && abs(first.x - last.x) <= 1 && abs(first.y - last.y) <= 1 ) {
+		OutlinePush(s, first.x, first.y);
+	}
+	memset(s->keep, 0, s->chain_count);
+	s->keep[0] = s->keep[s->chain_count - 1] = 1;
+	OutlineSimplify(s, 0, s->chain_count - 1);
+
+	if( s->feature_count == s->feature_capacity ) {
+		s->feature_capacity = s->feature_capacity ? s->feature_capacity * 2 : 256;
+		Feature* grown = (Feature*)malloc(s->feature_capacity * sizeof(Feature));
+		memcpy(grown, s->features, s->feature_count * sizeof(Feature));
+		free(s->features);
+		s->features = grown;
+	}
+	Feature* f = &s->features[s->feature_count++];
+	memset(f, 0, sizeof(*f));
+	f->first = s->out->count;
+
+	int x = s->x0 + first.x, y = s->y0 + first.y;
+	SegmentListMove(s->out, x - s->hx, y - s->hy, 0);
+	for( unsigned i = 1; i < s->chain_count; ++i ) {
+		if( s->keep[i] ) {
+			const int nx = s->x0 + s->chain[i].x, ny = s->y0 + s->chain[i].y;
+			SegmentListMove(s->out, nx - x, ny - y, SEGMENT_LASER);
+			x = nx;
+			y = ny;
+			++s->st->points;
+		}
+	}
+	s->hx = x;
+	s->hy = y;
+	f->count = s->out->count - f->first;
+	++s->st->contours;
+}
+
+static void OutlinePass(OutlineState* s, uint32_t level) {
+	// boundary: inside the grown region with a straight neighbour outside
+	for( int y = 0; y < s->h; ++y ) {
+		for( int x = 0; x < s->w; ++x ) {
+			const size_t i = (size_t)y * s->w + x;
+			int edge = 0;
+			if( s->dist[i] <= level ) {
+				edge = (x > 0 && s->dist[i - 1] > level) || (x + 1 < s->w && s->dist[i + 1] > level) ||
+					(y > 0 && s->dist[i - s->w] > level) || (y + 1 < s->h && s->dist[i + s->w] > level);
+			}
+			s->mark[i] = edge;
+			s->st->pixels += edge;
+		}
+	}
+	for( int y = 0; y < s->h; ++y ) {
+		for( int x = 0; x < s->w; ++x ) {
+			if( !s->mark[(size_t)y * s->w + x] ) {
+				continue;
+			}
+			s->chain_count = 0;
+			OutlinePush(s, x, y);
+			OutlineFollow(s);
+			// and the other way from the start
+			for( unsigned i = 0, j = s->chain_count - 1; i < j; ++i, --j ) {
+				const OutlinePoint t = s->chain[i];
+				s->chain[i] = s->chain[j];
+				s->chain[j] = t;
+			}
+			OutlineFollow(s);
+			OutlineEmitChain(s);
+		}
+	}
+}
+
+void OutlineBuild(const Bitmap* centres, int tool_radius, unsigned passes,
+	SegmentList* out, Feature** features, unsigned* feature_count, OutlineStats* st) {
+	const clock_t start = clock();
+	OutlineState s;
+	memset(&s, 0, sizeof(s));
+	memset(st, 0, sizeof(*st));
+	const int step = 2 * (tool_radius > 0 ? tool_radius : 1);
+	const int reach = step * passes;
+	const int margin = reach + 2;
+	s.w = centres->w + 2 * margin;
+	s.h = centres->h + 2 * margin;
+	s.x0 = centres->x0 - margin;
+	s.y0 = centres->y0 - margin;
+	s.out = out;
+	s.st = st;
+	st->passes = passes;
+
+	if( centres->w && centres->h ) {
+		s.dist = (uint32_t*)malloc((size_t)s.w * s.h * sizeof(uint32_t));
+		s.mark = (uint8_t*)malloc((size_t)s.w * s.h);
+		OutlineDistance(&s, centres, (uint32_t)(reach + 1) * (reach + 1));
+		for( unsigned k = 0; k < passes; ++k ) {
+			const uint32_t r = step * (k + 1);
+			OutlinePass(&s, r * r);
+		}
+		free(s.mark);
+		free(s.dist);
+	}
+	free(s.chain);
+	free(s.keep);
+	*features = s.features;
+	*feature_count = s.feature_count;
+	st->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+}
@@ -0,0 +1,33 @@
+#ifndef _HOST_OUTLINE_H
+#define _HOST_OUTLINE_H
+
+#include "bitmap.h"
+#include "order.h"
+
+/*
+ * Isolation (outline) mode: instead of filling the copper, burn contours
+ * around it. The copper is the union of the aperture shapes, which is
+ * the rendered tool centres (BitmapFromSegments) grown by the tool
+ * radius. Pass k runs at tool_radius + k * tool_width outside of it, so
+ * its tool centres lie on the boundary of the centres grown by
+ * 2 * (k + 1) * tool_radius. Growing uses an exact integer Euclidean
+ * distance transform, so touching and overlapping shapes merge exactly
+ * and no polygon clipping is involved.
+ */
+
+typedef struct OutlineStats {
+	unsigned passes;
+	unsigned contours;
+	unsigned long pixels; // contour pixels burned
+	unsigned long points; // polyline points after simplification
+	double seconds;
+} OutlineStats;
+
+/*
+ * Writes the contours into 'out' as positioning moves and burns starting
+ * from (0, 0), one feature per contour for the travel ordering.
+ */
+void OutlineBuild(const Bitmap* centres, int tool_radius, unsigned passes,
+	SegmentList* out, Feature** features, unsigned* feature_count, OutlineStats* st);
+
+#endif // _HOST_OUTLINE_H
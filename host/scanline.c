@@ -0,0 +1,349 @@
+
+#include "scanline.h"
+
+/*
+ * Runs on a row closer than this are engraved in one pass, wider gaps
+ * split the row into pieces. Pieces touching from row to row form a
+ * cluster, clusters are engraved one after another so the head never
+ * sweeps over empty board between separate areas.
+ */
+#define SCAN_GAP 48
+
+typedef struct ScanPiece {
+	int y;
+	int a, b; // first and last burned pixel
+	unsigned cluster;
+} ScanPiece;
+
+typedef struct ScanCluster {
+	unsigned first, count; // pieces, sorted by row
+	int x0, x1, y0, y1;
+	int done;
+} ScanCluster;
+
+typedef struct ScanState {
+	FILE* f;
+	const Bitmap* b;
+	ScanStats* st;
+	int hx, hy; // head position
+	RasterRow rows[2];
+	const RasterRow* prev; // last row as the firmware decoded it
+} ScanState;
+
+/*
+ * Writes a row with its spans filled in: the payload is the plain runs
+ * or the runs XORed with the previous row, whichever is shorter. The
+ * record is decoded back as the firmware will, the result is the base
+ * of the next row.
+ */
+static void ScanWriteRow(ScanState* s, RasterRow* row) {
+	static int16_t base[RASTER_EDGES_MAX], diff[RASTER_EDGES_MAX];
+	uint8_t buf[RASTER_ROW_HEADER_SIZE + RASTER_PAYLOAD_MAX];
+	uint8_t* payload = buf + RASTER_ROW_HEADER_SIZE;
+	uint8_t xored[RASTER_PAYLOAD_MAX];
+	int lo, hi;
+	RasterRowRange(row, &lo, &hi);
+
+	row->size = RasterEncodeRuns(row->spans, row->spans_count, lo, hi, payload);
+	if( s->prev ) {
+		const unsigned n = RasterClipSpans(s->prev->spans, s->prev->spans_count, lo, hi, base, RASTER_EDGES_MAX);
+		const unsigned d = n > RASTER_EDGES_MAX ? n :
+			RasterXorSpans(base, n, row->spans, row->spans_count, diff, RASTER_EDGES_MAX);
+		if( d <= RASTER_EDGES_MAX ) {
+			const unsigned size = RasterEncodeRuns(diff, d, lo, hi, xored);
+			if( size < row->size ) {
+				memcpy(payload, xored, size);
+				row->size = size;
+				row->flags |= RASTER_ROW_XOR;
+				++s->st->xor_records;
+			}
+		}
+	}
+	RasterEncodeRowHeader(row, buf);
+	const unsigned size = RASTER_ROW_HEADER_SIZE + row->size;
+	fwrite(buf, 1, size, s->f);
+	s->st->bytes += size;
+	s->st->pixel_bytes += RASTER_ROW_HEADER_SIZE + (row->length + 7) / 8;
+	++s->st->records;
+
+	RasterRow* decoded = &s->rows[s->st->records & 1];
+	*decoded = *row;
+	if( !RasterDecodeRow(decoded, payload, s->prev) || decoded->spans_count != row->spans_count ||
+		memcmp(decoded->spans, row->spans, row->spans_count * sizeof(row->spans[0])) != 0 ) {
+		fprintf(stderr, "gbrc: raster row at y %d does not decode back\n", row->y);
+		abort();
+	}
+	s->prev = decoded;
+
+	const unsigned dx = abs(row->x - s->hx), dy = abs(row->y - s->hy);
+	s->st->travel += dx > dy ? dx : dy;
+	s->st->length += row->length;
+	s->hx = row->x + ((row->flags & RASTER_ROW_REVERSE) ? -row->length : row->length);
+	s->hy = row->y;
+}
+
+/*
+ * Emits the pixels first..last of row y in one direction, in as many
+ * records as the edge limit needs.
+ */
+static void ScanEmitPiece(ScanState* s, int y, int first, int last, int reverse) {
+	static RasterRow row;
+	const int len = last - first + 1;
+	#define SCAN_PIXEL(i) BitmapGet(s->b, reverse ? last - (i) : first + (i), y)
+
+	// pixel i of the piece is crossed travelling from i to i + 1 in the row direction
+	int k = 0;
+	while( k < len ) {
+		int end = k, edges = 0;
+		while( end < len && edges + 2 <= RASTER_EDGES_MAX ) {
+			int on = end;
+			while( on < len && !SCAN_PIXEL(on) ) {
+				++on;
+			}
+			if( on == len ) {
+				break;
+			}
+			int off = on;
+			while( off < len && SCAN_PIXEL(off) ) {
+				++off;
+			}
+			edges += 2;
+			end = off;
+		}
+		row.y = y;
+		row.x = reverse ? last - k + 1 : first + k;
+		row.length = end - k;
+		row.flags = reverse ? RASTER_ROW_REVERSE : 0;
+
+		// toggles in +X order over the record
+		int lo, hi, on = 0;
+		RasterRowRange(&row, &lo, &hi);
+		row.spans_count = 0;
+		for( int x = lo; x < hi; ++x ) {
+			if( BitmapGet(s->b, x, y) != on ) {
+				on = !on;
+				row.spans[row.spans_count++] = x;
+			}
+		}
+		ScanWriteRow(s, &row);
+
+		k = end;
+		while( k < len && !SCAN_PIXEL(k) ) {
+			++k;
+		}
+	}
+	#undef SCAN_PIXEL
+}
+
+static unsigned ScanFind(unsigned* parent, unsigned i) {
+	while( parent[i] != i ) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+static void ScanPushPiece(ScanPiece** pieces, unsigned* count, unsigned* capacity, int y, int a, int b) {
+	if( *count == *capacity ) {
+		*capacity *= 2;
+		ScanPiece* grown = (ScanPiece*)malloc(*capacity * sizeof(ScanPiece));
+		memcpy(grown, *pieces, *count * sizeof(ScanPiece));
+		free(*pieces);
+		*pieces = grown;
+	}
+	ScanPiece* p = &(*pieces)[(*count)++];
+	p->y = y;
+	p->a = a;
+	p->b = b;
+}
+
+static void ScanPieces(const Bitmap* b, ScanPiece** pieces, unsigned* count) {
+	unsigned capacity = 1024;
+	*pieces = (ScanPiece*)malloc(capacity * sizeof(ScanPiece));
+	*count = 0;
+	for( int y = b->y0; y < b->y0 + b->h; ++y ) {
+		int open = 0, a = 0, last = 0;
+		for( int x = b->x0; x < b->x0 + b->w; ++x ) {
+			if( !BitmapGet(b, x, y) ) {
+				continue;
+			}
+			if( open && x - last > SCAN_GAP ) {
+				ScanPushPiece(pieces, count, &capacity, y, a, last);
+				open = 0;
+			}
+			if( !open ) {
+				a = x;
+				open = 1;
+			}
+			last = x;
+		}
+		if( open ) {
+			ScanPushPiece(pieces, count, &capacity, y, a, last);
+		}
+	}
+}
+
+static void ScanClusters(ScanPiece* pieces, unsigned count, ScanCluster** clusters, unsigned* cluster_count) {
+	unsigned* parent = (unsigned*)malloc(count * sizeof(unsigned));
+	for( unsigned i = 0; i < count; ++i ) {
+		parent[i] = i;
+	}
+	// pieces are sorted by row then x: join overlapping pieces of adjacent rows
+	unsigned prev = 0;
+	for( unsigned i = 0; i < count; ) {
+		unsigned e = i;
+		while( e < count && pieces[e].y == pieces[i].y ) {
+			++e;
+		}
+		while( prev < i && pieces[prev].y < pieces[i].y - 1 ) {
+			++prev;
+		}
+		for( unsigned p = prev; p < i; ++p ) {
+			for( unsigned q = i; q < e; ++q ) {
+				if( pieces[p].a <= pieces[q].b + SCAN_GAP && pieces[q].a <= pieces[p].b + SCAN_GAP ) {
+					parent[ScanFind(parent, p)] = ScanFind(parent, q);
+				}
+			}
+		}
+		prev = i;
+		i = e;
+	}
+
+	// number the clusters, then sort pieces by cluster keeping row order
+	unsigned* index = (unsigned*)malloc(count * sizeof(unsigned));
+	unsigned n = 0;
+	for( unsigned i = 0; i < count; ++i ) {
+		index[i] = (unsigned)-1;
+	}
+	for( unsigned i = 0; i < count; ++i ) {
+		const unsigned root = ScanFind(parent, i);
+		if( index[root] == (unsigned)-1 ) {
+			index[root] = n++;
+		}
+		pieces[i].cluster = index[root];
+	}
+	*clusters = (ScanCluster*)malloc((n ? n : 1) * sizeof(ScanCluster));
+	memset(*clusters, 0, (n ? n : 1) * sizeof(ScanCluster));
+	for( unsigned i = 0; i < count; ++i ) {
+		ScanCluster* c = &(*clusters)[pieces[i].cluster];
+		if( c->count++ == 0 ) {
+			c->x0 = pieces[i].a;
+			c->x1 = pieces[i].b;
+			c->y0 = c->y1 = pieces[i].y;
+		}
+		c->x0 = pieces[i].a < c->x0 ? pieces[i].a : c->x0;
+		c->x1 = pieces[i].b > c->x1 ? pieces[i].b : c->x1;
+		c->y1 = pieces[i].y;
+	}
+	unsigned at = 0;
+	for( unsigned c = 0; c < n; ++c ) {
+		(*clusters)[c].first = at;
+		at += (*clusters)[c].count;
+		(*clusters)[c].count = 0;
+	}
+	ScanPiece* sorted = (ScanPiece*)malloc((count ? count : 1) * sizeof(ScanPiece));
+	for( unsigned i = 0; i < count; ++i ) {
+		ScanCluster* c = &(*clusters)[pieces[i].cluster];
+		sorted[c->first + c->count++] = pieces[i];
+	}
+	memcpy(pieces, sorted, count * sizeof(ScanPiece));
+	free(sorted);
+	free(index);
+	free(parent);
+	*cluster_count = n;
+}
+
+static int ScanDist(int x0, int y0, int x1, int y1) {
+	const int dx = abs(x1 - x0), dy = abs(y1 - y0);
+	return dx > dy ? dx : dy;
+}
+
+/*
+ * Engraves a cluster row by row from the end nearer to the head,
+ * alternating the direction on every row.
+ */
+static void ScanEmitCluster(ScanState* s, const ScanPiece* pieces, const ScanCluster* c) {
+	const int down = abs(s->hy - c->y1) < abs(s->hy - c->y0);
+	int reverse = abs(s->hx - c->x1) < abs(s->hx - c->x0);
+	unsigned i = 0;
+	while( i < c->count ) {
+		// pieces of one row
+		const unsigned at = down ? c->count - 1 - i : i;
+		const int y = pieces[c->first + at].y;
+		unsigned lo = at, hi = at;
+		while( lo > 0 && pieces[c->first + lo - 1].y == y ) {
+			--lo;
+		}
+		while( hi + 1 < c->count && pieces[c->first + hi + 1].y == y ) {
+			++hi;
+		}
+		for( unsigned k = 0; k <= hi - lo; ++k ) {
+			const ScanPiece* p = &pieces[c->first + (reverse ? hi - k : lo + k)];
+			ScanEmitPiece(s, y, p->a, p->b, reverse);
+		}
+		++s->st->rows;
+		i += hi - lo + 1;
+		reverse = !reverse;
+	}
+}
+
+int ScanWriteRaster(const char* path, const Bitmap* b, ScanStats* st) {
+	static ScanState s;
+	s.f = fopen(path, "wb");
+	if( s.f == NULL ) {
+		fprintf(stderr, "gbrc: cannot write %s\n", path);
+		return 0;
+	}
+	s.b = b;
+	s.st = st;
+	s.hx = s.hy = 0;
+	s.prev = NULL;
+	memset(st, 0, sizeof(*st));
+	uint8_t header[RASTER_HEADER_SIZE] = { 0 };
+	fwrite(header, 1, sizeof(header), s.f); // patched with the record count
+
+	ScanPiece* pieces;
+	ScanCluster* clusters;
+	unsigned count, cluster_count;
+	ScanPieces(b, &pieces, &count);
+	ScanClusters(pieces, count, &clusters, &cluster_count);
+
+	// nearest cluster corner next
+	for( unsigned n = 0; n < cluster_count; ++n ) {
+		int best = -1, best_dist = 0;
+		for( unsigned c = 0; c < cluster_count; ++c ) {
+			if( clusters[c].done ) {
+				continue;
+			}
+			const ScanCluster* k = &clusters[c];
+			int d = ScanDist(s.hx, s.hy, k->x0, k->y0);
+			const int d1 = ScanDist(s.hx, s.hy, k->x1, k->y0);
+			const int d2 = ScanDist(s.hx, s.hy, k->x0, k->y1);
+			const int d3 = ScanDist(s.hx, s.hy, k->x1, k->y1);
+			d = d1 < d ? d1 : d;
+			d = d2 < d ? d2 : d;
+			d = d3 < d ? d3 : d;
+			if( best < 0 || d < best_dist ) {
+				best = c;
+				best_dist = d;
+			}
+		}
+		clusters[best].done = 1;
+		ScanEmitCluster(&s, pieces, &clusters[best]);
+	}
+	free(pieces);
+	free(clusters);
+
+	// back to the origin, as a vector job ends
+	st->travel += ScanDist(s.hx, s.hy, 0, 0);
+	st->seconds = (st->travel + st->length) * MOTOR_MICROSTEPPING * (STEP_MEANDR + STEP_WAIT) * 1e-6;
+
+	memcpy(header, RASTER_MAGIC, 4);
+	for( int i = 0; i < 4; ++i ) {
+		header[4 + i] = (st->records >> (8 * i)) & 0xFF;
+	}
+	fseek(s.f, 0, SEEK_SET);
+	fwrite(header, 1, sizeof(header), s.f);
+	st->bytes += sizeof(header);
+	return fclose(s.f) == 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _HOST_SCANLINE_H
+#define _HOST_SCANLINE_H
+
+#include "bitmap.h"
+
+/*
+ * Raster program generation: bidirectional scanlines over a bitmap,
+ * written as row records for the firmware "raster" command (raster.h).
+ */
+
+typedef struct ScanStats {
+	unsigned rows; // bitmap rows with pixels to burn
+	unsigned records; // row records, long rows may need several
+	unsigned long long travel; // steps, rapids between rows
+	unsigned long long length; // steps, along the rows
+	unsigned xor_records; // records sent as the difference to the previous one
+	unsigned long bytes;
+	unsigned long pixel_bytes; // the same records at one bit per pixel
+	double seconds; // estimated machine time
+} ScanStats;
+
+int ScanWriteRaster(const char* path, const Bitmap* b, ScanStats* st);
+
+#endif // _HOST_SCANLINE_H
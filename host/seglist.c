@@ -0,0 +1,29 @@
+
+#include "seglist.h"
+
+void SegmentListPush(void* arg, const Segment* s) {
+	SegmentList* list = (SegmentList*)arg;
+	if( list->count == list->capacity ) {
+		list->capacity = list->capacity ? list->capacity * 2 : 1024;
+		Segment* items = (Segment*)malloc(list->capacity * sizeof(Segment));
+		if( list->count ) {
+			memcpy(items, list->items, list->count * sizeof(Segment));
+		}
+		free(list->items);
+		list->items = items;
+	}
+	list->items[list->count++] = *s;
+}
+
+void SegmentListMove(SegmentList* list, int dx, int dy, uint8_t flags) {
+	if( dx || dy ) {
+		SegmentSplit(dx, dy, flags, SegmentListPush, list);
+	}
+}
+
+void SegmentListFree(SegmentList* list) {
+	free(list->items);
+	list->items = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
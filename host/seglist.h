@@ -0,0 +1,22 @@
+#ifndef _HOST_SEGLIST_H
+#define _HOST_SEGLIST_H
+
+#include "../segment.h"
+
+/*
+ * Growable list of recorded segments, used by the host tools.
+ */
+
+typedef struct SegmentList {
+	Segment* items;
+	unsigned count;
+	unsigned capacity;
+} SegmentList;
+
+// matches SegmentSink, so a list can be attached to SegmentSinkSet()
+void SegmentListPush(void* arg, const Segment* s);
+// appends a move of any length, split to the record range
+void SegmentListMove(SegmentList* list, int dx, int dy, uint8_t flags);
+void SegmentListFree(SegmentList* list);
+
+#endif // _HOST_SEGLIST_H
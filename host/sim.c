@@ -0,0 +1,236 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <ch.h>
+#include <hal.h>
+#include <chprintf.h>
+#include "../flash.h"
+#include "../override.h"
+
+GPIO_TypeDef HOST_GPIO[5];
+GPTDriver GPTD1;
+stm32_tim_t HOST_TIM2;
+stm32_tim_t HOST_TIM3;
+stm32_dma_stream_t HOST_DMA1_STREAM3;
+PWMDriver PWMD2 = { .period = 100, .tim = &HOST_TIM2 };
+SerialDriver SD3;
+
+uint64_t HostSimTicks = 0;
+uint64_t HostSimInterrupts = 0;
+uint64_t HostSimMoves = 0;
+int HostSimDry = 0;
+void (*HostPadHook)(GPIO_TypeDef* port, uint32_t pad, int val) = NULL;
+void (*HostTickHook)(void) = NULL;
+
+size_t HostHeapUsed = 0;
+size_t HostHeapPeak = 0;
+
+/*
+ * Cycle model of the step ISR (perf.h). The DWT counter follows the
+ * simulated time, a timer interrupt reaches its callback
+ * HOST_CYCLES_ENTRY cycles after the update event and every stand-in the
+ * ISR calls adds what its register accesses cost on the chip. The code
+ * around them is not charged, the model is a floor under the counts of
+ * the chip.
+ */
+#define HOST_CYCLES_ENTRY 40 // exception entry, IRQ prologue, the GPT driver
+#define HOST_CYCLES_PAD 3 // a BSRR or BRR store
+#define HOST_CYCLES_TIMER 4 // an ARR or CR1 store
+#define HOST_CYCLES_PWM 6 // CCR and CCER
+#define HOST_CYCLES_SIGNAL 60 // a thread made ready
+
+DWT_Type HOST_DWT;
+CoreDebug_Type HOST_COREDEBUG;
+
+static uint32_t HostSimCycles(void) {
+	return (uint32_t)(HostSimTicks * (STM32_SYSCLK / GPTD1.config->frequency));
+}
+
+#undef malloc
+#undef free
+
+typedef union {
+	size_t size;
+	max_align_t align;
+} HostHeapHeader;
+
+void* HostMalloc(size_t size) {
+	HostHeapHeader* h = (HostHeapHeader*)malloc(sizeof(HostHeapHeader) + size);
+	if( h == NULL ) {
+		return NULL;
+	}
+	h->size = size;
+	HostHeapUsed += size;
+	if( HostHeapUsed > HostHeapPeak ) {
+		HostHeapPeak = HostHeapUsed;
+	}
+	return h + 1;
+}
+
+void HostFree(void* ptr) {
+	if( ptr == NULL ) {
+		return;
+	}
+	HostHeapHeader* h = (HostHeapHeader*)ptr - 1;
+	HostHeapUsed -= h->size;
+	free(h);
+}
+
+void palSetPad(GPIO_TypeDef* port, uint32_t pad) {
+	port->ODR |= 1u << pad;
+	HOST_DWT.CYCCNT += HOST_CYCLES_PAD;
+	if( HostPadHook ) {
+		HostPadHook(port, pad, 1);
+	}
+}
+
+void palClearPad(GPIO_TypeDef* port, uint32_t pad) {
+	port->ODR &= ~(1u << pad);
+	HOST_DWT.CYCCNT += HOST_CYCLES_PAD;
+	if( HostPadHook ) {
+		HostPadHook(port, pad, 0);
+	}
+}
+
+void gptStart(GPTDriver* gptp, const GPTConfig* config) {
+	gptp->config = config;
+	gptp->running = 0;
+}
+
+void gptStartContinuous(GPTDriver* gptp, uint32_t interval) {
+	++HostSimMoves;
+	if( HostSimDry ) {
+		return;
+	}
+	gptp->interval = interval;
+	gptp->running = 1;
+	// the first update event is an interval from now
+	HOST_DWT.CYCCNT = HostSimCycles();
+}
+
+void gptChangeIntervalI(GPTDriver* gptp, uint32_t interval) {
+	gptp->interval = interval;
+	HOST_DWT.CYCCNT += HOST_CYCLES_TIMER;
+}
+
+void gptStopTimerI(GPTDriver* gptp) {
+	gptp->running = 0;
+	HOST_DWT.CYCCNT += HOST_CYCLES_TIMER;
+}
+
+void pwmEnableChannel(PWMDriver* pwmp, unsigned channel, uint32_t width) {
+	pwmp->tim->CCR[channel] = width;
+	pwmp->enabled |= 1u << channel;
+	HOST_DWT.CYCCNT += HOST_CYCLES_PWM;
+}
+
+void pwmDisableChannel(PWMDriver* pwmp, unsigned channel) {
+	pwmp->tim->CCR[channel] = 0;
+	pwmp->enabled &= ~(1u << channel);
+	HOST_DWT.CYCCNT += HOST_CYCLES_PWM;
+}
+
+/*
+ * Runs the motor timer until the semaphore is released. Only GPTD1 is
+ * simulated, that is the only timer the firmware waits on.
+ */
+/*
+ * An update event of the step timer. With TRGO on update it clocks TIM3
+ * (slave on ITR0, external clock mode 1), whose update requests a DMA
+ * transfer, as on the chip.
+ */
+static void HostSimTimerUpdate(void) {
+	stm32_tim_t* t = STM32_TIM3;
+	stm32_dma_stream_t* dma = STM32_DMA1_STREAM3;
+	if( (GPTD1.config->cr2 & STM32_TIM_CR2_MMS(7)) != STM32_TIM_CR2_MMS(2) ||
+		!(t->CR1 & STM32_TIM_CR1_CEN) ||
+		(t->SMCR & (STM32_TIM_SMCR_SMS(7) | STM32_TIM_SMCR_TS(7))) != (STM32_TIM_SMCR_SMS(7) | STM32_TIM_SMCR_TS(0)) ) {
+		return;
+	}
+	if( t->CNT < t->ARR ) {
+		++t->CNT;
+		return;
+	}
+	t->CNT = 0;
+	if( (t->DIER & STM32_TIM_DIER_UDE) && dma->enabled && dma->size ) {
+		*dma->peripheral = *dma->memory;
+		if( dma->mode & STM32_DMA_CR_MINC ) {
+			++dma->memory;
+		}
+		--dma->size;
+	}
+}
+
+void chBSemWait(binary_semaphore_t* bsp) {
+	if( HostSimDry ) {
+		return;
+	}
+	while( bsp->taken ) {
+		if( !GPTD1.running ) {
+			fprintf(stderr, "sim: waiting on a semaphore with no timer running\n");
+			abort();
+		}
+		HostSimTicks += GPTD1.interval;
+		++HostSimInterrupts;
+		HostSimTimerUpdate();
+		HOST_DWT.CYCCNT = HostSimCycles() + HOST_CYCLES_ENTRY;
+		GPTD1.config->callback(&GPTD1);
+		if( HostTickHook ) {
+			HostTickHook();
+		}
+	}
+	bsp->taken = 1;
+}
+
+void chBSemSignalI(binary_semaphore_t* bsp) {
+	bsp->taken = 0;
+	HOST_DWT.CYCCNT += HOST_CYCLES_SIGNAL;
+}
+
+size_t streamRead(BaseSequentialStream* chp, uint8_t* bp, size_t n) {
+	if( chp == NULL || chp->in == NULL ) {
+		return 0;
+	}
+	return fread(bp, 1, n, chp->in);
+}
+
+int chprintf(BaseSequentialStream* chp, const char* fmt, ...) {
+	if( chp == NULL || chp->out == NULL ) {
+		return 0;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = vfprintf(chp->out, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+// the spare flash pages, erased as on a new chip
+static uint8_t host_flash[FLASH_SPARE_PAGES * FLASH_PAGE_SIZE] = { [0 ... FLASH_SPARE_PAGES * FLASH_PAGE_SIZE - 1] = 0xFF };
+
+const uint8_t* FlashSpare(void) {
+	return host_flash;
+}
+
+int FlashErase(const uint8_t* page) {
+	memset((uint8_t*)page, 0xFF, FLASH_PAGE_SIZE);
+	return 1;
+}
+
+int FlashProgram(const uint8_t* at, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for( size_t i = 0; i < size; i += 2 ) {
+		// as on the chip, a halfword that is not erased is only written with 0
+		uint8_t* cell = (uint8_t*)at + i;
+		if( (cell[0] != 0xFF || cell[1] != 0xFF) && (bytes[i] | bytes[i + 1]) != 0 ) {
+			return 0;
+		}
+		cell[0] = bytes[i];
+		cell[1] = bytes[i + 1];
+	}
+	return 1;
+}
+
+// the input is a file, there is nothing to filter
+void OverrideRaw(int raw) {
+	(void)raw;
+}
@@ -0,0 +1,190 @@
+/*
+ * Runs a compiled program (job or raster) through the firmware receivers
+ * with the step ISR driven by the host timer. With -c a job is saved to
+ * the job cache first and run from there (job.h). Reports machine time and
+ * the cells burned: a cell is burned when the laser is on while the head
+ * crosses it, X travel from p to p + 1 or back burns cell p. The PWM
+ * width at that moment goes into a power hash, which host/grayc prints
+ * for the image it compiled: equal hashes mean every gray pixel got its
+ * power on its own step. With -p the step ISR report of the "perf"
+ * command follows, from the cycle model of the host (perf.h).
+ *
+ * With -a N the job is paused after N step interrupts and aborted once the
+ * hold stopped the head, as "job pause" and "job abort" do. The moves
+ * MotorDropped reports then have to be what the job queued less what the
+ * head made, or simrun fails.
+ */
+
+#include <ch.h>
+#include <hal.h>
+#include <chprintf.h>
+
+#include "../segment.c"
+#include "../laser.c"
+#include "../perf.c"
+#include "../motor.c"
+#include "../gerber.c"
+#include "../region.c"
+#include "../coverage.c"
+#include "../macro.c"
+#include "../arena.c"
+#include "../preflight.c"
+#include "../job.c"
+#include "../raster.c"
+#include "seglist.c"
+#include "bitmap.c"
+
+#define SIMRUN_EXTENT 16384
+
+static const GPTConfig gpt_motor = {
+	1000000,
+	MotorCallback,
+	STM32_TIM_CR2_MMS(2),
+	0
+};
+
+static Bitmap simrun_burned;
+static int simrun_x, simrun_y;
+static unsigned simrun_pulses_x, simrun_pulses_y;
+static unsigned long long simrun_burn_steps;
+static unsigned long long simrun_power_hash;
+static uint64_t simrun_abort_at; // step interrupts, 0 runs the job to its end
+static int simrun_aborted;
+
+static int SimrunPad(const Pad* p) {
+	return (p->m_port->ODR >> p->m_pad) & 1;
+}
+
+static void SimrunPadHook(GPIO_TypeDef* port, uint32_t pad, int val) {
+	const Pad* x = &MOTOR_X->m_pads[PadStep];
+	const Pad* y = &MOTOR_Y->m_pads[PadStep];
+	if( !val ) {
+		return;
+	}
+	const unsigned width = (PWMD2.enabled & 2) ? PWMD2.tim->CCR[1] : 0;
+	const int laser = width != 0;
+	if( port == x->m_port && pad == x->m_pad ) {
+		// a full step is MOTOR_MICROSTEPPING pulses, the laser is sampled on the first
+		if( simrun_pulses_x++ % MOTOR_MICROSTEPPING == 0 ) {
+			const int dir = SimrunPad(&MOTOR_X->m_pads[PadDir]) == MOTOR_X_DIRECTION_PLUS ? 1 : -1;
+			if( laser ) {
+				BitmapSet(&simrun_burned, dir > 0 ? simrun_x : simrun_x - 1, simrun_y);
+				simrun_power_hash += BitmapCellHash(dir > 0 ? simrun_x : simrun_x - 1, simrun_y, width);
+				++simrun_burn_steps;
+			}
+			simrun_x += dir;
+		}
+	} else if( port == y->m_port && pad == y->m_pad ) {
+		if( simrun_pulses_y++ % MOTOR_MICROSTEPPING == 0 ) {
+			const int dir = SimrunPad(&MOTOR_Y->m_pads[PadDir]) == MOTOR_Y_DIRECTION_PLUS ? 1 : -1;
+			if( laser ) {
+				BitmapSet(&simrun_burned, simrun_x, dir > 0 ? simrun_y : simrun_y - 1);
+				simrun_power_hash += BitmapCellHash(simrun_x, dir > 0 ? simrun_y : simrun_y - 1, width);
+				++simrun_burn_steps;
+			}
+			simrun_y += dir;
+		}
+	}
+}
+
+static void SimrunTick(void) {
+	if( simrun_aborted || HostSimInterrupts < simrun_abort_at ) {
+		return;
+	}
+	MotorHold();
+	if( MotorHeld() ) {
+		MotorAbort();
+		simrun_aborted = 1;
+	}
+}
+
+// the drop of the abort against the head position, returns 0 on a mismatch
+static int SimrunCheckAbort(const char* name) {
+	int dx, dy;
+	MotorDropped(&dx, &dy);
+	const int ok = CUR_X - dx == simrun_x && CUR_Y - dy == simrun_y;
+	printf("%s: aborted after %llu step interrupts, %u full steps, queued (%d,%d), dropped (%d,%d), head (%d,%d)%s\n",
+		name, (unsigned long long)simrun_abort_at, (unsigned)MotorSteps(), CUR_X, CUR_Y, dx, dy, simrun_x, simrun_y,
+		ok ? "" : ", MISMATCH");
+	MotorResume();
+	return ok;
+}
+
+int main(int argc, char* argv[]) {
+	int cached = 0;
+	int perf = 0;
+	while( argc > 1 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-a") == 0) ) {
+		if( argv[1][1] == 'c' ) {
+			cached = 1;
+		} else if( argv[1][1] == 'p' ) {
+			perf = 1;
+		} else if( argc > 2 ) {
+			simrun_abort_at = strtoull(argv[2], NULL, 10);
+			--argc;
+			++argv;
+		}
+		--argc;
+		++argv;
+	}
+	if( argc < 2 ) {
+		fprintf(stderr, "usage: simrun [-c] [-p] [-a INTERRUPTS] program.job|program.ras [burned.pbm]\n");
+		return 2;
+	}
+	FILE* f = fopen(argv[1], "rb");
+	uint8_t header[8];
+	if( f == NULL || fread(header, 1, sizeof(header), f) != sizeof(header) ) {
+		fprintf(stderr, "simrun: cannot read %s\n", argv[1]);
+		return 1;
+	}
+	const unsigned count = header[4] | (header[5] << 8) | (header[6] << 16) | ((unsigned)header[7] << 24);
+
+	gptStart(MOTOR_TIMER, &gpt_motor);
+	PerfInit();
+	LaserGrayInit();
+	BitmapInit(&simrun_burned, -SIMRUN_EXTENT / 2, -SIMRUN_EXTENT / 2, SIMRUN_EXTENT, SIMRUN_EXTENT);
+	HostPadHook = SimrunPadHook;
+	if( simrun_abort_at ) {
+		HostTickHook = SimrunTick;
+	}
+	SD3.stream.in = f;
+
+	if( memcmp(header, JOB_MAGIC, 4) == 0 && cached ) {
+		SD3.stream.out = stderr;
+		JobCacheSave(&SD3.stream, "simrun", count);
+		JobCacheList(&SD3.stream);
+		JobCacheRun(&SD3.stream, "simrun");
+	} else if( memcmp(header, JOB_MAGIC, 4) == 0 ) {
+		JobReceive(&SD3.stream, count);
+	} else if( memcmp(header, RASTER_MAGIC, 4) == 0 ) {
+		RasterReceive(&SD3.stream, count);
+		MoveTo(0, 0, 1);
+		MotorGroupWait();
+		printf("%s: raster %u rows (%u xor, %u gray), %lu bytes for %lu bitmap bytes, %u underruns\n",
+			argv[1], raster_stats.rows, raster_stats.xor_rows, raster_stats.gray_rows,
+			raster_stats.payload_bytes, raster_stats.pixel_bytes, raster_stats.underruns);
+	} else {
+		fprintf(stderr, "simrun: %s is not a compiled program\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+	int status = 0;
+	if( simrun_aborted && !SimrunCheckAbort(argv[1]) ) {
+		status = 1;
+	}
+
+	printf("%s: %u records, %llu moves, %llu step interrupts, machine time %.3f s, "
+		"burn %llu steps, %lu cells burned, hash %016llx, power hash %016llx, end (%d,%d)\n",
+		argv[1], count, (unsigned long long)HostSimMoves, (unsigned long long)HostSimInterrupts,
+		HostSimTicks / (double)gpt_motor.frequency, simrun_burn_steps,
+		BitmapCount(&simrun_burned), BitmapHash(&simrun_burned), simrun_power_hash, simrun_x, simrun_y);
+	if( perf ) {
+		BaseSequentialStream out = { stdout, NULL };
+		PerfPrint(&out);
+	}
+	if( argc > 2 && !BitmapWritePbm(&simrun_burned, argv[2]) ) {
+		fprintf(stderr, "simrun: cannot write %s\n", argv[2]);
+		return 1;
+	}
+	BitmapFree(&simrun_burned);
+	return status;
+}
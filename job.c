@@ -0,0 +1,281 @@
+
+#include "job.h"
+#include "gerber.h"
+#include "laser.h"
+#include "motor.h"
+#include "override.h"
+
+static int job_laser = 0;
+
+void JobExecuteSegment(const Segment* s) {
+	const int laser = (s->flags & SEGMENT_LASER) ? 1 : 0;
+	if( laser != job_laser ) {
+		if( laser ) {
+			LaserEnable();
+		} else {
+			LaserDisable();
+		}
+		job_laser = laser;
+	}
+	MoveToRelative(s->dx, s->dy, (s->flags & SEGMENT_RAPID) ? 1 : 0);
+}
+
+void JobFinish(void) {
+	LaserDisable();
+	job_laser = 0;
+	MotorGroupWait();
+}
+
+// takes n segments in buf, which has room for one more byte; returns 0 to stop the transfer
+typedef int (*JobChunk)(void* arg, uint8_t* buf, unsigned n);
+
+// requests the segments in chunks, returns the number taken
+static unsigned JobReceiveChunks(BaseSequentialStream* chp, unsigned count, JobChunk chunk, void* arg) {
+	uint8_t buf[JOB_CHUNK * SEGMENT_WIRE_SIZE + 1];
+	unsigned done = 0;
+
+	while( done < count ) {
+		const unsigned n = count - done < JOB_CHUNK ? count - done : JOB_CHUNK;
+		OverrideRaw(1);
+		chprintf(chp, "> %u\r\n", n);
+		const size_t got = streamRead(chp, buf, n * SEGMENT_WIRE_SIZE);
+		OverrideRaw(0);
+		if( got != n * SEGMENT_WIRE_SIZE ) {
+			chprintf(chp, "job transfer failed\r\n");
+			break;
+		}
+		if( !chunk(arg, buf, n) ) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static int JobExecuteChunk(void* arg, uint8_t* buf, unsigned n) {
+	(void)arg;
+	for( unsigned i = 0; i < n; ++i ) {
+		Segment s;
+		SegmentDecode(buf + i * SEGMENT_WIRE_SIZE, &s);
+		JobExecuteSegment(&s);
+	}
+	// moving while the next chunk comes in
+	MotorGroupFlush();
+	return 1;
+}
+
+void JobReceive(BaseSequentialStream* chp, unsigned count) {
+	JobReceiveChunks(chp, count, JobExecuteChunk, NULL);
+	JobFinish();
+	chprintf(chp, "job done\r\n");
+}
+
+static uint32_t JobCacheCrc(uint32_t crc, const uint8_t* data, size_t size) {
+	crc = ~crc;
+	while( size-- ) {
+		crc ^= *data++;
+		for( int k = 0; k < 8; ++k ) {
+			crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static const uint8_t* JobCacheSegments(const JobCacheHeader* h) {
+	return (const uint8_t*)(h + 1);
+}
+
+static const uint8_t* JobCacheSkip(const JobCacheHeader* h) {
+	return JobCacheSegments(h) + ((h->count * SEGMENT_WIRE_SIZE + 3) & ~3u);
+}
+
+// the job at, NULL after the last one
+static const JobCacheHeader* JobCacheAt(const uint8_t* cache, const uint8_t* at) {
+	const JobCacheHeader* h = (const JobCacheHeader*)at;
+	if( at + sizeof(*h) > cache + JOB_CACHE_SIZE || memcmp(h->magic, JOB_MAGIC, 4) != 0 ||
+		h->count > (size_t)(cache + JOB_CACHE_SIZE - JobCacheSegments(h)) / SEGMENT_WIRE_SIZE ) {
+		return NULL;
+	}
+	return h;
+}
+
+// the space after the last job
+static const uint8_t* JobCacheEnd(const uint8_t* cache) {
+	const uint8_t* at = cache;
+	for( const JobCacheHeader* h = JobCacheAt(cache, at); h; h = JobCacheAt(cache, at) ) {
+		at = JobCacheSkip(h);
+	}
+	return at;
+}
+
+static int JobCacheValid(const JobCacheHeader* h) {
+	return JobCacheCrc(0, JobCacheSegments(h), h->count * SEGMENT_WIRE_SIZE) == h->crc;
+}
+
+static const uint8_t* JobCacheOpen(BaseSequentialStream* chp) {
+	const uint8_t* cache = FlashSpare();
+	if( cache == NULL ) {
+		chprintf(chp, "the firmware takes the flash of the job cache\r\n");
+	}
+	return cache;
+}
+
+typedef struct JobCacheWriter {
+	const uint8_t* at;
+	uint32_t crc;
+} JobCacheWriter;
+
+static int JobCacheWriteChunk(void* arg, uint8_t* buf, unsigned n) {
+	JobCacheWriter* w = (JobCacheWriter*)arg;
+	unsigned size = n * SEGMENT_WIRE_SIZE;
+	w->crc = JobCacheCrc(w->crc, buf, size);
+	if( size & 1 ) {
+		// only the last chunk, the halfword is completed with an erased byte
+		buf[size++] = 0xFF;
+	}
+	if( !FlashProgram(w->at, buf, size) ) {
+		return 0;
+	}
+	w->at += size;
+	return 1;
+}
+
+void JobCacheSave(BaseSequentialStream* chp, const char* name, unsigned count) {
+	const uint8_t* cache = JobCacheOpen(chp);
+	if( cache == NULL ) {
+		return;
+	}
+	// JobCacheFind compares the whole name field
+	if( strlen(name) > JOB_CACHE_NAME_MAX - 1 ) {
+		chprintf(chp, "job name is longer than %u characters\r\n", JOB_CACHE_NAME_MAX - 1);
+		return;
+	}
+	if( count == 0 ) {
+		chprintf(chp, "job needs at least one segment\r\n");
+		return;
+	}
+	JobCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOB_MAGIC, 4);
+	h.count = count;
+	strncpy(h.name, name, JOB_CACHE_NAME_MAX - 1);
+	const uint8_t* at = JobCacheEnd(cache);
+	const size_t free_bytes = cache + JOB_CACHE_SIZE - at;
+	// the count is checked before it is multiplied, the free bytes are whole words as JobCacheSkip rounds to
+	if( free_bytes < sizeof(h) || count > (free_bytes - sizeof(h)) / SEGMENT_WIRE_SIZE ) {
+		chprintf(chp, "job cache has %u bytes free\r\n", (unsigned)free_bytes);
+		return;
+	}
+	// the step ISR stalls while the flash is programmed
+	MotorGroupWait();
+	JobCacheWriter w = { at + sizeof(h), 0 };
+	h.count = JobReceiveChunks(chp, count, JobCacheWriteChunk, &w);
+	h.crc = h.count == count ? w.crc : ~w.crc;
+	// a broken off job is written too, the jobs after it are found past its segments
+	const int written = FlashProgram(at, &h, sizeof(h));
+	if( written && h.count == count ) {
+		chprintf(chp, "job saved\r\n");
+	} else {
+		chprintf(chp, written ? "job not saved\r\n" : "job not saved, the cache needs job erase\r\n");
+	}
+}
+
+const JobCacheHeader* JobCacheFind(BaseSequentialStream* chp, const char* name) {
+	const uint8_t* cache = JobCacheOpen(chp);
+	if( cache == NULL ) {
+		return NULL;
+	}
+	const JobCacheHeader* job = NULL;
+	for( const JobCacheHeader* h = JobCacheAt(cache, cache); h; h = JobCacheAt(cache, JobCacheSkip(h)) ) {
+		if( strncmp(h->name, name, JOB_CACHE_NAME_MAX) == 0 ) {
+			job = h;
+		}
+	}
+	if( job == NULL ) {
+		chprintf(chp, "no job %s in the cache\r\n", name);
+		return NULL;
+	}
+	if( !JobCacheValid(job) ) {
+		chprintf(chp, "job %s is damaged\r\n", name);
+		return NULL;
+	}
+	return job;
+}
+
+uint32_t JobCacheOffset(const JobCacheHeader* job) {
+	return (const uint8_t*)job - FlashSpare();
+}
+
+const JobCacheHeader* JobCacheFindAt(BaseSequentialStream* chp, uint32_t offset) {
+	const uint8_t* cache = JobCacheOpen(chp);
+	if( cache == NULL ) {
+		return NULL;
+	}
+	// one of the jobs, not a place in the segments of one
+	for( const JobCacheHeader* h = JobCacheAt(cache, cache); h; h = JobCacheAt(cache, JobCacheSkip(h)) ) {
+		if( JobCacheOffset(h) == offset ) {
+			if( JobCacheValid(h) ) {
+				return h;
+			}
+			break;
+		}
+	}
+	chprintf(chp, "the job of the checkpoint is not in the cache\r\n");
+	return NULL;
+}
+
+void JobCacheSegment(const JobCacheHeader* job, unsigned i, Segment* s) {
+	SegmentDecode(JobCacheSegments(job) + i * SEGMENT_WIRE_SIZE, s);
+}
+
+void JobCachePreflight(const JobCacheHeader* job, Preflight* p) {
+	PreflightReset(p, CUR_X, CUR_Y);
+	for( unsigned i = 0; i < job->count; ++i ) {
+		Segment s;
+		JobCacheSegment(job, i, &s);
+		PreflightSegment(p, &s);
+	}
+}
+
+void JobCacheRun(BaseSequentialStream* chp, const char* name) {
+	const JobCacheHeader* job = JobCacheFind(chp, name);
+	if( job == NULL ) {
+		return;
+	}
+	for( unsigned i = 0; i < job->count; ++i ) {
+		Segment s;
+		JobCacheSegment(job, i, &s);
+		JobExecuteSegment(&s);
+	}
+	JobFinish();
+	chprintf(chp, "job done\r\n");
+}
+
+void JobCacheList(BaseSequentialStream* chp) {
+	const uint8_t* cache = JobCacheOpen(chp);
+	if( cache == NULL ) {
+		return;
+	}
+	for( const JobCacheHeader* h = JobCacheAt(cache, cache); h; h = JobCacheAt(cache, JobCacheSkip(h)) ) {
+		char name[JOB_CACHE_NAME_MAX + 1];
+		memcpy(name, h->name, JOB_CACHE_NAME_MAX);
+		name[JOB_CACHE_NAME_MAX] = 0;
+		chprintf(chp, "%s: %u segments, %s\r\n", name, (unsigned)h->count, JobCacheValid(h) ? "ok" : "damaged");
+	}
+	chprintf(chp, "%u of %u bytes free\r\n", (unsigned)(cache + JOB_CACHE_SIZE - JobCacheEnd(cache)), JOB_CACHE_SIZE);
+}
+
+void JobCacheErase(BaseSequentialStream* chp) {
+	const uint8_t* cache = JobCacheOpen(chp);
+	if( cache == NULL ) {
+		return;
+	}
+	MotorGroupWait();
+	for( unsigned i = 0; i < FLASH_SPARE_PAGES; ++i ) {
+		if( !FlashErase(cache + i * FLASH_PAGE_SIZE) ) {
+			chprintf(chp, "page %u of the job cache failed to erase\r\n", i);
+			return;
+		}
+	}
+	chprintf(chp, "job cache erased\r\n");
+}
@@ -0,0 +1,66 @@
+#ifndef _JOB_H
+#define _JOB_H
+
+#include "segment.h"
+#include "flash.h"
+#include "preflight.h"
+
+/*
+ * Compiled motion programs produced by the host compiler (host/gbrc).
+ *
+ * File layout: JOB_MAGIC, segment count (uint32, little endian), then
+ * the segments in SEGMENT_WIRE_SIZE wire format.
+ *
+ * Serial protocol: the host sends "job <count>", the machine answers
+ * "> <n>" whenever it is ready for the next n segments and reads exactly
+ * n * SEGMENT_WIRE_SIZE raw bytes. "job done" ends the transfer.
+ */
+
+#define JOB_MAGIC "GJOB"
+#define JOB_HEADER_SIZE 8
+#define JOB_CHUNK 32 // segments requested at once
+
+void JobExecuteSegment(const Segment* s);
+void JobFinish(void);
+void JobReceive(BaseSequentialStream* chp, unsigned count);
+
+/*
+ * Job cache: programs kept in the spare flash pages (flash.h) to run again
+ * without the serial transfer. "job save <name> <count>" receives a
+ * program as "job <count>" does and writes it after the jobs cached
+ * already, "job run <name>" checks its CRC and feeds its segments from the
+ * flash straight into the motion queue (from the job thread on the
+ * machine, runner.h) unless it leaves the soft limits, "job check <name>"
+ * measures it without moving (preflight.h), "job list" shows the cache
+ * and "job erase" empties it. Of jobs with the same name the last saved runs.
+ *
+ * Cache layout: JobCacheHeader, the segments in SEGMENT_WIRE_SIZE wire
+ * format padded to four bytes, the next header, up to a header that is
+ * not a job. The header is written after the segments, a transfer that
+ * broke off leaves a job that fails its CRC.
+ */
+
+#define JOB_CACHE_SIZE (FLASH_SPARE_PAGES * FLASH_PAGE_SIZE)
+#define JOB_CACHE_NAME_MAX 12
+
+typedef struct JobCacheHeader {
+	char magic[4]; // JOB_MAGIC
+	uint32_t count;
+	uint32_t crc; // CRC-32 of the segment bytes
+	char name[JOB_CACHE_NAME_MAX];
+} JobCacheHeader;
+
+void JobCacheSave(BaseSequentialStream* chp, const char* name, unsigned count);
+void JobCacheRun(BaseSequentialStream* chp, const char* name);
+// the job of the name with a good CRC, NULL after telling why not
+const JobCacheHeader* JobCacheFind(BaseSequentialStream* chp, const char* name);
+void JobCacheSegment(const JobCacheHeader* job, unsigned i, Segment* s);
+// the job measured from the head position
+void JobCachePreflight(const JobCacheHeader* job, Preflight* p);
+// where the job is in the cache, for a checkpoint (checkpoint.h)
+uint32_t JobCacheOffset(const JobCacheHeader* job);
+const JobCacheHeader* JobCacheFindAt(BaseSequentialStream* chp, uint32_t offset);
+void JobCacheList(BaseSequentialStream* chp);
+void JobCacheErase(BaseSequentialStream* chp);
+
+#endif // _JOB_H
@@ -1,12 +1,111 @@
 #include <hal.h>
+#include <math.h>
 #include "laser.h"
+#include "motor.h"
+#include "segment.h"
 
 unsigned LASER_POWER = 1; //percents
 
+static int laser_enabled = 0;
+static unsigned laser_override = 100;
+
+// of LASER_POWER with the override
+static uint32_t LaserWidth(void) {
+	const unsigned hundredths = LASER_POWER * laser_override;
+	return PWM_PERCENTAGE_TO_WIDTH(&PWMD2, hundredths < 10000 ? hundredths : 10000);
+}
+
+void LaserPowerOverrideI(unsigned percent) {
+	laser_override = percent;
+	// not under a row of gray widths
+	if( LaserLitI() && !(STM32_TIM3->CR1 & STM32_TIM_CR1_CEN) ) {
+		pwmEnableChannelI(&PWMD2, 1, LaserWidth());
+	}
+}
+
+unsigned LaserPowerOverride(void) {
+	return laser_override;
+}
+
+int LaserEnabled(void) {
+	return laser_enabled;
+}
+
 void LaserEnable(void) {
-	pwmEnableChannel(&PWMD2, 1, PWM_PERCENTAGE_TO_WIDTH(&PWMD2, LASER_POWER*100));
+	laser_enabled = 1;
+	if( SegmentSinkActive() ) {
+		SegmentSinkLaser(1);
+		return;
+	}
+	LaserOutput(1);
 }
 
 void LaserDisable(void) {
+	laser_enabled = 0;
+	if( SegmentSinkActive() ) {
+		SegmentSinkLaser(0);
+		return;
+	}
+	LaserOutput(0);
+}
+
+void LaserOutput(int enabled) {
+	MotorQueueLaser(enabled);
+}
+
+void LaserEnableI(void) {
+	pwmEnableChannelI(&PWMD2, 1, LaserWidth());
+}
+
+void LaserDisableI(void) {
+	pwmDisableChannelI(&PWMD2, 1);
+}
+
+int LaserLitI(void) {
+	return pwmIsChannelEnabledI(&PWMD2, 1);
+}
+
+uint8_t laser_gray_table[256];
+unsigned laser_gray_min, laser_gray_max;
+float laser_gray_gamma;
+
+void LaserGrayCurve(unsigned min, unsigned max, float gamma) {
+	laser_gray_min = min;
+	laser_gray_max = max;
+	laser_gray_gamma = gamma;
+	laser_gray_table[0] = 0;
+	for( unsigned level = 1; level < 256; ++level ) {
+		const float percent = min + (max - (float)min) * powf(level / 255.0f, gamma);
+		laser_gray_table[level] = PWM_PERCENTAGE_TO_WIDTH(&PWMD2, (uint32_t)(percent * 100 + 0.5f));
+	}
+}
+
+void LaserGrayInit(void) {
+	stm32_tim_t* tim = STM32_TIM3;
+	rccEnableTIM3(FALSE);
+	tim->CR1 = 0;
+	tim->SMCR = STM32_TIM_SMCR_SMS(7) | STM32_TIM_SMCR_TS(0); // clocked by ITR0, TIM1 TRGO
+	tim->DIER = STM32_TIM_DIER_UDE;
+	dmaStreamAllocate(LASER_GRAY_DMA_STREAM, LASER_GRAY_DMA_PRIORITY, NULL, NULL);
+	dmaStreamSetPeripheral(LASER_GRAY_DMA_STREAM, &PWMD2.tim->CCR[1]);
+	LaserGrayCurve(0, 100, 1.0f);
+}
+
+void LaserGrayStartI(const uint8_t* widths, unsigned count, unsigned events) {
+	stm32_tim_t* tim = STM32_TIM3;
+	pwmEnableChannelI(&PWMD2, 1, widths[0]);
+	dmaStreamSetMemory0(LASER_GRAY_DMA_STREAM, widths + 1);
+	dmaStreamSetTransactionSize(LASER_GRAY_DMA_STREAM, count);
+	dmaStreamSetMode(LASER_GRAY_DMA_STREAM, STM32_DMA_CR_PL(LASER_GRAY_DMA_PRIORITY) | STM32_DMA_CR_DIR_M2P |
+		STM32_DMA_CR_MINC | STM32_DMA_CR_MSIZE_BYTE | STM32_DMA_CR_PSIZE_HWORD);
+	dmaStreamEnable(LASER_GRAY_DMA_STREAM);
+	tim->CNT = 0;
+	tim->ARR = events - 1;
+	tim->CR1 = STM32_TIM_CR1_CEN;
+}
+
+void LaserGrayStop(void) {
+	STM32_TIM3->CR1 = 0;
+	dmaStreamDisable(LASER_GRAY_DMA_STREAM);
 	pwmDisableChannel(&PWMD2, 1);
 }
@@ -1,10 +1,53 @@
 #ifndef _LASER_H
 #define _LASER_H
 
+#include <stdint.h>
+
 extern unsigned LASER_POWER;
 
+/*
+ * Power override in percent of LASER_POWER, the output is capped at full
+ * power. It is applied at once when the laser is on. The gray rows keep
+ * the widths of their curve.
+ */
+void LaserPowerOverrideI(unsigned percent);
+unsigned LaserPowerOverride(void);
+
 void LaserEnable(void);
 void LaserDisable(void);
+int LaserEnabled(void);
+// switches the output after the queued moves, with or without a segment sink
+void LaserOutput(int enabled);
+
+// I-class variants, for the step engine
+void LaserEnableI(void);
+void LaserDisableI(void);
+int LaserLitI(void); // the output is on
+
+/*
+ * Grayscale power. The curve maps the 256 gray levels to PWM widths:
+ * level 0 is off, levels 1..255 run from min to max percent through the
+ * gamma exponent. A row of widths is written into the TIM2 channel 2
+ * compare register by DMA without the CPU: TIM1 (the step timer) sends
+ * its update events out on TRGO, TIM3 counts them as its clock and
+ * requests a transfer on every overflow, one per full step.
+ */
+#define LASER_GRAY_DMA_STREAM STM32_DMA1_STREAM3 // TIM3_UP
+#define LASER_GRAY_DMA_PRIORITY 2
+
+extern uint8_t laser_gray_table[256];
+extern unsigned laser_gray_min, laser_gray_max;
+extern float laser_gray_gamma;
+
+void LaserGrayCurve(unsigned min, unsigned max, float gamma);
+void LaserGrayInit(void);
+/*
+ * Puts widths[0] on the output now and widths[1..count] on each of the
+ * next count overflows, every events updates of the step timer. Called
+ * right after the step timer started, under lock.
+ */
+void LaserGrayStartI(const uint8_t* widths, unsigned count, unsigned events);
+void LaserGrayStop(void);
 
 #endif // _LASER_H
 
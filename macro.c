@@ -0,0 +1,380 @@
+#include "macro.h"
+#include "region.h"
+#include "arena.h"
+
+// statements
+#define MACRO_PRIMITIVE 1 // code, argument count (2 bytes), the arguments
+#define MACRO_ASSIGN 2 // variable, expression
+// expression words, an expression ends with MACRO_END
+#define MACRO_END 0
+#define MACRO_CONST 1 // float
+#define MACRO_VAR 2 // variable
+#define MACRO_ADD 3
+#define MACRO_SUB 4
+#define MACRO_MUL 5
+#define MACRO_DIV 6
+#define MACRO_NEG 7
+
+#define MACRO_CIRCLE_VERTICES 64 // at most, fewer on small circles
+
+static float macro_args[MACRO_ARGS_MAX];
+
+Macro* MacroNew(const char* name) {
+	Macro* m = (Macro*)ArenaMalloc(sizeof(Macro));
+	if( m == NULL ) {
+		return NULL;
+	}
+	memset(m, 0, sizeof(*m));
+	strncpy(m->name, name, MACRO_NAME_MAX - 1);
+	return m;
+}
+
+void MacroFree(Macro* m) {
+	ArenaFree(m->code);
+	ArenaFree(m);
+}
+
+static int MacroEmit(Macro* m, const void* data, unsigned size) {
+	if( m->size + size > m->capacity ) {
+		unsigned capacity = m->capacity ? m->capacity * 2 : 64;
+		while( capacity < m->size + size ) {
+			capacity *= 2;
+		}
+		uint8_t* code = (uint8_t*)ArenaMalloc(capacity);
+		if( code == NULL ) {
+			return 0;
+		}
+		if( m->size ) {
+			memcpy(code, m->code, m->size);
+		}
+		ArenaFree(m->code);
+		m->code = code;
+		m->capacity = capacity;
+	}
+	memcpy(m->code + m->size, data, size);
+	m->size += size;
+	return 1;
+}
+
+static int MacroEmitByte(Macro* m, uint8_t word) {
+	return MacroEmit(m, &word, 1);
+}
+
+static int MacroExpression(Macro* m, const char** s);
+
+static int MacroFactor(Macro* m, const char** s) {
+	const char* p = *s;
+	if( *p == '-' || *p == '+' ) {
+		*s = p + 1;
+		return MacroFactor(m, s) && (*p == '+' || MacroEmitByte(m, MACRO_NEG));
+	}
+	if( *p == '(' ) {
+		*s = p + 1;
+		if( !MacroExpression(m, s) || **s != ')' ) {
+			return 0;
+		}
+		++*s;
+		return 1;
+	}
+	if( *p == '$' ) {
+		char* end;
+		const unsigned long v = strtoul(p + 1, &end, 10);
+		if( end == p + 1 || v == 0 || v >= MACRO_VARS ) {
+			return 0;
+		}
+		*s = end;
+		const uint8_t word[2] = { MACRO_VAR, (uint8_t)v };
+		return MacroEmit(m, word, 2);
+	}
+	// decimals only, 'x' is the multiplication
+	float v = 0, f = 0.1f;
+	int digits = 0;
+	for( ; *p >= '0' && *p <= '9'; ++p, ++digits ) {
+		v = v * 10 + (*p - '0');
+	}
+	if( *p == '.' ) {
+		for( ++p; *p >= '0' && *p <= '9'; ++p, ++digits, f /= 10 ) {
+			v += (*p - '0') * f;
+		}
+	}
+	if( digits == 0 ) {
+		return 0;
+	}
+	*s = p;
+	uint8_t word[1 + sizeof(float)] = { MACRO_CONST };
+	memcpy(word + 1, &v, sizeof(float));
+	return MacroEmit(m, word, sizeof(word));
+}
+
+static int MacroTerm(Macro* m, const char** s) {
+	if( !MacroFactor(m, s) ) {
+		return 0;
+	}
+	while( **s == 'x' || **s == 'X' || **s == '/' ) {
+		const uint8_t op = **s == '/' ? MACRO_DIV : MACRO_MUL;
+		++*s;
+		if( !MacroFactor(m, s) || !MacroEmitByte(m, op) ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int MacroExpression(Macro* m, const char** s) {
+	if( !MacroTerm(m, s) ) {
+		return 0;
+	}
+	while( **s == '+' || **s == '-' ) {
+		const uint8_t op = **s == '+' ? MACRO_ADD : MACRO_SUB;
+		++*s;
+		if( !MacroTerm(m, s) || !MacroEmitByte(m, op) ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int MacroAdd(Macro* m, const char* s) {
+	const unsigned at = m->size;
+	char* end;
+	if( s[0] == '$' ) {
+		const unsigned long v = strtoul(s + 1, &end, 10);
+		if( end != s + 1 && v > 0 && v < MACRO_VARS && *end == '=' ) {
+			const uint8_t word[2] = { MACRO_ASSIGN, (uint8_t)v };
+			s = end + 1;
+			if( MacroEmit(m, word, 2) && MacroExpression(m, &s) && *s == '\0' && MacroEmitByte(m, MACRO_END) ) {
+				return 1;
+			}
+		}
+		m->size = at;
+		return 0;
+	}
+
+	const unsigned long code = strtoul(s, &end, 10);
+	if( end == s || code > 255 ) {
+		return 0;
+	}
+	if( code == 0 ) {
+		return 1; // comment
+	}
+	const uint8_t head[4] = { MACRO_PRIMITIVE, (uint8_t)code, 0, 0 };
+	unsigned count = 0;
+	int ok = MacroEmit(m, head, sizeof(head));
+	for( s = end; ok && *s == ','; ++count ) {
+		++s;
+		ok = MacroExpression(m, &s) && MacroEmitByte(m, MACRO_END);
+	}
+	if( !ok || *s != '\0' || count > MACRO_ARGS_MAX ) {
+		m->size = at;
+		return 0;
+	}
+	m->code[at + 2] = count & 0xFF;
+	m->code[at + 3] = count >> 8;
+	return 1;
+}
+
+static float MacroEvaluate(const uint8_t** pc, const float* vars) {
+	float stack[MACRO_STACK];
+	unsigned top = 0;
+	for( ;; ) {
+		const uint8_t op = *(*pc)++;
+		float v;
+		switch( op ) {
+		case MACRO_END:
+			return top ? stack[top - 1] : 0;
+		case MACRO_CONST:
+			memcpy(&v, *pc, sizeof(float));
+			*pc += sizeof(float);
+			break;
+		case MACRO_VAR:
+			v = vars[*(*pc)++];
+			break;
+		case MACRO_NEG:
+			stack[top - 1] = -stack[top - 1];
+			continue;
+		default: {
+			const float b = stack[--top];
+			const float a = stack[--top];
+			v = op == MACRO_ADD ? a + b : op == MACRO_SUB ? a - b : op == MACRO_MUL ? a * b : b != 0 ? a / b : 0;
+		}
+		}
+		if( top < MACRO_STACK ) {
+			stack[top++] = v;
+		}
+	}
+}
+
+/*
+ * Draws the contours of a primitive: vertices are in macro units around
+ * the aperture origin, rotated with the primitive.
+ */
+typedef struct MacroPen {
+	Region* r;
+	float scale;
+	float cos, sin;
+	int first;
+} MacroPen;
+
+static void MacroStart(MacroPen* p, Region* r, float scale, float rotation, float exposure) {
+	p->r = r;
+	p->scale = scale;
+	p->cos = cosf(rotation * (float)M_PI / 180);
+	p->sin = sinf(rotation * (float)M_PI / 180);
+	p->first = 1;
+	RegionPolarity(r, exposure != 0);
+}
+
+static void MacroVertex(MacroPen* p, float x, float y) {
+	const int sx = lroundf((x * p->cos - y * p->sin) * p->scale);
+	const int sy = lroundf((x * p->sin + y * p->cos) * p->scale);
+	if( p->first ) {
+		RegionMoveTo(p->r, sx, sy);
+		p->first = 0;
+	} else {
+		RegionLineTo(p->r, sx, sy);
+	}
+}
+
+// vertices from angle a0 to a1, half a step off the circle at most
+static void MacroArc(MacroPen* p, float cx, float cy, float radius, float a0, float a1) {
+	const float steps = radius * p->scale;
+	float angle = steps > 0.5f ? 2 * acosf(1 - 0.5f / steps) : (float)M_PI;
+	if( angle < 2 * (float)M_PI / MACRO_CIRCLE_VERTICES ) {
+		angle = 2 * (float)M_PI / MACRO_CIRCLE_VERTICES;
+	}
+	int n = (int)ceilf(fabsf(a1 - a0) / angle);
+	n = n > 1 ? n : 1;
+	for( int i = 0; i <= n; ++i ) {
+		const float a = a0 + (a1 - a0) * i / n;
+		MacroVertex(p, cx + radius * cosf(a), cy + radius * sinf(a));
+	}
+}
+
+/*
+ * The four pieces of a thermal, each between the gap lines and the two
+ * circles, or the corner of the gap lines when the inner circle does not
+ * reach past them.
+ */
+static void MacroThermal(MacroPen* p, const float* a) {
+	const float outer = a[2] / 2, inner = a[3] / 2, gap = a[4] / 2;
+	if( gap * (float)M_SQRT2 >= outer ) {
+		return;
+	}
+	const float o = asinf(gap / outer);
+	for( int q = 0; q < 4; ++q ) {
+		const float base = q * (float)M_PI / 2;
+		p->first = 1;
+		MacroArc(p, a[0], a[1], outer, base + o, base + (float)M_PI / 2 - o);
+		if( inner * (float)M_SQRT1_2 > gap ) {
+			const float i = asinf(gap / inner);
+			MacroArc(p, a[0], a[1], inner, base + (float)M_PI / 2 - i, base + i);
+		} else {
+			MacroVertex(p, a[0] + gap * (cosf(base) - sinf(base)), a[1] + gap * (sinf(base) + cosf(base)));
+		}
+	}
+}
+
+static int MacroPrimitive(unsigned code, const float* a, unsigned n, float scale, Region* r) {
+	MacroPen p;
+	switch( code ) {
+	case 1: // circle: exposure, diameter, centre x, y, rotation
+		if( n < 4 ) {
+			return 0;
+		}
+		MacroStart(&p, r, scale, n > 4 ? a[4] : 0, a[0]);
+		MacroArc(&p, a[2], a[3], a[1] / 2, 0, 2 * (float)M_PI);
+		return 1;
+
+	case 20: { // vector line: exposure, width, start x, y, end x, y, rotation
+		if( n < 7 ) {
+			return 0;
+		}
+		const float dx = a[4] - a[2], dy = a[5] - a[3];
+		const float length = sqrtf(dx * dx + dy * dy);
+		if( length == 0 ) {
+			return 1;
+		}
+		const float nx = -dy / length * a[1] / 2, ny = dx / length * a[1] / 2;
+		MacroStart(&p, r, scale, a[6], a[0]);
+		MacroVertex(&p, a[2] + nx, a[3] + ny);
+		MacroVertex(&p, a[4] + nx, a[5] + ny);
+		MacroVertex(&p, a[4] - nx, a[5] - ny);
+		MacroVertex(&p, a[2] - nx, a[3] - ny);
+		return 1;
+	}
+
+	case 21: { // center line: exposure, width, height, centre x, y, rotation
+		if( n < 6 ) {
+			return 0;
+		}
+		const float w = a[1] / 2, h = a[2] / 2;
+		MacroStart(&p, r, scale, a[5], a[0]);
+		MacroVertex(&p, a[3] - w, a[4] - h);
+		MacroVertex(&p, a[3] + w, a[4] - h);
+		MacroVertex(&p, a[3] + w, a[4] + h);
+		MacroVertex(&p, a[3] - w, a[4] + h);
+		return 1;
+	}
+
+	case 4: { // outline: exposure, vertices, vertices + 1 points, rotation
+		if( n < 2 || a[1] < 1 || n < 2 + 2 * ((unsigned)a[1] + 1) + 1 ) {
+			return 0;
+		}
+		const unsigned points = (unsigned)a[1] + 1;
+		MacroStart(&p, r, scale, a[2 + 2 * points], a[0]);
+		for( unsigned i = 0; i < points; ++i ) {
+			MacroVertex(&p, a[2 + 2 * i], a[3 + 2 * i]);
+		}
+		return 1;
+	}
+
+	case 5: { // polygon: exposure, vertices, centre x, y, diameter, rotation
+		if( n < 6 || a[1] < 3 ) {
+			return 0;
+		}
+		const unsigned vertices = (unsigned)a[1];
+		MacroStart(&p, r, scale, a[5], a[0]);
+		for( unsigned i = 0; i < vertices; ++i ) {
+			const float angle = 2 * (float)M_PI * i / vertices;
+			MacroVertex(&p, a[2] + a[4] / 2 * cosf(angle), a[3] + a[4] / 2 * sinf(angle));
+		}
+		return 1;
+	}
+
+	case 7: // thermal: centre x, y, outer, inner diameter, gap, rotation
+		if( n < 6 ) {
+			return 0;
+		}
+		MacroStart(&p, r, scale, a[5], 1);
+		MacroThermal(&p, a);
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+int MacroDraw(const Macro* m, const float* params, unsigned count, float scale, Region* r) {
+	float vars[MACRO_VARS];
+	memset(vars, 0, sizeof(vars));
+	for( unsigned i = 0; i < count && i + 1 < MACRO_VARS; ++i ) {
+		vars[i + 1] = params[i];
+	}
+	int ok = 1;
+	const uint8_t* pc = m->code;
+	while( pc < m->code + m->size ) {
+		if( pc[0] == MACRO_ASSIGN ) {
+			const unsigned v = pc[1];
+			pc += 2;
+			vars[v] = MacroEvaluate(&pc, vars);
+			continue;
+		}
+		const unsigned code = pc[1], n = pc[2] | pc[3] << 8;
+		pc += 4;
+		for( unsigned i = 0; i < n; ++i ) {
+			macro_args[i] = MacroEvaluate(&pc, vars);
+		}
+		ok = MacroPrimitive(code, macro_args, n, scale, r) && ok;
+	}
+	return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef _MACRO_H
+#define _MACRO_H
+
+#include <stdint.h>
+
+/*
+ * %AM aperture macros. The statements of a definition are compiled as
+ * they arrive into a bytecode of primitives and variable assignments,
+ * each argument an expression in postfix form over the $n variables.
+ * An %ADD of the macro evaluates it with its parameters and draws the
+ * primitives into a region (region.h), which is filled once and replayed
+ * on every flash (gerber.c).
+ *
+ * Supported primitives: circle (1), vector line (20), center line (21),
+ * outline (4), polygon (5) and thermal (7). Clear exposure erases the
+ * dark primitives it overlaps, whatever their order.
+ */
+
+#define MACRO_NAME_MAX 32
+#define MACRO_VARS 32 // $1..$31
+#define MACRO_STACK 16
+#define MACRO_ARGS_MAX 136 // an outline of 64 vertices
+
+struct Region;
+
+typedef struct Macro {
+	struct Macro* next;
+	char name[MACRO_NAME_MAX];
+	uint8_t* code;
+	unsigned size;
+	unsigned capacity;
+} Macro;
+
+// NULL when there is no memory for it
+Macro* MacroNew(const char* name);
+void MacroFree(Macro* m);
+// compiles one statement, returns 0 if it is not understood
+int MacroAdd(Macro* m, const char* statement);
+/*
+ * Draws the macro with the %ADD parameters into the region, scale is the
+ * number of steps per unit. Returns 0 on a primitive it cannot draw.
+ */
+int MacroDraw(const Macro* m, const float* params, unsigned count, float scale, struct Region* r);
+
+#endif // _MACRO_H
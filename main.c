@@ -7,11 +7,26 @@
 #include <shell.h>
 #include <chprintf.h>
 #include <stdlib.h>
+#include <malloc.h>
 
 #include "board.c"
+#include "segment.c"
 #include "laser.c"
+#include "perf.c"
 #include "motor.c"
 #include "gerber.c"
+#include "region.c"
+#include "coverage.c"
+#include "macro.c"
+#include "arena.c"
+#include "flash.c"
+#include "preflight.c"
+#include "job.c"
+#include "raster.c"
+#include "checkpoint.c"
+#include "pipeline.c"
+#include "runner.c"
+#include "override.c"
 
 
 #define SHELL_WA_SIZE   THD_WORKING_AREA_SIZE(2048)
@@ -33,6 +48,24 @@ static PWMConfig pwmcfg = {
 	#endif
 };
 
+static GerberContext* gbr = NULL;
+
+/*
+ * The motion queue takes the moves of one thread, the job thread or the
+ * Gerber pipeline while they run.
+ */
+static int MotionBusy(BaseSequentialStream *chp) {
+	if( gbr ) {
+		chprintf(chp, "Gerber machine is in progress\r\n");
+		return 1;
+	}
+	if( RunnerActive() ) {
+		chprintf(chp, "job is in progress\r\n");
+		return 1;
+	}
+	return 0;
+}
+
 static void cmd_start(BaseSequentialStream *chp, int argc, char *argv[]) {
 	(void)argc;
 	(void)argv;
@@ -45,9 +78,12 @@ static void cmd_start(BaseSequentialStream *chp, int argc, char *argv[]) {
 static void cmd_stop(BaseSequentialStream *chp, int argc, char *argv[]) {
 	(void)argc;
 	(void)argv;
-	(void)chp;
+	if( MotionBusy(chp) ) {
+		return;
+	}
 
 	MoveTo(0, 0, 1);
+	MotorGroupWait();
 	MotorDriverSetSleep(MOTOR_X, true);
 	MotorDriverSetSleep(MOTOR_Y, true);
 }
@@ -57,7 +93,11 @@ static void cmd_moveto(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "move XPOS YPOS\r\n");
 		return;
 	}
+	if( MotionBusy(chp) ) {
+		return;
+	}
 	MoveTo(atoi(argv[0]), atoi(argv[1]), 1);
+	MotorGroupWait();
 }
 
 static void cmd_movetol(BaseSequentialStream *chp, int argc, char *argv[]) {
@@ -65,17 +105,24 @@ static void cmd_movetol(BaseSequentialStream *chp, int argc, char *argv[]) {
 		chprintf(chp, "movel XPOS YPOS\r\n");
 		return;
 	}
+	if( MotionBusy(chp) ) {
+		return;
+	}
 
 	LaserEnable();
 	MoveTo(atoi(argv[0]), atoi(argv[1]), 0);
 	LaserDisable();
+	MotorGroupWait();
 }
 
 static void cmd_origin(BaseSequentialStream *chp, int argc, char *argv[]) {
 	(void)argc;
 	(void)argv;
-	(void)chp;
+	if( MotionBusy(chp) ) {
+		return;
+	}
 	MoveTo(0, 0, 1);
+	MotorGroupWait();
 }
 
 static void cmd_ping(BaseSequentialStream *chp, int argc, char *argv[]) {
@@ -85,7 +132,9 @@ static void cmd_ping(BaseSequentialStream *chp, int argc, char *argv[]) {
 }
 
 static void cmd_lamp(BaseSequentialStream *chp, int argc, char *argv[]) {
-	(void)chp;
+	if( MotionBusy(chp) ) {
+		return;
+	}
 	
 	int timeout = argc > 0 ? atoi(argv[0]) : 1;
 	LaserEnable();
@@ -103,16 +152,97 @@ static void cmd_laserpower(BaseSequentialStream *chp, int argc, char *argv[]) {
 	chprintf(chp, "%d%%\r\n", LASER_POWER);
 }
 
-static GerberContext* gbr = NULL;
+// the overrides as the real-time bytes set them (override.h)
+static void cmd_override(BaseSequentialStream *chp, int argc, char *argv[]) {
+	const int feed = argc >= 2 && strcmp(argv[0], "feed") == 0;
+	if( feed || (argc >= 2 && strcmp(argv[0], "power") == 0) ) {
+		const int percent = atoi(argv[1]);
+		chSysLock();
+		if( feed ) {
+			MotorFeedOverrideI(OverrideClamp(percent));
+		} else {
+			LaserPowerOverrideI(OverrideClamp(percent));
+		}
+		chSysUnlock();
+		return;
+	}
+	if( argc > 0 ) {
+		chprintf(chp, "override feed|power PERCENT\r\n");
+		return;
+	}
+	chprintf(chp, "feed %u%%, power %u%%, %u override bytes\r\n",
+		MotorFeedOverride(), LaserPowerOverride(), override_bytes);
+}
+
+static void cmd_gray(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if( argc >= 3 ) {
+		LaserGrayCurve(atoi(argv[0]), atoi(argv[1]), atof(argv[2]));
+		return;
+	}
+	if( argc > 0 ) {
+		chprintf(chp, "gray MIN MAX GAMMA\r\n");
+		return;
+	}
+	const int gamma = (int)(laser_gray_gamma * 100 + 0.5f);
+	chprintf(chp, "%u%%..%u%% gamma %d.%02d\r\n", laser_gray_min, laser_gray_max, gamma / 100, gamma % 100);
+}
+
+// a Gerber job goes on from the checkpoint after job resume
+static Checkpoint gerber_resume;
+static int gerber_resuming = 0;
+static int gerber_aborted = 0;
+static int gerber_checking = 0;
+// the job measured last, for frame (preflight.h)
+static Preflight job_preflight;
+static int job_preflight_kind = CHECKPOINT_NONE;
+
+// the memory of a Gerber job, released by gerber_finish (arena.h)
+#define GERBER_ARENA_SIZE 4096
+static uint64_t gerber_arena_buf[GERBER_ARENA_SIZE / sizeof(uint64_t)];
+static Arena gerber_arena = { (uint8_t*)gerber_arena_buf, sizeof(gerber_arena_buf), 0, 0, 0 };
 
 static void cmd_gerber_start(BaseSequentialStream *chp, int argc, char *argv[]) {
-	(void)argc;
-	(void)argv;
 	if( gbr ) {
 		chprintf(chp, "Gerber machine is already in progress\r\n");
 		return;
 	}
+	if( RunnerActive() ) {
+		chprintf(chp, "job is in progress\r\n");
+		return;
+	}
+	ArenaReset(&gerber_arena);
+	ArenaSet(&gerber_arena);
 	gbr = GerberContextNew();
+	if( gbr == NULL ) {
+		ArenaSet(NULL);
+		chprintf(chp, "no memory for the Gerber job\r\n");
+		return;
+	}
+	memset(&motor_merge_stats, 0, sizeof(motor_merge_stats));
+	motor_queue.high = 0;
+	gerber_checking = 0;
+	for( int i = 0; i < argc; ++i ) {
+		if( strcmp(argv[i], "cover") == 0 ) {
+			// burn overlapping copper once (coverage.h)
+			Coverage* coverage = CoverageNew(gbr->tool_width / (2.0f * gbr->step_accuracy));
+			if( coverage == NULL ) {
+				chprintf(chp, "no memory for the coverage, overlapping copper is burned again\r\n");
+			}
+			CoverageSet(coverage);
+		} else if( strcmp(argv[i], "check") == 0 ) {
+			// measured up to gerber_finish, nothing moves (preflight.h)
+			gerber_checking = 1;
+		}
+	}
+	if( gerber_checking ) {
+		PreflightReset(&job_preflight, CUR_X, CUR_Y);
+		job_preflight_kind = CHECKPOINT_NONE;
+		PipelineStart(gbr, NULL, &job_preflight);
+		return;
+	}
+	PipelineStart(gbr, gerber_resuming ? &gerber_resume : NULL, NULL);
+	gerber_resuming = 0;
+	gerber_aborted = 0;
 }
 
 static void cmd_gerber_finish(BaseSequentialStream *chp, int argc, char *argv[]) {
@@ -122,19 +252,300 @@ static void cmd_gerber_finish(BaseSequentialStream *chp, int argc, char *argv[])
 		chprintf(chp, "Gerber machine is already free\r\n");
 		return;
 	}
+	PipelineStop();
+	if( gerber_checking ) {
+		// the interpreter kept CUR_X and CUR_Y along the moves not made
+		CUR_X = job_preflight.x0;
+		CUR_Y = job_preflight.y0;
+		job_preflight_kind = CHECKPOINT_GERBER;
+		PreflightPrint(chp, &job_preflight);
+	} else {
+		// after job abort the moves were dropped up to here, the checkpoint stays
+		int dx, dy;
+		MotorDropped(&dx, &dy);
+		CUR_X -= dx;
+		CUR_Y -= dy;
+		if( !gerber_aborted ) {
+			CheckpointClear();
+		}
+		MotorResume();
+	}
+	Coverage* coverage = CoverageActive();
+	if( coverage ) {
+		const unsigned burn = coverage->burn * gbr->step_accuracy;
+		const unsigned saved = coverage->saved * gbr->step_accuracy;
+		chprintf(chp, "coverage: %u.%02u of %u.%02u mm burn skipped over burned copper, %u tiles dropped\r\n",
+			saved / 100, saved % 100, burn / 100, burn % 100, coverage->dropped);
+		CoverageSet(NULL);
+		CoverageFree(coverage);
+	}
 	GerberContextFree(gbr);
 	gbr = NULL;
+	chprintf(chp, "arena: %u of %u bytes used, high-water %u, %u allocations spilled to the heap\r\n",
+		(unsigned)gerber_arena.used, (unsigned)gerber_arena.size, (unsigned)gerber_arena.high, gerber_arena.spilled);
+	ArenaSet(NULL);
+	ArenaReset(&gerber_arena);
+	if( gerber_checking ) {
+		return;
+	}
+	const MotorMergeStats* ms = &motor_merge_stats;
+	chprintf(chp, "moves: %u queued, %u merged, %u dropped, %u started, %u chained\r\n",
+		ms->queued, ms->merged, ms->dropped, ms->started, ms->chained);
 }
 
 static void cmd_gerber(BaseSequentialStream *chp, int argc, char *argv[]) {
 	if( !gbr) {
 		chprintf(chp, "No Gerber machine was activated\r\n");
+		return;
 	}
 	if( argc < 1 ) {
 		chprintf(chp, "Wrong Gerber command\r\n");
 		return;
 	}
-	GerberAcceptCommand(gbr, argc, argv);
+	// interpreted while the next line comes in (pipeline.h)
+	PipelineSubmit(argc, argv);
+}
+
+static void cmd_pipeline(BaseSequentialStream *chp, int argc, char *argv[]) {
+	(void)argc;
+	(void)argv;
+	PipelinePrintStats(chp);
+}
+
+// from the checkpoint of the job aborted or cut off by a reset (checkpoint.h)
+static void JobResume(BaseSequentialStream *chp) {
+	Checkpoint c;
+	if( !CheckpointLoad(&c) ) {
+		chprintf(chp, "no checkpoint to resume from\r\n");
+		return;
+	}
+	int x, y;
+	if( CheckpointOrigin(&x, &y) ) {
+		chprintf(chp, "the head goes back to the job origin %d,%d first\r\n", x, y);
+	} else {
+		chprintf(chp, "the job origin is lost with the reset, the head has to stand at it\r\n");
+	}
+	if( c.kind == CHECKPOINT_CACHED ) {
+		RunnerResumeFrom(chp, &c);
+		return;
+	}
+	gerber_resume = c;
+	gerber_resuming = 1;
+	chprintf(chp, "send the Gerber job again from gerber_start, the moves before line %u are skipped\r\n", (unsigned)c.line);
+}
+
+static void JobCheck(BaseSequentialStream *chp, const char *name) {
+	const JobCacheHeader* job = JobCacheFind(chp, name);
+	if( job == NULL ) {
+		return;
+	}
+	JobCachePreflight(job, &job_preflight);
+	job_preflight_kind = CHECKPOINT_CACHED;
+	PreflightPrint(chp, &job_preflight);
+}
+
+static void cmd_job(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if( argc < 1 ) {
+		chprintf(chp, "job SEGMENTS | save NAME SEGMENTS | run NAME | check NAME | list | erase | status | pause | resume | abort\r\n");
+		return;
+	}
+	if( strcmp(argv[0], "list") == 0 ) {
+		JobCacheList(chp);
+		return;
+	}
+	// the job control takes the Gerber jobs too
+	if( strcmp(argv[0], "status") == 0 ) {
+		RunnerPrintStatus(chp);
+		if( gbr ) {
+			chprintf(chp, "gerber: line %u, motion queue: %u of %u records\r\n",
+				pipeline_line_stats.items, SegmentQueueCount(&motor_queue), MOTOR_QUEUE_LENGTH);
+		}
+		Checkpoint c;
+		if( CheckpointLoad(&c) ) {
+			chprintf(chp, "checkpoint: %s job, segment %u, %s %u, at %d,%d\r\n",
+				c.kind == CHECKPOINT_GERBER ? "Gerber" : "cached", (unsigned)c.segment,
+				c.kind == CHECKPOINT_GERBER ? "line" : "cache offset", (unsigned)c.line, (int)c.x, (int)c.y);
+		}
+		return;
+	}
+	if( strcmp(argv[0], "pause") == 0 ) {
+		RunnerPause();
+		return;
+	}
+	if( strcmp(argv[0], "resume") == 0 ) {
+		if( RunnerActive() || gbr ) {
+			RunnerResume();
+		} else {
+			JobResume(chp);
+		}
+		return;
+	}
+	if( strcmp(argv[0], "abort") == 0 ) {
+		if( RunnerActive() ) {
+			RunnerAbort();
+		} else if( gbr ) {
+			gerber_aborted = 1;
+			MotorAbort();
+			chprintf(chp, "moves are dropped up to gerber_finish\r\n");
+		} else {
+			chprintf(chp, "no job in progress\r\n");
+		}
+		return;
+	}
+	if( gbr ) {
+		chprintf(chp, "Gerber machine is in progress\r\n");
+		return;
+	}
+	if( RunnerActive() ) {
+		chprintf(chp, "job is in progress\r\n");
+		return;
+	}
+	if( strcmp(argv[0], "save") == 0 && argc > 2 ) {
+		if( atoi(argv[2]) <= 0 ) {
+			chprintf(chp, "job needs at least one segment\r\n");
+			return;
+		}
+		JobCacheSave(chp, argv[1], atoi(argv[2]));
+	} else if( strcmp(argv[0], "run") == 0 && argc > 1 ) {
+		RunnerStart(chp, argv[1]);
+	} else if( strcmp(argv[0], "check") == 0 && argc > 1 ) {
+		JobCheck(chp, argv[1]);
+	} else if( strcmp(argv[0], "erase") == 0 ) {
+		JobCacheErase(chp);
+	} else if( atoi(argv[0]) > 0 ) {
+		JobReceive(chp, atoi(argv[0]));
+	} else {
+		chprintf(chp, "job needs at least one segment\r\n");
+	}
+}
+
+static void cmd_limits(BaseSequentialStream *chp, int argc, char *argv[]) {
+	PreflightBox* l = &preflight_limits;
+	if( argc > 0 && strcmp(argv[0], "off") == 0 ) {
+		l->empty = 1;
+	} else if( argc > 3 && atoi(argv[0]) <= atoi(argv[2]) && atoi(argv[1]) <= atoi(argv[3]) ) {
+		l->xmin = atoi(argv[0]);
+		l->ymin = atoi(argv[1]);
+		l->xmax = atoi(argv[2]);
+		l->ymax = atoi(argv[3]);
+		l->empty = 0;
+	} else if( argc > 0 ) {
+		chprintf(chp, "limits XMIN YMIN XMAX YMAX | off\r\n");
+		return;
+	}
+	if( l->empty ) {
+		chprintf(chp, "soft limits off, head at %d,%d\r\n", CUR_X, CUR_Y);
+	} else {
+		chprintf(chp, "soft limits x %d..%d, y %d..%d, head at %d,%d\r\n", l->xmin, l->xmax, l->ymin, l->ymax, CUR_X, CUR_Y);
+	}
+}
+
+// the bounds of the burning moves of the job checked last, with rapids
+static void cmd_frame(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if( MotionBusy(chp) ) {
+		return;
+	}
+	if( job_preflight_kind == CHECKPOINT_NONE ) {
+		chprintf(chp, "no job checked, job check NAME or gerber_start check first\r\n");
+		return;
+	}
+	const PreflightBox* b = &job_preflight.burn;
+	if( b->empty ) {
+		chprintf(chp, "the job burns nothing\r\n");
+		return;
+	}
+	// a cached job runs from the head, a Gerber job where its coordinates are
+	const int x0 = job_preflight_kind == CHECKPOINT_CACHED ? CUR_X : job_preflight.x0;
+	const int y0 = job_preflight_kind == CHECKPOINT_CACHED ? CUR_Y : job_preflight.y0;
+	if( !PreflightInside(x0 + b->xmin, y0 + b->ymin) || !PreflightInside(x0 + b->xmax, y0 + b->ymax) ) {
+		chprintf(chp, "the frame is outside the soft limits\r\n");
+		return;
+	}
+	const int x = CUR_X, y = CUR_Y;
+	const unsigned power = LASER_POWER;
+	MoveTo(x0 + b->xmin, y0 + b->ymin, 1);
+	if( argc > 0 ) {
+		// a pointer power that shows the frame without burning
+		LASER_POWER = atoi(argv[0]);
+		LaserEnable();
+	}
+	MoveTo(x0 + b->xmax, y0 + b->ymin, 1);
+	MoveTo(x0 + b->xmax, y0 + b->ymax, 1);
+	MoveTo(x0 + b->xmin, y0 + b->ymax, 1);
+	MoveTo(x0 + b->xmin, y0 + b->ymin, 1);
+	if( argc > 0 ) {
+		LaserDisable();
+		// the step ISR lights the laser with the power it finds
+		MotorGroupWait();
+		LASER_POWER = power;
+	}
+	MoveTo(x, y, 1);
+	MotorGroupWait();
+}
+
+static void cmd_raster(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if( argc < 1 ) {
+		chprintf(chp, "raster ROWS | stat\r\n");
+		return;
+	}
+	if( strcmp(argv[0], "stat") == 0 ) {
+		RasterPrintStats(chp);
+		return;
+	}
+	if( MotionBusy(chp) ) {
+		return;
+	}
+	RasterReceive(chp, atoi(argv[0]));
+}
+
+// bytes at the bottom of a stack that still hold the fill pattern, never reached
+static size_t StackUnused(const void* base, const void* end) {
+	const uint8_t* p = (const uint8_t*)base;
+	while( p < (const uint8_t*)end && *p == CH_DBG_STACK_FILL_VALUE ) {
+		++p;
+	}
+	return p - (const uint8_t*)base;
+}
+
+static void StackPrint(BaseSequentialStream *chp, const char* name, const void* base, const void* end) {
+	const unsigned size = (const uint8_t*)end - (const uint8_t*)base;
+	chprintf(chp, "stack %s: %u of %u bytes never used\r\n", name, (unsigned)StackUnused(base, end), size);
+}
+
+// filled by crt0 with the same pattern as the thread working areas
+extern stkalign_t __main_stack_base__, __main_stack_end__;
+extern stkalign_t __main_thread_stack_end__;
+
+// cycle counts of the step ISR (perf.h)
+static void cmd_perf(BaseSequentialStream *chp, int argc, char *argv[]) {
+	if( argc > 0 && strcmp(argv[0], "reset") == 0 ) {
+		PerfReset();
+		return;
+	}
+	PerfPrint(chp);
+}
+
+static void cmd_mem(BaseSequentialStream *chp, int argc, char *argv[]) {
+	(void)argc;
+	(void)argv;
+
+	size_t heap_largest;
+	size_t heap_free;
+	const size_t heap_fragments = chHeapStatus(NULL, &heap_free, &heap_largest);
+	const struct mallinfo mi = mallinfo();
+	chprintf(chp, "core: %u bytes free\r\n", (unsigned)chCoreGetStatusX());
+	chprintf(chp, "heap: %u bytes free in %u fragments, largest %u\r\n",
+		(unsigned)heap_free, (unsigned)heap_fragments, (unsigned)heap_largest);
+	chprintf(chp, "malloc: %u bytes in use, %u free in its pool\r\n", (unsigned)mi.uordblks, (unsigned)mi.fordblks);
+	chprintf(chp, "arena: %u of %u bytes, high-water %u\r\n",
+		(unsigned)gerber_arena.used, (unsigned)gerber_arena.size, (unsigned)gerber_arena.high);
+	chprintf(chp, "motion queue: high-water %u of %u records, %u moves held as one at most\r\n",
+		motor_queue.high, MOTOR_QUEUE_LENGTH, motor_merge_stats.held_high);
+	// a thread is at the top of its working area, but the main thread
+	for( thread_t* tp = chRegFirstThread(); tp; tp = chRegNextThread(tp) ) {
+		StackPrint(chp, tp->name, tp->wabase, tp == &ch.mainthread ? (void*)&__main_thread_stack_end__ : (void*)tp);
+	}
+	StackPrint(chp, "exceptions", &__main_stack_base__, &__main_stack_end__);
 }
 
 static const ShellCommand commands[] = {
@@ -142,6 +553,7 @@ static const ShellCommand commands[] = {
 	{"stop", cmd_stop},
 	{"lamp", cmd_lamp},
 	{"laserpower", cmd_laserpower},
+	{"override", cmd_override},
 	{"move", cmd_moveto},
 	{"movel", cmd_movetol},
 	{"origin", cmd_origin},
@@ -149,6 +561,14 @@ static const ShellCommand commands[] = {
 	{"gerber_start", cmd_gerber_start},
 	{"gerber_finish", cmd_gerber_finish},
 	{"gerber", cmd_gerber},
+	{"job", cmd_job},
+	{"raster", cmd_raster},
+	{"limits", cmd_limits},
+	{"frame", cmd_frame},
+	{"gray", cmd_gray},
+	{"mem", cmd_mem},
+	{"pipeline", cmd_pipeline},
+	{"perf", cmd_perf},
 	{NULL, NULL}
 };
 
@@ -160,7 +580,7 @@ static const ShellConfig shell_cfg1 = {
 static const GPTConfig gpt_motor = {
 	1000000,
 	MotorCallback,
-	0,
+	STM32_TIM_CR2_MMS(2), // update events on TRGO, they clock the gray power DMA (laser.h)
 	0
 };
 
@@ -173,13 +593,19 @@ int main(void) {
 	palSetPadMode(GPIOB, 10, PAL_MODE_STM32_ALTERNATE_PUSHPULL);
 
         sdStart(&SD3, NULL);
+	OverrideInit();
 
 	pwmStart(&PWMD2, &pwmcfg);
+	LaserGrayInit();
 	
 	gptStart(MOTOR_TIMER, &gpt_motor);
+	PerfInit();
 
 	MotorDriverInit(MOTOR_X);
 	MotorDriverInit(MOTOR_Y);
+	CheckpointInit();
+	PipelineInit();
+	RunnerInit();
 	
 	while( 1 ) {
 		thread_t *shelltp = chThdCreateFromHeap(
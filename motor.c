@@ -1,4 +1,7 @@
+#include <stdlib.h>
 #include "motor.h"
+#include "laser.h"
+#include "perf.h"
 
 #define STEP_MEANDR 20
 #define STEP_WAIT 500
@@ -20,20 +23,134 @@ static uint16_t motor_microsteps;
 static unsigned char motor_x_involved, motor_y_involved; // involved on next full step
 static int motor_move_silent;
 Stepfunction motor_step_next_stage, motor_step_function;
+static const uint16_t* motor_gate_edges;
+static unsigned motor_gate_count, motor_gate_index;
+static const uint8_t* motor_power_widths;
+static unsigned motor_power_count;
+static volatile int motor_running; // cleared by the timer when the move is done
+static int motor_started; // a move was started and not waited for yet
+// the move held back to be merged with the next ones, see MotorGroupQueueSteps
+static int motor_held, motor_held_dx, motor_held_dy, motor_held_silent;
+static unsigned motor_held_moves;
+static int motor_queue_laser; // for the moves queued from now on, see MotorQueueLaser
+// feed hold, see MotorHold
+#define MOTOR_HOLD 1
+#define MOTOR_ABORT 2
+static volatile int motor_hold;
+static volatile int motor_hold_stopped; // the timer was stopped by the hold
+static int motor_hold_laser; // the laser was on when it was stopped
+// feed override, see MotorFeedOverrideI
+static unsigned motor_feed = 100;
+static uint32_t motor_feed_wait = STEP_WAIT;
+static volatile uint32_t motor_steps; // full steps made, see MotorSteps
+static int motor_move_sx, motor_move_sy; // the signs of the move being made, 0 unknown
+static int motor_dropped_dx, motor_dropped_dy; // see MotorDropped
+
+MotorMergeStats motor_merge_stats;
+
+static uint8_t motor_queue_records[MOTOR_QUEUE_LENGTH * SEGMENT_WIRE_SIZE];
+SegmentQueue motor_queue = { motor_queue_records, MOTOR_QUEUE_LENGTH, 0, 0, 0 };
 
 BSEMAPHORE_DECL(motor_sem, TRUE);
+BSEMAPHORE_DECL(motor_queue_sem, TRUE); // signalled when the ISR takes a record
+BSEMAPHORE_DECL(motor_resume_sem, TRUE);
 
 static void MotorStepStageMakeMicrostep(GPTDriver* gptp);
+void MotorStepStagePrepareFullStep(GPTDriver* gptp);
+void MotorStepStagePrepareFullStepSilent(GPTDriver* gptp);
+
+static void MotorGateStep(void) {
+	if( motor_gate_index < motor_gate_count && motor_movement_x1 == motor_gate_edges[motor_gate_index] ) {
+		if( motor_gate_index & 1 ) {
+			LaserDisableI();
+		} else {
+			LaserEnableI();
+		}
+		++motor_gate_index;
+	}
+}
+
+static void MotorLaserI(int enabled) {
+	if( !enabled != !LaserLitI() ) {
+		if( enabled ) {
+			LaserEnableI();
+		} else {
+			LaserDisableI();
+		}
+	}
+}
+
+// a laser switch queued after the last move, not under a gate or a power table
+static void MotorQueueLaserI(void) {
+	if( !motor_gate_edges && !motor_power_widths && SegmentQueueCount(&motor_queue) == 0 ) {
+		MotorLaserI(motor_queue_laser);
+	}
+}
+
+static void MotorMoveSet(int dx, int dy) {
+	motor_move_sx = dx >= 0 ? 1 : -1;
+	motor_move_sy = dy >= 0 ? 1 : -1;
+	MotorDriverSetDirection(MOTOR_X, dx >= 0 ? MOTOR_X_DIRECTION_PLUS : MOTOR_X_DIRECTION_MINUS);
+	MotorDriverSetDirection(MOTOR_Y, dy >= 0 ? MOTOR_Y_DIRECTION_PLUS : MOTOR_Y_DIRECTION_MINUS);
+	motor_movement_x1 = 0;
+	motor_movement_y1 = 0;
+	motor_movement_x2 = motor_x_delta = dx >= 0 ? dx : -dx;
+	motor_movement_y2 = motor_y_delta = dy >= 0 ? dy : -dy;
+	motor_movement_interpolation_error = motor_x_delta - motor_y_delta;
+	motor_gate_index = 0;
+}
+
+/*
+ * The next queued move, set up when the last step of the current one is
+ * made so that the directions settle before the next step, with the laser
+ * state it carries. Moves under a gate or a power table are started on
+ * their own.
+ */
+static void MotorQueueNext(void) {
+	Segment s;
+	if( motor_gate_edges || motor_power_widths || !SegmentQueuePop(&motor_queue, &s) ) {
+		return;
+	}
+	MotorMoveSet(s.dx, s.dy);
+	MotorLaserI(s.flags & SEGMENT_LASER);
+	motor_move_silent = (s.flags & SEGMENT_RAPID) ? 1 : 0;
+	motor_step_function = motor_move_silent ? MotorStepStagePrepareFullStepSilent : MotorStepStagePrepareFullStep;
+	++motor_merge_stats.chained;
+	chBSemSignalI(&motor_queue_sem);
+}
+
+/*
+ * Stops the timer where a full step would begin, the next stage stays the
+ * same so that MotorResume makes the step. The DMA of a power table counts
+ * the updates of the timer, such a move is not stopped.
+ */
+static int MotorHoldI(GPTDriver* gptp) {
+	if( !motor_hold || motor_power_widths ) {
+		return 0;
+	}
+	gptStopTimerI(gptp);
+	motor_hold_stopped = 1;
+	motor_hold_laser = LaserLitI();
+	LaserDisableI();
+	return 1;
+}
 
 static void MotorStepStageOnMeandrGenerated(GPTDriver* gptp) {
 	MotorDriverSetPad(MOTOR_X, PadStep, 0);
 	MotorDriverSetPad(MOTOR_Y, PadStep, 0);
 	--motor_microsteps;
+	if( motor_step_function != MotorStepStageMakeMicrostep &&
+		motor_movement_x1 == motor_movement_x2 && motor_movement_y1 == motor_movement_y2 ) {
+		MotorQueueNext();
+	}
 	motor_step_next_stage = motor_step_function;
-	gptChangeIntervalI(gptp, STEP_WAIT);
+	gptChangeIntervalI(gptp, motor_move_silent ? STEP_WAIT : motor_feed_wait);
 }
 
 void MotorStepStagePrepareFullStepSilent(GPTDriver* gptp) {
+	if( MotorHoldI(gptp) ) {
+		return;
+	}
 	motor_x_involved = motor_movement_x1 != motor_movement_x2 ? 1 : 0;
 	if( motor_x_involved ) {
 		++motor_movement_x1;
@@ -49,9 +166,12 @@ void MotorStepStagePrepareFullStepSilent(GPTDriver* gptp) {
 	if( !(motor_x_involved || motor_y_involved) ) {
 		// finished
 		gptStopTimerI(gptp);
+		MotorQueueLaserI();
+		motor_running = 0;
 		chBSemSignalI(&motor_sem);
 		return;
 	}
+	++motor_steps;
 
 	if( MOTOR_MICROSTEPPING == sFull ) {
 		motor_step_function = MotorStepStagePrepareFullStepSilent;
@@ -65,12 +185,18 @@ void MotorStepStagePrepareFullStepSilent(GPTDriver* gptp) {
 }
 
 void MotorStepStagePrepareFullStep(GPTDriver* gptp) {
+	if( MotorHoldI(gptp) ) {
+		return;
+	}
 	if( motor_movement_x1 == motor_movement_x2 && motor_movement_y1 == motor_movement_y2 ) {
 		// finished
 		gptStopTimerI(gptp);
+		MotorQueueLaserI();
+		motor_running = 0;
 		chBSemSignalI(&motor_sem);
 		return;
 	}
+	++motor_steps;
 
 	if( MOTOR_MICROSTEPPING == sFull ) {
 		motor_step_function = MotorStepStagePrepareFullStep;
@@ -82,6 +208,9 @@ void MotorStepStagePrepareFullStep(GPTDriver* gptp) {
 	const int error = motor_movement_interpolation_error * 2;
 	if(error > -motor_y_delta) {
 		motor_movement_interpolation_error -= motor_y_delta;
+		if( motor_gate_edges ) {
+			MotorGateStep();
+		}
 		++motor_movement_x1;
 		motor_x_involved = 1;
 		MotorDriverSetPad(MOTOR_X, PadStep, 1);
@@ -117,9 +246,22 @@ void MotorStepStageMakeMicrostep(GPTDriver* gptp) {
 }
 
 
+static inline unsigned MotorStage(Stepfunction stage) {
+	if( stage == MotorStepStagePrepareFullStep ) {
+		return PERF_STAGE_FULL_STEP;
+	}
+	if( stage == MotorStepStagePrepareFullStepSilent ) {
+		return PERF_STAGE_FULL_STEP_SILENT;
+	}
+	return stage == MotorStepStageMakeMicrostep ? PERF_STAGE_MICROSTEP : PERF_STAGE_MEANDR;
+}
+
 static void MotorCallback(GPTDriver* gptp) {
+	const uint32_t entry = PerfEnterI();
 	osalSysLockFromISR();
-	motor_step_next_stage(gptp);
+	const Stepfunction stage = motor_step_next_stage;
+	stage(gptp);
+	PerfLeaveI(gptp, entry, MotorStage(stage));
 	osalSysUnlockFromISR();
 }
 
@@ -199,7 +341,29 @@ MotorDriver DRV2 = {
 };
 
 
-void MotorGroupMakeSteps(const unsigned x_count, const unsigned y_count, int silent) {
+void MotorGateSet(const uint16_t* edges, unsigned count) {
+	MotorGroupWait();
+	motor_gate_edges = edges;
+	motor_gate_count = count;
+	motor_gate_index = 0;
+}
+
+void MotorPowerSet(const uint8_t* widths, unsigned count) {
+	MotorGroupWait();
+	motor_power_widths = widths;
+	motor_power_count = count;
+}
+
+static void MotorGroupRun(const unsigned x_count, const unsigned y_count, int silent, int laser) {
+	while( motor_hold == MOTOR_HOLD ) {
+		chBSemWait(&motor_resume_sem);
+	}
+	if( motor_hold == MOTOR_ABORT ) {
+		// the signs are those of the move, set by the caller
+		motor_dropped_dx += motor_move_sx * (int)x_count;
+		motor_dropped_dy += motor_move_sy * (int)y_count;
+		return;
+	}
 	motor_movement_x1 = 0;
 	motor_movement_y1 = 0;
 	motor_movement_x2 = x_count;
@@ -208,8 +372,221 @@ void MotorGroupMakeSteps(const unsigned x_count, const unsigned y_count, int sil
 	motor_y_delta = y_count;
 	motor_movement_interpolation_error = motor_x_delta - motor_y_delta;
 	motor_move_silent = silent;
+	motor_gate_index = 0;
 
 	motor_step_next_stage = silent ? MotorStepStagePrepareFullStepSilent: MotorStepStagePrepareFullStep;
-	gptStartContinuous(MOTOR_TIMER, STEP_MEANDR);
-	chBSemWait(&motor_sem);
+	motor_running = 1;
+	motor_started = 1;
+	chSysLock();
+	if( !motor_gate_edges && !motor_power_widths ) {
+		MotorLaserI(laser);
+	}
+	gptStartContinuousI(MOTOR_TIMER, STEP_MEANDR);
+	PerfStartI(MOTOR_TIMER);
+	if( motor_power_widths ) {
+		// armed after the start, the update generated by it is not counted
+		LaserGrayStartI(motor_power_widths, motor_power_count, 2 * MOTOR_MICROSTEPPING);
+	}
+	chSysUnlock();
+	++motor_merge_stats.started;
+}
+
+static void MotorGroupWaitRunning(void) {
+	if( motor_started ) {
+		chBSemWait(&motor_sem);
+		motor_started = 0;
+	}
+}
+
+void MotorGroupStartSteps(const unsigned x_count, const unsigned y_count, int silent) {
+	MotorGroupWait();
+	motor_move_sx = motor_move_sy = 0;
+	MotorGroupRun(x_count, y_count, silent, motor_queue_laser);
+}
+
+void MotorGroupQueueSteps(int dx, int dy, int silent) {
+	++motor_merge_stats.queued;
+	if( dx == 0 && dy == 0 ) {
+		++motor_merge_stats.dropped;
+		return;
+	}
+	// the same direction: parallel and no axis turning back
+	if( motor_held && silent == motor_held_silent && (int64_t)dx * motor_held_dy == (int64_t)dy * motor_held_dx &&
+		(dx ^ motor_held_dx) >= 0 && (dy ^ motor_held_dy) >= 0 ) {
+		motor_held_dx += dx;
+		motor_held_dy += dy;
+		++motor_merge_stats.merged;
+		++motor_held_moves;
+	} else {
+		MotorGroupFlush();
+		motor_held = 1;
+		motor_held_dx = dx;
+		motor_held_dy = dy;
+		motor_held_silent = silent;
+		motor_held_moves = 1;
+	}
+	if( motor_held_moves > motor_merge_stats.held_high ) {
+		motor_merge_stats.held_high = motor_held_moves;
+	}
+}
+
+// starts the timer on the next queued move if it stands, returns whether it did
+static int MotorQueueStart(void) {
+	Segment s;
+	if( motor_running || !SegmentQueuePop(&motor_queue, &s) ) {
+		return 0;
+	}
+	// takes the signal of the last stop
+	MotorGroupWaitRunning();
+	MotorDriverSetDirection(MOTOR_X, s.dx >= 0 ? MOTOR_X_DIRECTION_PLUS : MOTOR_X_DIRECTION_MINUS);
+	MotorDriverSetDirection(MOTOR_Y, s.dy >= 0 ? MOTOR_Y_DIRECTION_PLUS : MOTOR_Y_DIRECTION_MINUS);
+	motor_move_sx = s.dx >= 0 ? 1 : -1;
+	motor_move_sy = s.dy >= 0 ? 1 : -1;
+	MotorGroupRun(abs(s.dx), abs(s.dy), (s.flags & SEGMENT_RAPID) ? 1 : 0, s.flags & SEGMENT_LASER);
+	return 1;
+}
+
+// matches SegmentSink
+static void MotorQueuePush(void* arg, const Segment* s) {
+	(void)arg;
+	if( motor_hold == MOTOR_ABORT ) {
+		motor_dropped_dx += s->dx;
+		motor_dropped_dy += s->dy;
+		return;
+	}
+	while( !SegmentQueuePush(&motor_queue, s) ) {
+		if( !MotorQueueStart() ) {
+			++motor_merge_stats.stalls;
+			chBSemWait(&motor_queue_sem);
+		}
+		// woken by MotorAbort
+		if( motor_hold == MOTOR_ABORT ) {
+			motor_dropped_dx += s->dx;
+			motor_dropped_dy += s->dy;
+			return;
+		}
+	}
+}
+
+void MotorGroupFlush(void) {
+	if( !motor_held ) {
+		return;
+	}
+	motor_held = 0;
+	const uint8_t flags = (motor_held_silent ? SEGMENT_RAPID : 0) | (motor_queue_laser ? SEGMENT_LASER : 0);
+	SegmentSplit(motor_held_dx, motor_held_dy, flags, MotorQueuePush, NULL);
+	MotorQueueStart();
+}
+
+void MotorQueueLaser(int enabled) {
+	if( enabled != motor_queue_laser ) {
+		// the held move keeps the state it was queued with
+		MotorGroupFlush();
+		motor_queue_laser = enabled;
+	}
+	chSysLock();
+	// the ISR applies it after the last queued move, the aborted moves are made without it
+	if( !motor_running && motor_hold != MOTOR_ABORT ) {
+		MotorQueueLaserI();
+	}
+	chSysUnlock();
+}
+
+void MotorHold(void) {
+	if( !motor_hold ) {
+		motor_hold = MOTOR_HOLD;
+	}
+}
+
+void MotorResume(void) {
+	chSysLock();
+	motor_hold = 0;
+	if( motor_hold_stopped ) {
+		motor_hold_stopped = 0;
+		if( motor_hold_laser ) {
+			LaserEnableI();
+		}
+		gptStartContinuousI(MOTOR_TIMER, STEP_MEANDR);
+		PerfStartI(MOTOR_TIMER);
+	}
+	chBSemSignalI(&motor_resume_sem);
+	chSchRescheduleS();
+	chSysUnlock();
+}
+
+void MotorAbort(void) {
+	chSysLock();
+	motor_hold = MOTOR_ABORT;
+	motor_hold_stopped = 0;
+	gptStopTimerI(MOTOR_TIMER);
+	LaserDisableI();
+	// the ISR stands, the records are taken from its side
+	Segment s;
+	while( SegmentQueuePop(&motor_queue, &s) ) {
+		motor_dropped_dx += s.dx;
+		motor_dropped_dy += s.dy;
+	}
+	if( motor_held ) {
+		motor_dropped_dx += motor_held_dx;
+		motor_dropped_dy += motor_held_dy;
+		motor_held = 0;
+	}
+	if( motor_running ) {
+		// the rest of the move being made
+		motor_dropped_dx += motor_move_sx * (int)(motor_movement_x2 - motor_movement_x1);
+		motor_dropped_dy += motor_move_sy * (int)(motor_movement_y2 - motor_movement_y1);
+		motor_running = 0;
+		chBSemSignalI(&motor_sem);
+	}
+	// a thread waiting for room or for the resume goes on and drops its moves
+	chBSemSignalI(&motor_queue_sem);
+	chBSemSignalI(&motor_resume_sem);
+	chSchRescheduleS();
+	chSysUnlock();
+}
+
+void MotorFeedOverrideI(unsigned percent) {
+	motor_feed = percent;
+	// the whole microstep is scaled, the meander keeps its width
+	motor_feed_wait = (STEP_MEANDR + STEP_WAIT) * 100 / percent - STEP_MEANDR;
+}
+
+unsigned MotorFeedOverride(void) {
+	return motor_feed;
+}
+
+uint32_t MotorStepTime(int silent) {
+	return MOTOR_MICROSTEPPING * (STEP_MEANDR + (silent ? STEP_WAIT : motor_feed_wait));
+}
+
+uint32_t MotorSteps(void) {
+	return motor_steps;
+}
+
+void MotorDropped(int* dx, int* dy) {
+	chSysLock();
+	*dx = motor_dropped_dx;
+	*dy = motor_dropped_dy;
+	motor_dropped_dx = motor_dropped_dy = 0;
+	chSysUnlock();
+}
+
+int MotorHeld(void) {
+	return motor_hold_stopped || (motor_hold == MOTOR_HOLD && !motor_running);
+}
+
+int MotorGroupBusy(void) {
+	return motor_running;
+}
+
+void MotorGroupWait(void) {
+	MotorGroupFlush();
+	do {
+		MotorGroupWaitRunning();
+	} while( MotorQueueStart() );
+}
+
+void MotorGroupMakeSteps(const unsigned x_count, const unsigned y_count, int silent) {
+	MotorGroupStartSteps(x_count, y_count, silent);
+	MotorGroupWait();
 }
@@ -3,6 +3,7 @@
 
 #include <hal.h>
 #include "board.h"
+#include "segment.h"
 
 #define MOTOR_MICROSTEPPING s1_8
 #define MOTOR_TIMER (&GPTD1)
@@ -54,6 +55,111 @@ typedef struct MotorGroup {
 
 void MotorGroupMakeSteps(const unsigned x_count, const unsigned y_count, int silent);
 
+/*
+ * Split form of MotorGroupMakeSteps: the move runs from the timer while
+ * the caller prepares the next one, MotorGroupWait blocks until it is done.
+ */
+void MotorGroupStartSteps(const unsigned x_count, const unsigned y_count, int silent);
+int MotorGroupBusy(void);
+void MotorGroupWait(void);
+
+/*
+ * Coalescing stage in front of the timer. A queued move is held back and
+ * the next ones going on in the same direction with the same silent state
+ * are added to it, moves of length zero are dropped. The held move goes
+ * into the motion queue when the next move cannot be added, on
+ * MotorGroupFlush and on MotorGroupWait, split to the segment range.
+ * Runs to merge come from traces drawn in collinear pieces. The aperture
+ * fills give none: stroke hatches zig-zag and flash hatches turn at every
+ * line end. Of those it only drops the zero moves of the flash fills.
+ *
+ * The motion queue holds the moves as packed segments (segment.h). The
+ * step ISR takes the next one when the last full step of a move is made
+ * and goes on without stopping the timer, the timer is started when a
+ * move is queued while it stands. A full queue blocks the thread until
+ * the ISR takes a record. MotorGroupWait returns when the queue is empty
+ * and the head stands, everything that needs the head to stand still
+ * calls it: the gate and power settings, the start of another move.
+ */
+#ifndef MOTOR_QUEUE_LENGTH
+#define MOTOR_QUEUE_LENGTH 128 // records, a power of two
+#endif
+
+typedef struct MotorMergeStats {
+	unsigned queued;
+	unsigned merged;
+	unsigned dropped;
+	unsigned started; // moves the timer was started for, queued or not
+	unsigned chained; // queued moves the ISR went on to without stopping
+	unsigned stalls; // waits of the thread for room in the motion queue
+	unsigned held_high; // the most queued moves held back as one move
+} MotorMergeStats;
+
+extern MotorMergeStats motor_merge_stats;
+extern SegmentQueue motor_queue;
+
+void MotorGroupQueueSteps(int dx, int dy, int silent);
+void MotorGroupFlush(void);
+
+/*
+ * Laser state of the moves queued from now on, carried in their records:
+ * the ISR switches the output when it goes on to a move with the other
+ * state and after the last queued move, at once when the head stands.
+ * Gated and power table moves leave the output to their tables.
+ */
+void MotorQueueLaser(int enabled);
+
+/*
+ * Laser gate for the next X moves: the laser is toggled when the X full
+ * step with the given index (counted from the start of the move) begins,
+ * on at even entries and off at odd ones. NULL disables the gate.
+ */
+void MotorGateSet(const uint16_t* edges, unsigned count);
+
+/*
+ * Laser power for the next moves, one PWM width per full step streamed by
+ * DMA (LaserGrayStartI): widths[k] is on while step k is made, count + 1
+ * entries, the last one for the end of the move. NULL disables it.
+ */
+void MotorPowerSet(const uint8_t* widths, unsigned count);
+
+/*
+ * Feed hold. MotorHold stops the head where the next full step would
+ * begin, or before the next move starts when it stands, and the laser is
+ * off while it is held. A move under a power table is finished first. The
+ * thread starting a move waits while the motion is held, MotorResume
+ * restores the laser and goes on with the same step. MotorAbort stops the
+ * head at once and drops the queued and the held back moves, every move
+ * after it is dropped too until MotorResume.
+ */
+void MotorHold(void);
+void MotorResume(void);
+void MotorAbort(void);
+int MotorHeld(void); // stopped by the hold, not only requested
+/*
+ * What MotorAbort and the moves after it did not make, taken once. The
+ * head stands short of the position the moves were queued for by it.
+ */
+void MotorDropped(int* dx, int* dy);
+
+/*
+ * Full steps made by the ISR, running on. A move makes the steps of its
+ * longer axis, the moves queued up to a point are made when the count
+ * has grown by their sum.
+ */
+uint32_t MotorSteps(void);
+
+/*
+ * Feed override in percent of the step rate of the burning moves, the
+ * rapid moves keep theirs. The ISR takes the pause after a microstep from
+ * it, so it applies from the next step on to the move being made and to
+ * the queued ones, which hold no rates.
+ */
+void MotorFeedOverrideI(unsigned percent);
+unsigned MotorFeedOverride(void);
+// microseconds of a full step, at the feed override unless silent
+uint32_t MotorStepTime(int silent);
+
 extern MotorDriver DRV1;
 extern MotorDriver DRV2;
 
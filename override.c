@@ -0,0 +1,82 @@
+#include "override.h"
+#include "laser.h"
+#include "motor.h"
+
+#define OVERRIDE_SD SD3
+
+unsigned override_bytes;
+
+static uint8_t* override_scan = NULL; // the first byte not looked at
+static int override_raw;
+
+static unsigned OverrideClamp(int percent) {
+	return percent < OVERRIDE_MIN ? OVERRIDE_MIN : percent > OVERRIDE_MAX ? OVERRIDE_MAX : percent;
+}
+
+// acts on an override byte, returns 0 for a data byte
+static int OverrideTakeI(uint8_t b) {
+	static const int8_t steps[5] = { 0, 10, -10, 1, -1 };
+	if( b >= OVERRIDE_FEED_RESET && b <= OVERRIDE_FEED_DOWN_1 ) {
+		const int i = b - OVERRIDE_FEED_RESET;
+		MotorFeedOverrideI(i ? OverrideClamp(MotorFeedOverride() + steps[i]) : 100);
+	} else if( b >= OVERRIDE_POWER_RESET && b <= OVERRIDE_POWER_DOWN_1 ) {
+		const int i = b - OVERRIDE_POWER_RESET;
+		LaserPowerOverrideI(i ? OverrideClamp(LaserPowerOverride() + steps[i]) : 100);
+	} else {
+		return 0;
+	}
+	++override_bytes;
+	return 1;
+}
+
+static uint8_t* OverrideNext(input_queue_t* iqp, uint8_t* p) {
+	return ++p >= iqp->q_top ? iqp->q_buffer : p;
+}
+
+// takes the override bytes out of n queued bytes from, the data bytes close up
+static void OverrideScanI(uint8_t* from, unsigned n) {
+	input_queue_t* iqp = &OVERRIDE_SD.iqueue;
+	uint8_t* to = from;
+	for( ; n; --n, from = OverrideNext(iqp, from) ) {
+		if( OverrideTakeI(*from) ) {
+			--iqp->q_counter;
+			continue;
+		}
+		*to = *from;
+		to = OverrideNext(iqp, to);
+	}
+	iqp->q_wrptr = to;
+	override_scan = to;
+}
+
+void OverrideInit(void) {
+	chSysLock();
+	override_scan = OVERRIDE_SD.iqueue.q_wrptr;
+	chSysUnlock();
+}
+
+/*
+ * Runs at the end of every interrupt, the bytes put since the last one
+ * are the ones after override_scan. The receive interrupt puts one or
+ * two, never a whole queue.
+ */
+void OverrideServeI(void) {
+	input_queue_t* iqp = &OVERRIDE_SD.iqueue;
+	if( override_scan == iqp->q_wrptr || override_scan == NULL || override_raw ) {
+		return;
+	}
+	chSysLockFromISR();
+	const unsigned size = iqp->q_top - iqp->q_buffer;
+	OverrideScanI(override_scan, (iqp->q_wrptr - override_scan + size) % size);
+	chSysUnlockFromISR();
+}
+
+void OverrideRaw(int raw) {
+	chSysLock();
+	override_raw = raw;
+	if( !raw ) {
+		// whatever is queued came after the data that was read
+		OverrideScanI(OVERRIDE_SD.iqueue.q_rdptr, OVERRIDE_SD.iqueue.q_counter);
+	}
+	chSysUnlock();
+}
@@ -0,0 +1,41 @@
+#ifndef _OVERRIDE_H
+#define _OVERRIDE_H
+
+/*
+ * Real-time overrides on the shell serial line. The bytes below never
+ * appear in a command line, they are taken out of the input queue of the
+ * serial driver by the IRQ epilogue (chconf.h) right after the receive
+ * interrupt put them there, so they act while the shell or a job waits
+ * on a command and are not queued behind it. The feed override scales
+ * the step rate of the burning moves (motor.h), the power override the
+ * laser power (laser.h), both from OVERRIDE_MIN to OVERRIDE_MAX percent.
+ *
+ * The binary transfers of job and raster take every byte as data: a
+ * transfer turns the filter off before it asks for a chunk and on after
+ * reading it, the bytes received after the chunk are filtered then.
+ */
+
+#define OVERRIDE_FEED_RESET 0x90
+#define OVERRIDE_FEED_UP_10 0x91
+#define OVERRIDE_FEED_DOWN_10 0x92
+#define OVERRIDE_FEED_UP_1 0x93
+#define OVERRIDE_FEED_DOWN_1 0x94
+#define OVERRIDE_POWER_RESET 0x99
+#define OVERRIDE_POWER_UP_10 0x9A
+#define OVERRIDE_POWER_DOWN_10 0x9B
+#define OVERRIDE_POWER_UP_1 0x9C
+#define OVERRIDE_POWER_DOWN_1 0x9D
+
+#define OVERRIDE_MIN 10
+#define OVERRIDE_MAX 200
+
+extern unsigned override_bytes; // taken out of the input
+
+// starts the filter on the serial line of the shell, after sdStart
+void OverrideInit(void);
+// from CH_CFG_IRQ_EPILOGUE_HOOK
+void OverrideServeI(void);
+// while raw the bytes received are data
+void OverrideRaw(int raw);
+
+#endif // _OVERRIDE_H
@@ -0,0 +1,99 @@
+#include "perf.h"
+
+#if PERF_ENABLED
+
+PerfStats perf_stats;
+
+static uint32_t perf_update; // cycle count of the update event being served
+static uint32_t perf_period; // cycles from it to the next one
+static uint32_t perf_tick; // cycles per timer tick
+static int perf_anchored;
+
+static const char* const perf_stage_names[PERF_STAGES] = {
+	"full step", "silent full step", "microstep", "meander"
+};
+
+void PerfInit(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void PerfStartI(GPTDriver* gptp) {
+	perf_update = DWT->CYCCNT;
+	perf_tick = STM32_SYSCLK / gptp->config->frequency;
+	perf_period = gptGetIntervalX(gptp) * perf_tick;
+	perf_anchored = 1;
+}
+
+static void PerfCount(uint32_t* buckets, uint32_t* max, uint32_t cycles) {
+	const uint32_t scaled = cycles / PERF_BUCKET_MIN;
+	unsigned b = scaled ? 32 - __builtin_clz(scaled) : 0;
+	if( b >= PERF_BUCKETS ) {
+		b = PERF_BUCKETS - 1;
+	}
+	++buckets[b];
+	if( cycles > *max ) {
+		*max = cycles;
+	}
+}
+
+void PerfLeaveI(GPTDriver* gptp, uint32_t entry, unsigned stage) {
+	const uint32_t exit = DWT->CYCCNT;
+	PerfStats* st = &perf_stats;
+	const uint32_t time = exit - entry;
+	++st->interrupts;
+	PerfCount(st->time, &st->time_max, time);
+	PerfStage* s = &st->stages[stage];
+	++s->calls;
+	s->total += time;
+	if( time > s->max ) {
+		s->max = time;
+	}
+	if( perf_anchored ) {
+		perf_update += perf_period;
+		PerfCount(st->latency, &st->latency_max, entry - perf_update);
+	} else {
+		// after a missed deadline, the latency of this one is not known
+		perf_update = exit - gptGetCounterX(gptp) * perf_tick;
+		perf_anchored = 1;
+	}
+	// the interval set by the stage counts from the update being served
+	perf_period = gptGetIntervalX(gptp) * perf_tick;
+	if( exit - perf_update > perf_period ) {
+		++st->missed;
+		perf_anchored = 0;
+	}
+}
+
+void PerfReset(void) {
+	chSysLock();
+	memset(&perf_stats, 0, sizeof(perf_stats));
+	chSysUnlock();
+}
+
+static void PerfPrintBuckets(BaseSequentialStream* chp, const char* name, const uint32_t* buckets, uint32_t max) {
+	chprintf(chp, "%s: max %u,", name, (unsigned)max);
+	for( unsigned b = 0; b < PERF_BUCKETS - 1; ++b ) {
+		chprintf(chp, " <%u %u", PERF_BUCKET_MIN << b, (unsigned)buckets[b]);
+	}
+	chprintf(chp, " more %u\r\n", (unsigned)buckets[PERF_BUCKETS - 1]);
+}
+
+void PerfPrint(BaseSequentialStream* chp) {
+	PerfStats st;
+	chSysLock();
+	st = perf_stats;
+	chSysUnlock();
+	chprintf(chp, "step ISR: %u interrupts, %u missed deadlines, cycles at %u MHz\r\n",
+		(unsigned)st.interrupts, (unsigned)st.missed, (unsigned)(STM32_SYSCLK / 1000000));
+	PerfPrintBuckets(chp, "latency", st.latency, st.latency_max);
+	PerfPrintBuckets(chp, "time", st.time, st.time_max);
+	for( unsigned i = 0; i < PERF_STAGES; ++i ) {
+		const PerfStage* s = &st.stages[i];
+		chprintf(chp, "%s: %u calls, max %u, mean %u\r\n", perf_stage_names[i], (unsigned)s->calls,
+			(unsigned)s->max, s->calls ? (unsigned)(s->total / s->calls) : 0);
+	}
+}
+
+#endif
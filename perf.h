@@ -0,0 +1,77 @@
+#ifndef _PERF_H
+#define _PERF_H
+
+#include <stdint.h>
+
+/*
+ * Cycle counts of the step ISR (motor.c) from the DWT cycle counter:
+ * entry latency, execution time, missed deadlines and the longest run of
+ * each stage function, shown by the "perf" command.
+ *
+ * The latency is taken from the update event the timer raised, kept as a
+ * cycle count: the timer start sets it and every interrupt moves it on by
+ * the interval the stage before set, the timer runs from the core clock
+ * without preload. An interrupt that leaves after the next update event
+ * missed its deadline: a stage that sets an interval the counter is
+ * already past lets the timer run round. The count is taken up again from
+ * the timer counter then, to a timer tick.
+ *
+ * The host tools (host/sim.c) run the DWT counter from a cycle model of
+ * the HAL stand-ins, "simrun -p" prints the same report for a program.
+ * Built without it with PERF_ENABLED 0.
+ */
+
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 1
+#endif
+
+#define PERF_BUCKETS 8
+#define PERF_BUCKET_MIN 64 // cycles, the buckets double from here
+
+#define PERF_STAGE_FULL_STEP 0
+#define PERF_STAGE_FULL_STEP_SILENT 1
+#define PERF_STAGE_MICROSTEP 2
+#define PERF_STAGE_MEANDR 3
+#define PERF_STAGES 4
+
+typedef struct PerfStage {
+	uint32_t calls;
+	uint32_t max;
+	uint64_t total;
+} PerfStage;
+
+typedef struct PerfStats {
+	uint32_t interrupts;
+	uint32_t missed;
+	uint32_t latency_max;
+	uint32_t latency[PERF_BUCKETS];
+	uint32_t time_max;
+	uint32_t time[PERF_BUCKETS];
+	PerfStage stages[PERF_STAGES];
+} PerfStats;
+
+#if PERF_ENABLED
+
+extern PerfStats perf_stats;
+
+// starts the cycle counter, once
+void PerfInit(void);
+// after the step timer is started
+void PerfStartI(GPTDriver* gptp);
+#define PerfEnterI() (DWT->CYCCNT)
+void PerfLeaveI(GPTDriver* gptp, uint32_t entry, unsigned stage);
+void PerfReset(void);
+void PerfPrint(BaseSequentialStream* chp);
+
+#else
+
+#define PerfInit()
+#define PerfStartI(gptp)
+#define PerfEnterI() 0
+#define PerfLeaveI(gptp, entry, stage) ((void)(entry))
+#define PerfReset()
+#define PerfPrint(chp) chprintf(chp, "built without PERF_ENABLED\r\n")
+
+#endif
+
+#endif // _PERF_H
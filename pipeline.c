@@ -0,0 +1,262 @@
+#include "pipeline.h"
+#include "gerber.h"
+#include "laser.h"
+#include "motor.h"
+#include "checkpoint.h"
+
+typedef struct PipelineLine {
+	int argc;
+	char* argv[PIPELINE_ARGS_MAX];
+	char text[PIPELINE_LINE_MAX];
+} PipelineLine;
+
+// a pool block holds a pointer while it is free
+typedef union PipelineSegment {
+	Segment segment;
+	void* link;
+	uint32_t words[2];
+} PipelineSegment;
+
+// passed through both stages, the planner answers it when the moves are made
+#define PIPELINE_SYNC ((msg_t)0)
+
+PipelineStats pipeline_line_stats;
+PipelineStats pipeline_segment_stats;
+
+static PipelineLine pipeline_lines[PIPELINE_LINES];
+static guarded_memory_pool_t pipeline_line_pool;
+static msg_t pipeline_line_msgs[PIPELINE_LINES + 1];
+static MAILBOX_DECL(pipeline_line_mb, pipeline_line_msgs, PIPELINE_LINES + 1);
+
+static PipelineSegment pipeline_segments[PIPELINE_SEGMENTS];
+static guarded_memory_pool_t pipeline_segment_pool;
+static msg_t pipeline_segment_msgs[PIPELINE_SEGMENTS + 1];
+static MAILBOX_DECL(pipeline_segment_mb, pipeline_segment_msgs, PIPELINE_SEGMENTS + 1);
+
+static BSEMAPHORE_DECL(pipeline_synced, TRUE);
+
+static THD_WORKING_AREA(pipeline_interpreter_wa, PIPELINE_INTERPRETER_WA_SIZE);
+static THD_WORKING_AREA(pipeline_planner_wa, PIPELINE_PLANNER_WA_SIZE);
+
+static struct GerberContext* pipeline_ctx = NULL;
+static int pipeline_laser = 0;
+static Checkpoint pipeline_resume;
+static int pipeline_resume_dx, pipeline_resume_dy; // the rapid to the checkpoint
+static int pipeline_mismatch;
+static Preflight* pipeline_check = NULL;
+static Preflight pipeline_bounds; // of the moves so far, against the soft limits
+static int pipeline_outside;
+
+// a free block, waiting for one while the next stage is a pool behind
+static void* PipelineAlloc(guarded_memory_pool_t* pool, PipelineStats* st) {
+	void* block = chGuardedPoolAllocTimeout(pool, TIME_IMMEDIATE);
+	if( block == NULL ) {
+		++st->stalls;
+		block = chGuardedPoolAllocTimeout(pool, TIME_INFINITE);
+	}
+	return block;
+}
+
+// the mailboxes have room for every block and the sync
+static void PipelinePost(mailbox_t* mb, PipelineStats* st, msg_t msg) {
+	chMBPost(mb, msg, TIME_INFINITE);
+	chSysLock();
+	const unsigned waiting = chMBGetUsedCountI(mb);
+	chSysUnlock();
+	++st->items;
+	if( waiting > st->high ) {
+		st->high = waiting;
+	}
+}
+
+static msg_t PipelineFetch(mailbox_t* mb, PipelineStats* st) {
+	msg_t msg;
+	if( chMBFetch(mb, &msg, TIME_IMMEDIATE) != MSG_OK ) {
+		++st->starved;
+		chMBFetch(mb, &msg, TIME_INFINITE);
+	}
+	return msg;
+}
+
+// matches SegmentSink
+static void PipelinePostSegment(void* arg, const Segment* s) {
+	(void)arg;
+	PipelineSegment* block = (PipelineSegment*)PipelineAlloc(&pipeline_segment_pool, &pipeline_segment_stats);
+	block->segment = *s;
+	PipelinePost(&pipeline_segment_mb, &pipeline_segment_stats, (msg_t)block);
+}
+
+// matches SegmentSink, runs in the interpreter
+static void PipelineSink(void* arg, const Segment* s) {
+	BaseSequentialStream* chp = (BaseSequentialStream*)&SD3;
+	if( pipeline_check ) {
+		PreflightSegment(pipeline_check, s);
+		return;
+	}
+	if( pipeline_outside ) {
+		return;
+	}
+	PreflightSegment(&pipeline_bounds, s);
+	if( !PreflightInside(pipeline_bounds.x0 + pipeline_bounds.x, pipeline_bounds.y0 + pipeline_bounds.y) ) {
+		pipeline_outside = 1;
+		MotorAbort();
+		chprintf(chp, "the job leaves the soft limits at %d,%d, its moves are dropped\r\n",
+			pipeline_bounds.x0 + pipeline_bounds.x, pipeline_bounds.y0 + pipeline_bounds.y);
+		return;
+	}
+	switch( CheckpointSegment(s) ) {
+	case CHECKPOINT_SKIP:
+		return;
+	case CHECKPOINT_MISMATCH:
+		if( !pipeline_mismatch ) {
+			pipeline_mismatch = 1;
+			chprintf(chp, "the job does not match its checkpoint, its moves are dropped\r\n");
+		}
+		return;
+	case CHECKPOINT_RESUME:
+		// from where the head stood at gerber_start, with the laser off
+		SegmentSplit(pipeline_resume_dx, pipeline_resume_dy, SEGMENT_RAPID, PipelinePostSegment, NULL);
+		CheckpointMoved(pipeline_resume_dx, pipeline_resume_dy);
+		chprintf(chp, "resumed at line %u\r\n", (unsigned)pipeline_resume.line);
+		break;
+	}
+	PipelinePostSegment(arg, s);
+}
+
+// matches CheckpointState
+static void PipelineCheckpointState(Checkpoint* c) {
+	const GerberContext* ctx = pipeline_ctx;
+	c->line = ctx->line_counter;
+	c->aperture = ctx->current_aperture ? ctx->current_aperture->code : 0;
+	c->modal = (ctx->is_mm ? CHECKPOINT_MM : 0) | (ctx->is_absolute_coords ? CHECKPOINT_ABSOLUTE : 0) |
+		(ctx->is_linear_interpolation ? CHECKPOINT_LINEAR : 0) | (ctx->is_clockwise ? CHECKPOINT_CLOCKWISE : 0) |
+		CHECKPOINT_QUADRANT(ctx->is_single_quadrant & 3);
+}
+
+static THD_FUNCTION(PipelineInterpreter, arg) {
+	(void)arg;
+	chRegSetThreadName("interpreter");
+	while( true ) {
+		const msg_t msg = PipelineFetch(&pipeline_line_mb, &pipeline_line_stats);
+		if( msg == PIPELINE_SYNC ) {
+			chMBPost(&pipeline_segment_mb, PIPELINE_SYNC, TIME_INFINITE);
+			continue;
+		}
+		PipelineLine* line = (PipelineLine*)msg;
+		GerberAcceptCommand(pipeline_ctx, line->argc, line->argv);
+		chGuardedPoolFree(&pipeline_line_pool, line);
+	}
+}
+
+static THD_FUNCTION(PipelinePlanner, arg) {
+	(void)arg;
+	chRegSetThreadName("planner");
+	while( true ) {
+		msg_t msg;
+		if( chMBFetch(&pipeline_segment_mb, &msg, TIME_IMMEDIATE) != MSG_OK ) {
+			++pipeline_segment_stats.starved;
+			// the move held back is made while the interpreter works
+			MotorGroupFlush();
+			chMBFetch(&pipeline_segment_mb, &msg, TIME_INFINITE);
+		}
+		if( msg == PIPELINE_SYNC ) {
+			// a laser switch without a move after it
+			if( !pipeline_check && pipeline_laser != LaserEnabled() ) {
+				pipeline_laser = LaserEnabled();
+				LaserOutput(pipeline_laser);
+			}
+			MotorGroupWait();
+			chBSemSignal(&pipeline_synced);
+			continue;
+		}
+		PipelineSegment* block = (PipelineSegment*)msg;
+		const Segment s = block->segment;
+		chGuardedPoolFree(&pipeline_segment_pool, block);
+		const int laser = (s.flags & SEGMENT_LASER) ? 1 : 0;
+		if( laser != pipeline_laser ) {
+			LaserOutput(laser);
+			pipeline_laser = laser;
+		}
+		MotorGroupQueueSteps(s.dx, s.dy, (s.flags & SEGMENT_RAPID) ? 1 : 0);
+	}
+}
+
+void PipelineInit(void) {
+	chGuardedPoolObjectInit(&pipeline_line_pool, sizeof(PipelineLine));
+	chGuardedPoolLoadArray(&pipeline_line_pool, pipeline_lines, PIPELINE_LINES);
+	chGuardedPoolObjectInit(&pipeline_segment_pool, sizeof(PipelineSegment));
+	chGuardedPoolLoadArray(&pipeline_segment_pool, pipeline_segments, PIPELINE_SEGMENTS);
+	chThdCreateStatic(pipeline_planner_wa, sizeof(pipeline_planner_wa), NORMALPRIO + 2, PipelinePlanner, NULL);
+	chThdCreateStatic(pipeline_interpreter_wa, sizeof(pipeline_interpreter_wa), NORMALPRIO, PipelineInterpreter, NULL);
+}
+
+void PipelineStart(struct GerberContext* ctx, const Checkpoint* resume, Preflight* check) {
+	memset(&pipeline_line_stats, 0, sizeof(pipeline_line_stats));
+	memset(&pipeline_segment_stats, 0, sizeof(pipeline_segment_stats));
+	pipeline_ctx = ctx;
+	pipeline_laser = 0;
+	pipeline_mismatch = 0;
+	pipeline_outside = 0;
+	pipeline_check = check;
+	if( !check ) {
+		CheckpointStart(CHECKPOINT_GERBER, PipelineCheckpointState, resume);
+	}
+	if( resume ) {
+		pipeline_resume = *resume;
+		/*
+		 * The lines are interpreted from the job origin, the moves before
+		 * the checkpoint are not made: the head stands where it is up to
+		 * the rapid to the checkpoint.
+		 */
+		int x, y;
+		CheckpointOrigin(&x, &y);
+		pipeline_resume_dx = x + resume->x - CUR_X;
+		pipeline_resume_dy = y + resume->y - CUR_Y;
+		CUR_X = x;
+		CUR_Y = y;
+	}
+	PreflightReset(&pipeline_bounds, CUR_X, CUR_Y);
+	SegmentSinkSet(PipelineSink, NULL);
+}
+
+void PipelineSubmit(int argc, char* argv[]) {
+	PipelineLine* line = (PipelineLine*)PipelineAlloc(&pipeline_line_pool, &pipeline_line_stats);
+	char* text = line->text;
+	size_t left = sizeof(line->text);
+	line->argc = 0;
+	for( int i = 0; i < argc && i < PIPELINE_ARGS_MAX; ++i ) {
+		const size_t size = strlen(argv[i]) + 1;
+		if( size > left ) {
+			break;
+		}
+		memcpy(text, argv[i], size);
+		line->argv[line->argc++] = text;
+		text += size;
+		left -= size;
+	}
+	PipelinePost(&pipeline_line_mb, &pipeline_line_stats, (msg_t)line);
+}
+
+void PipelineStop(void) {
+	chMBPost(&pipeline_line_mb, PIPELINE_SYNC, TIME_INFINITE);
+	chBSemWait(&pipeline_synced);
+	if( !pipeline_check ) {
+		CheckpointStop();
+	}
+	// the interpreter waits for the next line, the sink is not in use
+	SegmentSinkSet(NULL, NULL);
+	pipeline_ctx = NULL;
+	pipeline_check = NULL;
+}
+
+static void PipelinePrintStage(BaseSequentialStream* chp, const char* name, const PipelineStats* st, unsigned size) {
+	chprintf(chp, "%s: %u passed, high-water %u of %u, %u stalls, %u starved\r\n",
+		name, st->items, st->high, size, st->stalls, st->starved);
+}
+
+void PipelinePrintStats(BaseSequentialStream* chp) {
+	PipelinePrintStage(chp, "lines", &pipeline_line_stats, PIPELINE_LINES);
+	PipelinePrintStage(chp, "segments", &pipeline_segment_stats, PIPELINE_SEGMENTS);
+	chprintf(chp, "motion: high-water %u of %u records, %u stalls, %u restarts\r\n",
+		motor_queue.high, MOTOR_QUEUE_LENGTH, motor_merge_stats.stalls, motor_merge_stats.started);
+}
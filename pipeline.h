@@ -0,0 +1,59 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "segment.h"
+#include "checkpoint.h"
+#include "preflight.h"
+
+/*
+ * Gerber pipeline. The shell thread receives and frames the lines of a job
+ * (cmd_gerber), the interpreter thread parses them and makes the fills,
+ * the planner thread feeds the moves into the motion queue (motor.h).
+ * Lines go from the shell to the interpreter and segments from the
+ * interpreter to the planner, in blocks of a fixed pool passed through a
+ * mailbox, so a stage waits when the next one is a whole pool behind. The
+ * interpreter runs with a segment sink (segment.h) that posts its moves
+ * with the laser state to the planner, through the checkpoint counting
+ * (checkpoint.h). A move that would leave the soft limits (preflight.h)
+ * stops the motion and the rest of the job is dropped.
+ *
+ * The planner runs above the shell and the shell above the interpreter:
+ * the motion queue is fed first and the lines are taken from the serial
+ * driver while the fills are made.
+ */
+
+#define PIPELINE_LINES 4
+#define PIPELINE_LINE_MAX 64 // SHELL_MAX_LINE_LENGTH
+#define PIPELINE_ARGS_MAX 4
+#define PIPELINE_SEGMENTS 32
+#define PIPELINE_INTERPRETER_WA_SIZE 2048
+#define PIPELINE_PLANNER_WA_SIZE 512
+
+// of the mailbox in front of a stage
+typedef struct PipelineStats {
+	unsigned items;
+	unsigned high; // the most items waiting
+	unsigned stalls; // waits of the stage before for a free block
+	unsigned starved; // waits of the stage for an item
+} PipelineStats;
+
+extern PipelineStats pipeline_line_stats;
+extern PipelineStats pipeline_segment_stats;
+
+struct GerberContext;
+
+// creates the threads, once
+void PipelineInit(void);
+/*
+ * The lines submitted from now on are interpreted in ctx. The segments
+ * are counted for checkpoints, with resume the ones before it are skipped.
+ * With check they are only measured into it, nothing moves.
+ */
+void PipelineStart(struct GerberContext* ctx, const Checkpoint* resume, Preflight* check);
+// queues a command line for the interpreter, the arguments are copied
+void PipelineSubmit(int argc, char* argv[]);
+// returns when the lines submitted are interpreted and their moves made
+void PipelineStop(void);
+void PipelinePrintStats(BaseSequentialStream* chp);
+
+#endif // _PIPELINE_H
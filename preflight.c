@@ -0,0 +1,87 @@
+#include "preflight.h"
+#include "motor.h"
+
+PreflightBox preflight_limits = PREFLIGHT_LIMITS;
+
+static void PreflightBoxAdd(PreflightBox* b, int x, int y) {
+	if( b->empty ) {
+		b->xmin = b->xmax = x;
+		b->ymin = b->ymax = y;
+		b->empty = 0;
+		return;
+	}
+	if( x < b->xmin ) {
+		b->xmin = x;
+	} else if( x > b->xmax ) {
+		b->xmax = x;
+	}
+	if( y < b->ymin ) {
+		b->ymin = y;
+	} else if( y > b->ymax ) {
+		b->ymax = y;
+	}
+}
+
+void PreflightReset(Preflight* p, int x0, int y0) {
+	memset(p, 0, sizeof(*p));
+	p->x0 = x0;
+	p->y0 = y0;
+	p->burn.empty = 1;
+	p->travel.empty = 1;
+	PreflightBoxAdd(&p->travel, 0, 0);
+}
+
+void PreflightSegment(void* arg, const Segment* s) {
+	Preflight* p = (Preflight*)arg;
+	const uint32_t steps = abs(s->dx) > abs(s->dy) ? abs(s->dx) : abs(s->dy);
+	if( s->flags & SEGMENT_LASER ) {
+		// a segment is straight, its ends bound it
+		PreflightBoxAdd(&p->burn, p->x, p->y);
+		PreflightBoxAdd(&p->burn, p->x + s->dx, p->y + s->dy);
+		p->burn_steps += steps;
+	} else if( s->flags & SEGMENT_RAPID ) {
+		p->rapid_steps += steps;
+	} else {
+		p->move_steps += steps;
+	}
+	p->x += s->dx;
+	p->y += s->dy;
+	PreflightBoxAdd(&p->travel, p->x, p->y);
+	++p->segments;
+}
+
+uint32_t PreflightTime(const Preflight* p) {
+	const uint64_t us = (uint64_t)(p->burn_steps + p->move_steps) * MotorStepTime(0) +
+		(uint64_t)p->rapid_steps * MotorStepTime(1);
+	return (uint32_t)(us / 1000);
+}
+
+int PreflightInside(int x, int y) {
+	const PreflightBox* l = &preflight_limits;
+	return l->empty || (x >= l->xmin && x <= l->xmax && y >= l->ymin && y <= l->ymax);
+}
+
+int PreflightFits(const Preflight* p) {
+	const PreflightBox* b = &p->travel;
+	return PreflightInside(p->x0 + b->xmin, p->y0 + b->ymin) && PreflightInside(p->x0 + b->xmax, p->y0 + b->ymax);
+}
+
+void PreflightPrint(BaseSequentialStream* chp, const Preflight* p) {
+	const uint32_t ms = PreflightTime(p);
+	chprintf(chp, "%u segments, burn %u steps, travel %u steps, estimated %u.%u s\r\n",
+		p->segments, (unsigned)p->burn_steps, (unsigned)(p->move_steps + p->rapid_steps),
+		(unsigned)(ms / 1000), (unsigned)(ms % 1000 / 100));
+	const PreflightBox* t = &p->travel;
+	chprintf(chp, "travel: x %d..%d, y %d..%d\r\n", p->x0 + t->xmin, p->x0 + t->xmax, p->y0 + t->ymin, p->y0 + t->ymax);
+	const PreflightBox* b = &p->burn;
+	if( b->empty ) {
+		chprintf(chp, "burn: none\r\n");
+	} else {
+		chprintf(chp, "burn: x %d..%d, y %d..%d, %d x %d steps\r\n",
+			p->x0 + b->xmin, p->x0 + b->xmax, p->y0 + b->ymin, p->y0 + b->ymax, b->xmax - b->xmin, b->ymax - b->ymin);
+	}
+	if( !PreflightFits(p) ) {
+		const PreflightBox* l = &preflight_limits;
+		chprintf(chp, "outside the soft limits x %d..%d, y %d..%d\r\n", l->xmin, l->xmax, l->ymin, l->ymax);
+	}
+}
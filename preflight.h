@@ -0,0 +1,57 @@
+#ifndef _PREFLIGHT_H
+#define _PREFLIGHT_H
+
+#include <stdint.h>
+#include "segment.h"
+
+/*
+ * Pre-flight pass: a job is measured from its segments without moving,
+ * a cached job (job.h) from the flash and a Gerber job sent from
+ * "gerber_start check" through the interpreter (pipeline.h). It gives the
+ * bounds of the travel and of the burning moves, the segment and step
+ * counts and the machine time at the current feed override. A job whose
+ * travel leaves the soft limits is refused before it starts, "frame"
+ * traces the bounds of its burning moves with rapids to check where it
+ * lands on the board.
+ *
+ * Positions are in steps from where the job starts, the soft limits are
+ * in the frame of CUR_X and CUR_Y (gerber.h).
+ */
+
+typedef struct PreflightBox {
+	int xmin, ymin, xmax, ymax;
+	int empty;
+} PreflightBox;
+
+// the soft limits at power on, off unless the board sets them
+#ifndef PREFLIGHT_LIMITS
+#define PREFLIGHT_LIMITS { 0, 0, 0, 0, 1 }
+#endif
+
+// set by the "limits" command, off while empty
+extern PreflightBox preflight_limits;
+
+typedef struct Preflight {
+	int x0, y0; // where the job starts, in the frame of the limits
+	int x, y; // from there, after the segments so far
+	PreflightBox travel; // every position the head passes
+	PreflightBox burn; // of the burning moves
+	unsigned segments;
+	// full steps of the longer axis
+	uint32_t burn_steps;
+	uint32_t move_steps; // laser off at the feed rate
+	uint32_t rapid_steps;
+} Preflight;
+
+void PreflightReset(Preflight* p, int x0, int y0);
+// matches SegmentSink
+void PreflightSegment(void* arg, const Segment* s);
+// milliseconds of motion at the current feed override
+uint32_t PreflightTime(const Preflight* p);
+// whether a position is inside the soft limits
+int PreflightInside(int x, int y);
+// whether the travel stays inside them
+int PreflightFits(const Preflight* p);
+void PreflightPrint(BaseSequentialStream* chp, const Preflight* p);
+
+#endif // _PREFLIGHT_H
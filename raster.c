@@ -0,0 +1,329 @@
+
+#include "raster.h"
+#include "motor.h"
+#include "gerber.h"
+#include "laser.h"
+#include "override.h"
+
+RasterStats raster_stats;
+
+void RasterEncodeRowHeader(const RasterRow* row, uint8_t* out) {
+	out[0] = (uint16_t)row->y & 0xFF;
+	out[1] = (uint16_t)row->y >> 8;
+	out[2] = (uint16_t)row->x & 0xFF;
+	out[3] = (uint16_t)row->x >> 8;
+	out[4] = row->length & 0xFF;
+	out[5] = row->length >> 8;
+	out[6] = row->flags;
+	out[7] = row->size & 0xFF;
+	out[8] = row->size >> 8;
+}
+
+void RasterDecodeRowHeader(const uint8_t* in, RasterRow* row) {
+	row->y = (int16_t)(in[0] | (in[1] << 8));
+	row->x = (int16_t)(in[2] | (in[3] << 8));
+	row->length = in[4] | (in[5] << 8);
+	row->flags = in[6];
+	row->size = in[7] | (in[8] << 8);
+}
+
+static void RasterRowRange(const RasterRow* row, int* lo, int* hi) {
+	if( row->flags & RASTER_ROW_REVERSE ) {
+		*lo = row->x - row->length;
+		*hi = row->x;
+	} else {
+		*lo = row->x;
+		*hi = row->x + row->length;
+	}
+}
+
+unsigned RasterClipSpans(const int16_t* spans, unsigned count, int lo, int hi, int16_t* out, unsigned max) {
+	unsigned i = 0, n = 0;
+	int on = 0;
+	while( i < count && spans[i] <= lo ) {
+		on = !on;
+		++i;
+	}
+	if( on ) {
+		out[n++] = lo;
+	}
+	for( ; i < count && spans[i] < hi; ++i ) {
+		if( n == max ) {
+			return max + 1;
+		}
+		out[n++] = spans[i];
+	}
+	return n;
+}
+
+unsigned RasterXorSpans(const int16_t* a, unsigned na, const int16_t* b, unsigned nb, int16_t* out, unsigned max) {
+	unsigned i = 0, j = 0, n = 0;
+	while( i < na || j < nb ) {
+		int16_t v;
+		if( j == nb || (i < na && a[i] < b[j]) ) {
+			v = a[i++];
+		} else if( i == na || b[j] < a[i] ) {
+			v = b[j++];
+		} else {
+			// toggles on both sides cancel
+			++i;
+			++j;
+			continue;
+		}
+		if( n == max ) {
+			return max + 1;
+		}
+		out[n++] = v;
+	}
+	return n;
+}
+
+static unsigned RasterPutVarint(uint8_t* out, unsigned value) {
+	unsigned n = 0;
+	while( value >= 0x80 ) {
+		out[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[n++] = value;
+	return n;
+}
+
+// 0 when the payload ends inside the value or it is too long
+static int RasterGetVarint(const uint8_t* in, unsigned size, unsigned* at, unsigned* value) {
+	unsigned shift = 0;
+	*value = 0;
+	do {
+		if( *at == size || shift > 14 ) {
+			return 0;
+		}
+		*value |= (in[*at] & 0x7F) << shift;
+		shift += 7;
+	} while( in[(*at)++] & 0x80 );
+	return 1;
+}
+
+unsigned RasterEncodeRuns(const int16_t* spans, unsigned count, int lo, int hi, uint8_t* out) {
+	unsigned n = 0;
+	int x = lo;
+	for( unsigned i = 0; i <= count; ++i ) {
+		const int end = i < count ? spans[i] : hi;
+		n += RasterPutVarint(out + n, end - x);
+		x = end;
+	}
+	return n;
+}
+
+unsigned RasterEncodeGray(const uint8_t* levels, unsigned count, uint8_t* out) {
+	unsigned n = 0;
+	for( unsigned i = 0; i < count; ) {
+		unsigned run = 1;
+		while( i + run < count && levels[i + run] == levels[i] ) {
+			++run;
+		}
+		if( run >= 3 || i + run == count ) {
+			n += RasterPutVarint(out + n, run << 1);
+			out[n++] = levels[i];
+			i += run;
+			continue;
+		}
+		// literal up to the next run of three
+		unsigned end = i + run;
+		while( end < count && !(end + 2 < count && levels[end] == levels[end + 1] && levels[end] == levels[end + 2]) ) {
+			++end;
+		}
+		n += RasterPutVarint(out + n, ((end - i) << 1) | 1);
+		memcpy(out + n, levels + i, end - i);
+		n += end - i;
+		i = end;
+	}
+	return n;
+}
+
+static int RasterDecodeGray(RasterRow* row, const uint8_t* payload, int lo, int hi) {
+	if( row->length > RASTER_GRAY_MAX ) {
+		return 0;
+	}
+	const int reverse = row->flags & RASTER_ROW_REVERSE;
+	unsigned at = 0;
+	int x = lo;
+	while( at < row->size ) {
+		unsigned packet;
+		if( !RasterGetVarint(payload, row->size, &at, &packet) ) {
+			return 0;
+		}
+		const int literal = packet & 1;
+		const unsigned count = packet >> 1;
+		if( x + (int)count > hi || at + (literal ? count : 1) > row->size ) {
+			return 0;
+		}
+		for( const int end = x + count; x < end; ++x ) {
+			const uint8_t width = laser_gray_table[payload[literal ? at++ : at]];
+			row->widths[reverse ? hi - 1 - x : x - lo] = width;
+		}
+		at += literal ? 0 : 1;
+	}
+	row->widths[row->length] = 0; // off when the row ends
+	return x == hi;
+}
+
+int RasterDecodeRow(RasterRow* row, const uint8_t* payload, const RasterRow* prev) {
+	static int16_t runs[RASTER_EDGES_MAX], base[RASTER_EDGES_MAX];
+	int lo, hi;
+	RasterRowRange(row, &lo, &hi);
+
+	if( row->flags & RASTER_ROW_GRAY ) {
+		return RasterDecodeGray(row, payload, lo, hi);
+	}
+
+	unsigned count = 0, at = 0;
+	int x = lo;
+	while( at < row->size ) {
+		unsigned run;
+		if( !RasterGetVarint(payload, row->size, &at, &run) ) {
+			return 0;
+		}
+		x += run;
+		if( x > hi ) {
+			return 0;
+		}
+		if( x < hi ) {
+			if( count == RASTER_EDGES_MAX ) {
+				return 0;
+			}
+			runs[count++] = x;
+		}
+	}
+	if( x != hi ) {
+		return 0;
+	}
+
+	if( row->flags & RASTER_ROW_XOR ) {
+		if( prev == NULL || (prev->flags & RASTER_ROW_GRAY) ) {
+			return 0;
+		}
+		const unsigned n = RasterClipSpans(prev->spans, prev->spans_count, lo, hi, base, RASTER_EDGES_MAX);
+		if( n > RASTER_EDGES_MAX ) {
+			return 0;
+		}
+		count = RasterXorSpans(base, n, runs, count, row->spans, RASTER_EDGES_MAX);
+		if( count > RASTER_EDGES_MAX ) {
+			return 0;
+		}
+	} else {
+		memcpy(row->spans, runs, count * sizeof(runs[0]));
+	}
+	row->spans_count = count;
+
+	// gate edges in the row direction
+	unsigned n = 0;
+	if( row->flags & RASTER_ROW_REVERSE ) {
+		if( count & 1 ) {
+			row->edges[n++] = 0; // on at the start of the row
+		}
+		for( unsigned i = count; i-- > 0; ) {
+			const unsigned e = hi - row->spans[i];
+			if( e < row->length ) {
+				if( n == RASTER_EDGES_MAX ) {
+					return 0;
+				}
+				row->edges[n++] = e;
+			}
+		}
+	} else {
+		for( unsigned i = 0; i < count; ++i ) {
+			row->edges[n++] = row->spans[i] - lo;
+		}
+	}
+	row->edges_count = n;
+	return 1;
+}
+
+void RasterStartRow(const RasterRow* row) {
+	MoveTo(row->x, row->y, 1);
+	if( row->flags & RASTER_ROW_GRAY ) {
+		MotorPowerSet(row->widths, row->length);
+	} else {
+		MotorGateSet(row->edges, row->edges_count);
+	}
+	MoveToRelativeStart((row->flags & RASTER_ROW_REVERSE) ? -row->length : row->length, 0, 0);
+}
+
+void RasterFinishRow(const RasterRow* row) {
+	MotorGroupWait();
+	if( row->flags & RASTER_ROW_GRAY ) {
+		MotorPowerSet(NULL, 0);
+		LaserGrayStop();
+	} else {
+		MotorGateSet(NULL, 0);
+		LaserDisable();
+	}
+}
+
+static int RasterReadRow(BaseSequentialStream* chp, RasterRow* row, const RasterRow* prev) {
+	static uint8_t buf[RASTER_PAYLOAD_MAX];
+
+	chprintf(chp, "> row\r\n");
+	if( streamRead(chp, buf, RASTER_ROW_HEADER_SIZE) != RASTER_ROW_HEADER_SIZE ) {
+		chprintf(chp, "raster transfer failed\r\n");
+		return 0;
+	}
+	RasterDecodeRowHeader(buf, row);
+	if( row->size > RASTER_PAYLOAD_MAX ) {
+		chprintf(chp, "raster row is too long: %u bytes\r\n", row->size);
+		return 0;
+	}
+	if( streamRead(chp, buf, row->size) != row->size ) {
+		chprintf(chp, "raster transfer failed\r\n");
+		return 0;
+	}
+	if( !RasterDecodeRow(row, buf, prev) ) {
+		chprintf(chp, "raster row is malformed\r\n");
+		return 0;
+	}
+	++raster_stats.rows;
+	raster_stats.xor_rows += (row->flags & RASTER_ROW_XOR) ? 1 : 0;
+	raster_stats.gray_rows += (row->flags & RASTER_ROW_GRAY) ? 1 : 0;
+	raster_stats.payload_bytes += RASTER_ROW_HEADER_SIZE + row->size;
+	raster_stats.pixel_bytes += RASTER_ROW_HEADER_SIZE +
+		((row->flags & RASTER_ROW_GRAY) ? row->length : (row->length + 7) / 8);
+	return 1;
+}
+
+void RasterReceive(BaseSequentialStream* chp, unsigned rows) {
+	// one row is engraved by the step ISR while the next one is read
+	static RasterRow buffers[2];
+	const RasterRow* current = NULL;
+
+	memset(&raster_stats, 0, sizeof(raster_stats));
+	for( unsigned i = 0; i < rows; ++i ) {
+		RasterRow* next = &buffers[i & 1];
+		// the row record is binary (override.h)
+		OverrideRaw(1);
+		const int ok = RasterReadRow(chp, next, current);
+		OverrideRaw(0);
+		if( current ) {
+			if( !MotorGroupBusy() ) {
+				++raster_stats.underruns;
+			}
+			RasterFinishRow(current);
+		}
+		if( !ok ) {
+			current = NULL;
+			break;
+		}
+		RasterStartRow(next);
+		current = next;
+	}
+	if( current ) {
+		RasterFinishRow(current);
+	}
+	chprintf(chp, "raster done\r\n");
+}
+
+void RasterPrintStats(BaseSequentialStream* chp) {
+	const RasterStats* st = &raster_stats;
+	const unsigned long ratio = st->payload_bytes ? st->pixel_bytes * 100 / st->payload_bytes : 0;
+	chprintf(chp, "rows %u (xor %u, gray %u), underruns %u\r\n", st->rows, st->xor_rows, st->gray_rows, st->underruns);
+	chprintf(chp, "bytes %lu, as bitmap %lu, ratio %lu.%02lu\r\n",
+		st->payload_bytes, st->pixel_bytes, ratio / 100, ratio % 100);
+}
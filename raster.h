@@ -0,0 +1,96 @@
+#ifndef _RASTER_H
+#define _RASTER_H
+
+#include <stdint.h>
+
+/*
+ * Raster engraving: the layer is rendered on the host (host/gbrc -R) into
+ * a bitmap at the step pitch and sent row by row. A row is one X move
+ * with the laser gated per pixel by the step engine (MotorGateSet).
+ *
+ * Pixel k of a row is burned while the head travels from step k to step
+ * k + 1 in the row direction, so rows run in both directions burn the
+ * same cells.
+ *
+ * Row wire format (little endian): y int16, x int16 (start position),
+ * length uint16 (steps), flags uint8, payload size uint16, then the
+ * payload: run lengths as 7 bit varints over the row pixels in +X order,
+ * alternately off and on starting with off. A RASTER_ROW_XOR row is
+ * XORed with the pixels of the previous row, so a row repeating its
+ * neighbour costs a couple of bytes.
+ *
+ * A RASTER_ROW_GRAY row carries gray levels instead (host/grayc), in +X
+ * order, as packets of a varint n * 2 followed by one level repeated n
+ * times, or n * 2 + 1 followed by n literal levels. The levels go
+ * through the power curve (LaserGrayCurve) into PWM widths that DMA
+ * puts on the laser output step by step (MotorPowerSet).
+ *
+ * Serial protocol: "raster <rows>", the machine answers "> row" when it
+ * is ready for the next row record, "raster done" at the end. A row is
+ * requested and decoded while the previous one is being engraved;
+ * "raster stat" reports the compression and underruns of the last run.
+ */
+
+#define RASTER_MAGIC "GRAS"
+#define RASTER_HEADER_SIZE 8
+#define RASTER_ROW_HEADER_SIZE 9
+#define RASTER_EDGES_MAX 128
+#define RASTER_PAYLOAD_MAX (3 * (RASTER_EDGES_MAX + 1))
+#define RASTER_GRAY_MAX 511 // pixels of a gray row
+
+#define RASTER_ROW_REVERSE 0x01 // row runs towards -X
+#define RASTER_ROW_XOR 0x02 // payload is the difference to the previous row
+#define RASTER_ROW_GRAY 0x04 // payload is gray level runs
+
+typedef struct RasterRow {
+	int16_t y;
+	int16_t x;
+	uint16_t length;
+	uint8_t flags;
+	uint16_t size; // payload bytes
+	union {
+		struct {
+			uint8_t edges_count;
+			uint16_t edges[RASTER_EDGES_MAX]; // gate edges, pixel indexes in the row direction
+			uint8_t spans_count;
+			int16_t spans[RASTER_EDGES_MAX]; // X where the pixels toggle, ascending
+		};
+		uint8_t widths[RASTER_GRAY_MAX + 1]; // gray rows, PWM width per pixel in the row direction
+	};
+} RasterRow;
+
+typedef struct RasterStats {
+	unsigned rows;
+	unsigned xor_rows;
+	unsigned gray_rows;
+	unsigned underruns; // rows finished before the next one was decoded
+	unsigned long payload_bytes;
+	unsigned long pixel_bytes; // the same rows at one bit (gray: byte) per pixel
+} RasterStats;
+
+extern RasterStats raster_stats;
+
+void RasterEncodeRowHeader(const RasterRow* row, uint8_t* out);
+void RasterDecodeRowHeader(const uint8_t* in, RasterRow* row);
+
+/*
+ * Span lists hold the X positions where the pixels toggle, ascending,
+ * starting with off. Clip keeps the part inside [lo, hi), Xor merges two
+ * lists cancelling common positions; both return more than max when the
+ * result does not fit.
+ */
+unsigned RasterClipSpans(const int16_t* spans, unsigned count, int lo, int hi, int16_t* out, unsigned max);
+unsigned RasterXorSpans(const int16_t* a, unsigned na, const int16_t* b, unsigned nb, int16_t* out, unsigned max);
+unsigned RasterEncodeRuns(const int16_t* spans, unsigned count, int lo, int hi, uint8_t* out);
+// gray levels of count pixels, in +X order, into gray packets
+unsigned RasterEncodeGray(const uint8_t* levels, unsigned count, uint8_t* out);
+
+// fills spans and edges of a row from its payload, 0 if it is malformed
+int RasterDecodeRow(RasterRow* row, const uint8_t* payload, const RasterRow* prev);
+
+void RasterStartRow(const RasterRow* row);
+void RasterFinishRow(const RasterRow* row);
+void RasterReceive(BaseSequentialStream* chp, unsigned rows);
+void RasterPrintStats(BaseSequentialStream* chp);
+
+#endif // _RASTER_H
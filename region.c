@@ -0,0 +1,293 @@
+
+#include "region.h"
+#include "gerber.h"
+#include "laser.h"
+
+#define REGION_MARK INT16_MIN // vertex slot starting a contour
+#define REGION_COORD_MAX 16383 // keeps the crossing arithmetic in 32 bits
+
+typedef struct RegionEdge {
+	int16_t x0, y0, x1, y1; // y0 < y1
+	int8_t winding;
+} RegionEdge;
+
+typedef struct RegionCrossing {
+	int16_t x;
+	int8_t winding;
+} RegionCrossing;
+
+Region* RegionNew(void) {
+	Region* r = (Region*)malloc(sizeof(Region));
+	if( r == NULL ) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->weight = 1;
+	return r;
+}
+
+void RegionFree(Region* r) {
+	while( r->first ) {
+		RegionChunk* next = r->first->next;
+		free(r->first);
+		r->first = next;
+	}
+	free(r);
+}
+
+static int16_t* RegionSlot(Region* r) {
+	if( r->last == NULL || r->last->count == REGION_CHUNK ) {
+		RegionChunk* c = r->chunks < REGION_CHUNKS_MAX ? (RegionChunk*)malloc(sizeof(RegionChunk)) : NULL;
+		if( c == NULL ) {
+			r->overflow = 1;
+			return NULL;
+		}
+		c->next = NULL;
+		c->count = 0;
+		if( r->last ) {
+			r->last->next = c;
+		} else {
+			r->first = c;
+		}
+		r->last = c;
+		++r->chunks;
+	}
+	return &r->last->xy[2 * r->last->count++];
+}
+
+static void RegionClose(Region* r) {
+	if( r->contour ) {
+		r->area += (long long)r->px * r->fy - (long long)r->fx * r->py;
+		// a counterclockwise contour winds negative at the scanline crossings
+		r->contour[1] = r->area > 0 ? -r->contour[1] : r->contour[1];
+		r->contour = NULL;
+	}
+}
+
+void RegionMoveTo(Region* r, int x, int y) {
+	RegionClose(r);
+	r->fx = r->px = x;
+	r->fy = r->py = y;
+	r->area = 0;
+}
+
+void RegionPolarity(Region* r, int dark) {
+	r->weight = dark ? 1 : REGION_CLEAR;
+}
+
+void RegionLineTo(Region* r, int x, int y) {
+	if( abs(x) > REGION_COORD_MAX || abs(y) > REGION_COORD_MAX ||
+		abs(r->fx) > REGION_COORD_MAX || abs(r->fy) > REGION_COORD_MAX ) {
+		r->overflow = 1;
+		return;
+	}
+	if( r->contour == NULL ) {
+		// the first edge of a contour, store its start behind a marker
+		int16_t* mark = RegionSlot(r);
+		int16_t* start = RegionSlot(r);
+		if( mark == NULL || start == NULL ) {
+			return;
+		}
+		mark[0] = REGION_MARK;
+		mark[1] = r->weight;
+		start[0] = r->fx;
+		start[1] = r->fy;
+		r->contour = mark;
+		if( r->vertices == 0 ) {
+			r->x0 = r->x1 = r->fx;
+			r->y0 = r->y1 = r->fy;
+		}
+		++r->vertices;
+	}
+	int16_t* v = RegionSlot(r);
+	if( v == NULL ) {
+		return;
+	}
+	v[0] = x;
+	v[1] = y;
+	r->area += (long long)r->px * y - (long long)x * r->py;
+	r->px = x;
+	r->py = y;
+	r->x0 = x < r->x0 ? x : r->x0;
+	r->x1 = x > r->x1 ? x : r->x1;
+	r->y0 = y < r->y0 ? y : r->y0;
+	r->y1 = y > r->y1 ? y : r->y1;
+	++r->vertices;
+}
+
+static void RegionAddEdge(RegionEdge* edges, unsigned* count, int x0, int y0, int x1, int y1, int winding, int lo, int hi) {
+	if( y0 == y1 ) {
+		return; // never crossed by a scanline
+	}
+	if( y0 > y1 ) {
+		int t = x0; x0 = x1; x1 = t;
+		t = y0; y0 = y1; y1 = t;
+		winding = -winding;
+	}
+	if( y1 <= lo || y0 > hi ) {
+		return; // outside of the band
+	}
+	if( *count < REGION_EDGES_MAX ) {
+		RegionEdge* e = &edges[*count];
+		e->x0 = x0;
+		e->y0 = y0;
+		e->x1 = x1;
+		e->y1 = y1;
+		e->winding = winding;
+		// edge table order: by the first scanline
+		for( unsigned i = *count; i > 0 && edges[i - 1].y0 > y0; --i ) {
+			const RegionEdge t = edges[i - 1];
+			edges[i - 1] = edges[i];
+			edges[i] = t;
+		}
+	}
+	++*count;
+}
+
+/*
+ * Builds the edge table of the scanlines lo..hi. Returns the number of
+ * edges, more than REGION_EDGES_MAX when they did not fit.
+ */
+static unsigned RegionEdges(const Region* r, RegionEdge* edges, int lo, int hi) {
+	unsigned count = 0;
+	int fx = 0, fy = 0, px = 0, py = 0, winding = 1, open = 0;
+	for( const RegionChunk* c = r->first; c; c = c->next ) {
+		for( unsigned i = 0; i < c->count; ++i ) {
+			const int x = c->xy[2 * i], y = c->xy[2 * i + 1];
+			if( x == REGION_MARK ) {
+				if( open ) {
+					RegionAddEdge(edges, &count, px, py, fx, fy, winding, lo, hi);
+				}
+				winding = y;
+				open = 0;
+				continue;
+			}
+			if( open ) {
+				RegionAddEdge(edges, &count, px, py, x, y, winding, lo, hi);
+			} else {
+				fx = x;
+				fy = y;
+				open = 1;
+			}
+			px = x;
+			py = y;
+		}
+	}
+	if( open ) {
+		RegionAddEdge(edges, &count, px, py, fx, fy, winding, lo, hi);
+	}
+	return count;
+}
+
+static void RegionBurn(int y, int xa, int xb) {
+	MoveTo(xa, y, 1);
+	LaserEnable();
+	MoveTo(xb, y, 0);
+	LaserDisable();
+}
+
+/*
+ * Scanline k of n, spread at pitch from lo to hi with the last one on hi.
+ */
+static int RegionScanline(int k, int n, int lo, int hi, int pitch) {
+	return k == n - 1 ? hi : lo + k * pitch;
+}
+
+int RegionFill(Region* r, int tool, int pitch) {
+	RegionClose(r);
+	if( r->overflow ) {
+		return 0;
+	}
+	if( r->vertices == 0 ) {
+		return 1;
+	}
+	pitch = pitch > 0 ? pitch : 1;
+	int lo = r->y0 + tool, hi = r->y1 - tool;
+	if( lo > hi ) {
+		lo = hi = (r->y0 + r->y1) / 2; // thinner than the tool
+	}
+	const int n = (hi - lo + pitch - 1) / pitch + 1;
+
+	RegionEdge* edges = (RegionEdge*)malloc(REGION_EDGES_MAX * sizeof(RegionEdge));
+	RegionCrossing* crossings = (RegionCrossing*)malloc(REGION_EDGES_MAX * sizeof(RegionCrossing));
+	unsigned char* active = (unsigned char*)malloc(REGION_EDGES_MAX);
+	if( edges == NULL || crossings == NULL || active == NULL ) {
+		free(edges);
+		free(crossings);
+		free(active);
+		return 0;
+	}
+
+	int ok = 1;
+	int reverse = 0;
+	int band = REGION_BAND;
+	for( int k = 0; k < n; ) {
+		const int last = k + band < n ? k + band - 1 : n - 1;
+		const unsigned count = RegionEdges(r, edges, RegionScanline(k, n, lo, hi, pitch), RegionScanline(last, n, lo, hi, pitch));
+		if( count > REGION_EDGES_MAX ) {
+			if( band > 1 ) {
+				band /= 2;
+				continue;
+			}
+			ok = 0; // a single scanline crosses too many edges
+			break;
+		}
+
+		unsigned next = 0, active_count = 0;
+		for( ; k <= last; ++k ) {
+			const int y = RegionScanline(k, n, lo, hi, pitch);
+			// active edge table: add the edges starting here, drop the finished ones
+			while( next < count && edges[next].y0 <= y ) {
+				active[active_count++] = next++;
+			}
+			unsigned crossing_count = 0;
+			for( unsigned i = 0; i < active_count; ) {
+				const RegionEdge* e = &edges[active[i]];
+				if( e->y1 <= y ) {
+					active[i] = active[--active_count];
+					continue;
+				}
+				RegionCrossing c;
+				c.x = e->x0 + (int32_t)(y - e->y0) * (e->x1 - e->x0) / (e->y1 - e->y0);
+				c.winding = e->winding;
+				unsigned at = crossing_count++;
+				for( ; at > 0 && crossings[at - 1].x > c.x; --at ) {
+					crossings[at] = crossings[at - 1];
+				}
+				crossings[at] = c;
+				++i;
+			}
+
+			// spans of positive winding, inset by the tool, stored over the crossings
+			unsigned spans = 0;
+			int winding = 0, start = 0, open = 0;
+			for( unsigned i = 0; i < crossing_count; ++i ) {
+				winding += crossings[i].winding;
+				if( !open && winding > 0 ) {
+					open = 1;
+					start = crossings[i].x;
+				} else if( open && winding <= 0 && (i + 1 == crossing_count || crossings[i + 1].x != crossings[i].x) ) {
+					// a span goes on where edges meet, as on a cut-in
+					open = 0;
+					if( start + tool <= crossings[i].x - tool ) {
+						crossings[2 * spans].x = start + tool;
+						crossings[2 * spans + 1].x = crossings[i].x - tool;
+						++spans;
+					}
+				}
+			}
+			for( unsigned i = 0; i < spans; ++i ) {
+				const unsigned at = reverse ? spans - 1 - i : i;
+				const int xa = crossings[2 * at].x, xb = crossings[2 * at + 1].x;
+				RegionBurn(y, reverse ? xb : xa, reverse ? xa : xb);
+			}
+			if( spans ) {
+				reverse = !reverse;
+			}
+		}
+	}
+	free(active);
+	free(crossings);
+	free(edges);
+	return ok;
+}
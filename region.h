@@ -0,0 +1,61 @@
+#ifndef _REGION_H
+#define _REGION_H
+
+#include <stdint.h>
+
+/*
+ * G36/G37 regions. Between G36 and G37, D02 starts a contour and D01
+ * adds a vertex to it; at G37 the area is filled.
+ *
+ * Vertices are kept as int16 step coordinates in heap chunks, up to
+ * REGION_CHUNKS_MAX of them. Contours are normalised to one orientation
+ * and filled where the winding is positive, so overlapping contours add
+ * up. Clear contours (aperture macros) weigh REGION_CLEAR and erase the
+ * dark ones under them.
+ *
+ * The fill is a scanline pass at tool pitch, inset by the tool radius,
+ * with spans run in alternating directions. It goes by Y bands: only the
+ * edges crossing the current band are in the edge table, and a band
+ * with more than REGION_EDGES_MAX edges is split, so the memory needed
+ * does not grow with the region.
+ */
+
+#define REGION_CHUNK 128 // vertices per chunk
+#define REGION_CHUNKS_MAX 16
+#define REGION_EDGES_MAX 128
+#define REGION_BAND 64 // scanlines per band to start with
+#define REGION_CLEAR -64 // winding of a clear contour
+
+typedef struct RegionChunk {
+	struct RegionChunk* next;
+	unsigned count;
+	int16_t xy[2 * REGION_CHUNK];
+} RegionChunk;
+
+typedef struct Region {
+	RegionChunk* first;
+	RegionChunk* last;
+	unsigned chunks;
+	int16_t* contour; // marker of the open contour, its y holds the winding
+	int weight; // winding of the contours to come
+	int fx, fy, px, py; // first and last vertex of the open contour
+	long long area; // twice the signed area of the open contour
+	int x0, y0, x1, y1; // bounds
+	unsigned vertices;
+	int overflow;
+} Region;
+
+// NULL when the heap is out
+Region* RegionNew(void);
+void RegionFree(Region* r);
+void RegionMoveTo(Region* r, int x, int y);
+void RegionLineTo(Region* r, int x, int y);
+// contours started from now on are dark or clear
+void RegionPolarity(Region* r, int dark);
+/*
+ * Fills the region: tool is the tool radius and pitch the scanline
+ * distance, in steps. Returns 0 if the region did not fit.
+ */
+int RegionFill(Region* r, int tool, int pitch);
+
+#endif // _REGION_H
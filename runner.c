@@ -0,0 +1,199 @@
+#include "runner.h"
+#include "motor.h"
+#include "gerber.h"
+#include "checkpoint.h"
+
+static volatile RunnerState runner_state = RunnerIdle;
+static const JobCacheHeader* runner_job = NULL;
+static volatile unsigned runner_fed; // segments handed to the motion
+static unsigned runner_from; // the segment resumed from
+static Checkpoint runner_resume;
+static volatile int runner_abort;
+static systime_t runner_started;
+static systime_t runner_paused; // when the current pause began
+static unsigned runner_paused_ms; // of the pauses before it
+static int runner_pause;
+
+static BSEMAPHORE_DECL(runner_go, TRUE);
+static THD_WORKING_AREA(runner_wa, RUNNER_WA_SIZE);
+
+// matches CheckpointState
+static void RunnerCheckpointState(Checkpoint* c) {
+	c->line = JobCacheOffset(runner_job);
+	c->aperture = 0;
+	c->modal = 0;
+}
+
+static THD_FUNCTION(Runner, arg) {
+	(void)arg;
+	chRegSetThreadName("job");
+	while( true ) {
+		chBSemWait(&runner_go);
+		const JobCacheHeader* job = runner_job;
+		CheckpointStart(CHECKPOINT_CACHED, RunnerCheckpointState, runner_from ? &runner_resume : NULL);
+		for( unsigned i = 0; i < job->count && !runner_abort; ++i ) {
+			Segment s;
+			JobCacheSegment(job, i, &s);
+			const int make = CheckpointSegment(&s);
+			if( make == CHECKPOINT_RESUME ) {
+				// from where the head stands, the laser is off
+				int x, y;
+				CheckpointOrigin(&x, &y);
+				const int dx = x + runner_resume.x - CUR_X;
+				const int dy = y + runner_resume.y - CUR_Y;
+				MoveToRelative(dx, dy, 1);
+				CheckpointMoved(dx, dy);
+			}
+			if( make == CHECKPOINT_RESUME || make == CHECKPOINT_MAKE ) {
+				JobExecuteSegment(&s);
+			}
+			runner_fed = i + 1;
+		}
+		// the laser goes off after the last move
+		JobFinish();
+		CheckpointStop();
+		runner_state = runner_abort ? RunnerAborted : RunnerDone;
+		if( runner_abort ) {
+			// the checkpoint stays for job resume
+			int dx, dy;
+			MotorDropped(&dx, &dy);
+			CUR_X -= dx;
+			CUR_Y -= dy;
+			MotorResume();
+		} else {
+			CheckpointClear();
+		}
+	}
+}
+
+void RunnerInit(void) {
+	chThdCreateStatic(runner_wa, sizeof(runner_wa), NORMALPRIO - 1, Runner, NULL);
+}
+
+int RunnerActive(void) {
+	return runner_state == RunnerRunning;
+}
+
+static void RunnerRun(const JobCacheHeader* job, const Checkpoint* resume) {
+	runner_job = job;
+	runner_from = resume ? resume->segment : 0;
+	if( resume ) {
+		runner_resume = *resume;
+	}
+	runner_fed = 0;
+	runner_abort = 0;
+	runner_pause = 0;
+	runner_paused_ms = 0;
+	runner_started = chVTGetSystemTimeX();
+	runner_state = RunnerRunning;
+	chBSemSignal(&runner_go);
+}
+
+void RunnerStart(BaseSequentialStream* chp, const char* name) {
+	if( RunnerActive() ) {
+		chprintf(chp, "job is in progress\r\n");
+		return;
+	}
+	const JobCacheHeader* job = JobCacheFind(chp, name);
+	if( job == NULL ) {
+		return;
+	}
+	// the whole job is measured first, from the flash without moving
+	Preflight p;
+	JobCachePreflight(job, &p);
+	if( !PreflightFits(&p) ) {
+		PreflightPrint(chp, &p);
+		chprintf(chp, "job %s not started\r\n", name);
+		return;
+	}
+	RunnerRun(job, NULL);
+	chprintf(chp, "job %s started\r\n", name);
+}
+
+void RunnerResumeFrom(BaseSequentialStream* chp, const Checkpoint* c) {
+	const JobCacheHeader* job = JobCacheFindAt(chp, c->line);
+	if( job == NULL ) {
+		return;
+	}
+	if( c->segment >= job->count ) {
+		chprintf(chp, "the checkpoint is past the end of the job\r\n");
+		return;
+	}
+	RunnerRun(job, c);
+	chprintf(chp, "job resumed at segment %u of %u\r\n", (unsigned)c->segment, (unsigned)job->count);
+}
+
+void RunnerPause(void) {
+	if( !runner_pause ) {
+		runner_pause = 1;
+		runner_paused = chVTGetSystemTimeX();
+	}
+	MotorHold();
+}
+
+void RunnerResume(void) {
+	if( runner_pause ) {
+		runner_pause = 0;
+		runner_paused_ms += ST2MS(chVTTimeElapsedSinceX(runner_paused));
+	}
+	MotorResume();
+}
+
+void RunnerAbort(void) {
+	runner_abort = 1;
+	MotorAbort();
+	if( runner_pause ) {
+		runner_pause = 0;
+		runner_paused_ms += ST2MS(chVTTimeElapsedSinceX(runner_paused));
+	}
+}
+
+static const char* RunnerStateName(void) {
+	switch( runner_state ) {
+	case RunnerRunning:
+		if( runner_pause ) {
+			return MotorHeld() ? "paused" : "pausing";
+		}
+		return runner_abort ? "aborting" : "running";
+	case RunnerDone:
+		return "done";
+	case RunnerAborted:
+		return "aborted";
+	default:
+		return "idle";
+	}
+}
+
+void RunnerPrintStatus(BaseSequentialStream* chp) {
+	const JobCacheHeader* job = runner_job;
+	if( job == NULL ) {
+		chprintf(chp, "job: idle\r\n");
+		return;
+	}
+	const unsigned queued = SegmentQueueCount(&motor_queue);
+	const unsigned fed = runner_fed;
+	// the moves in the queue are not made yet, merged moves count once
+	const unsigned made = fed > queued ? fed - queued : 0;
+	const unsigned count = job->count;
+	char name[JOB_CACHE_NAME_MAX + 1];
+	memcpy(name, job->name, JOB_CACHE_NAME_MAX);
+	name[JOB_CACHE_NAME_MAX] = 0;
+	chprintf(chp, "job %s: %s, segment %u of %u, %u%%\r\n",
+		name, RunnerStateName(), made, count, count ? (unsigned)((uint64_t)made * 100 / count) : 100);
+	if( runner_state != RunnerRunning ) {
+		return;
+	}
+	unsigned paused_ms = runner_paused_ms;
+	if( runner_pause ) {
+		paused_ms += ST2MS(chVTTimeElapsedSinceX(runner_paused));
+	}
+	const unsigned elapsed_ms = ST2MS(chVTTimeElapsedSinceX(runner_started)) - paused_ms;
+	if( made > runner_from ) {
+		// the segments before a checkpoint are skipped in no time
+		const unsigned eta_ms = (unsigned)((uint64_t)elapsed_ms * (count - made) / (made - runner_from));
+		chprintf(chp, "elapsed %u s, ETA %u s\r\n", elapsed_ms / 1000, eta_ms / 1000);
+	} else {
+		chprintf(chp, "elapsed %u s, ETA unknown\r\n", elapsed_ms / 1000);
+	}
+	chprintf(chp, "motion queue: %u of %u records\r\n", queued, MOTOR_QUEUE_LENGTH);
+}
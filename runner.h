@@ -0,0 +1,41 @@
+#ifndef _RUNNER_H
+#define _RUNNER_H
+
+#include "job.h"
+#include "checkpoint.h"
+
+/*
+ * Background jobs. "job run <name>" hands a cached job (job.h) to the job
+ * thread and returns, so the shell answers while it runs: "job status"
+ * shows the progress, "job pause" holds the motion (motor.h), "job
+ * resume" goes on and "job abort" stops the head and drops the rest.
+ * The job keeps checkpoints (checkpoint.h), after an abort or a reset
+ * "job resume" runs it again from the last one.
+ *
+ * The job thread runs below the shell, it spends its time waiting for
+ * room in the motion queue. The status is kept in words the shell reads
+ * without a lock, the ETA is the running time so far scaled by the part
+ * of the segments left.
+ */
+
+#define RUNNER_WA_SIZE 512
+
+typedef enum {
+	RunnerIdle = 0,
+	RunnerRunning,
+	RunnerDone,
+	RunnerAborted
+} RunnerState;
+
+// creates the job thread, once
+void RunnerInit(void);
+int RunnerActive(void);
+void RunnerStart(BaseSequentialStream* chp, const char* name);
+// runs the cached job of the checkpoint from it, the head at the job origin
+void RunnerResumeFrom(BaseSequentialStream* chp, const Checkpoint* c);
+void RunnerPause(void);
+void RunnerResume(void);
+void RunnerAbort(void);
+void RunnerPrintStatus(BaseSequentialStream* chp);
+
+#endif // _RUNNER_H
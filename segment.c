@@ -0,0 +1,127 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "segment.h"
+#include "arena.h"
+
+static SegmentSink segment_sink = NULL;
+static void* segment_sink_arg = NULL;
+static int segment_sink_laser = 0;
+
+void SegmentEncode(const Segment* s, uint8_t* out) {
+	out[0] = (uint16_t)s->dx & 0xFF;
+	out[1] = (uint16_t)s->dx >> 8;
+	out[2] = (uint16_t)s->dy & 0xFF;
+	out[3] = (uint16_t)s->dy >> 8;
+	out[4] = s->flags;
+}
+
+void SegmentDecode(const uint8_t* in, Segment* s) {
+	s->dx = (int16_t)(in[0] | (in[1] << 8));
+	s->dy = (int16_t)(in[2] | (in[3] << 8));
+	s->flags = in[4];
+}
+
+void SegmentSplit(int dx, int dy, uint8_t flags, SegmentSink sink, void* arg) {
+	int parts = 1;
+	while( abs(dx) / parts > SEGMENT_DELTA_MAX || abs(dy) / parts > SEGMENT_DELTA_MAX ) {
+		++parts;
+	}
+
+	Segment s;
+	s.flags = flags;
+	int done_x = 0, done_y = 0;
+	for( int i = 1; i <= parts; ++i ) {
+		const int x = dx * i / parts;
+		const int y = dy * i / parts;
+		s.dx = x - done_x;
+		s.dy = y - done_y;
+		done_x = x;
+		done_y = y;
+		sink(arg, &s);
+	}
+}
+
+void SegmentQueueInit(SegmentQueue* q, uint8_t* records, unsigned length) {
+	q->records = records;
+	q->length = length;
+	q->head = q->tail = 0;
+	q->high = 0;
+}
+
+unsigned SegmentQueueCount(const SegmentQueue* q) {
+	return q->tail - q->head;
+}
+
+int SegmentQueuePush(SegmentQueue* q, const Segment* s) {
+	const unsigned tail = q->tail;
+	const unsigned count = tail - q->head;
+	if( count == q->length ) {
+		return 0;
+	}
+	SegmentEncode(s, q->records + (tail & (q->length - 1)) * SEGMENT_WIRE_SIZE);
+	// the record is written before the reader can see it
+	__sync_synchronize();
+	q->tail = tail + 1;
+	if( count + 1 > q->high ) {
+		q->high = count + 1;
+	}
+	return 1;
+}
+
+int SegmentQueuePop(SegmentQueue* q, Segment* s) {
+	const unsigned head = q->head;
+	if( head == q->tail ) {
+		return 0;
+	}
+	SegmentDecode(q->records + (head & (q->length - 1)) * SEGMENT_WIRE_SIZE, s);
+	__sync_synchronize();
+	q->head = head + 1;
+	return 1;
+}
+
+void SegmentPathPush(void* arg, const Segment* s) {
+	SegmentPath* p = (SegmentPath*)arg;
+	if( p->count == p->capacity ) {
+		const unsigned capacity = p->capacity ? p->capacity * 2 : 32;
+		Segment* items = (Segment*)ArenaResize(p->items, p->capacity * sizeof(Segment), capacity * sizeof(Segment));
+		if( items == NULL ) {
+			p->failed = 1;
+			return;
+		}
+		p->items = items;
+		p->capacity = capacity;
+	}
+	p->items[p->count++] = *s;
+}
+
+void SegmentPathFree(SegmentPath* p) {
+	ArenaRelease(p->items, p->capacity * sizeof(Segment));
+	p->items = NULL;
+	p->count = p->capacity = 0;
+	p->failed = 0;
+}
+
+void SegmentSinkSet(SegmentSink sink, void* arg) {
+	segment_sink = sink;
+	segment_sink_arg = arg;
+	segment_sink_laser = 0;
+}
+
+void SegmentSinkGet(SegmentSink* sink, void** arg) {
+	*sink = segment_sink;
+	*arg = segment_sink_arg;
+}
+
+int SegmentSinkActive(void) {
+	return segment_sink != NULL;
+}
+
+void SegmentSinkLaser(int enabled) {
+	segment_sink_laser = enabled;
+}
+
+void SegmentSinkMove(int dx, int dy, int silent) {
+	const uint8_t flags = (segment_sink_laser ? SEGMENT_LASER : 0) | (silent ? SEGMENT_RAPID : 0);
+	SegmentSplit(dx, dy, flags, segment_sink, segment_sink_arg);
+}
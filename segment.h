@@ -0,0 +1,77 @@
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <stdint.h>
+
+/*
+ * A motion segment: a relative move in steps together with the laser
+ * state to hold while moving. This is the unit of compiled motion
+ * programs (see job.c) and of recorded paths.
+ */
+
+#define SEGMENT_LASER 0x01 // laser is on during the move
+#define SEGMENT_RAPID 0x02 // silent move, axes are not interpolated
+
+#define SEGMENT_DELTA_MAX 32767
+#define SEGMENT_WIRE_SIZE 5
+
+typedef struct Segment {
+	int16_t dx;
+	int16_t dy;
+	uint8_t flags;
+} Segment;
+
+typedef void (*SegmentSink)(void* arg, const Segment* s);
+
+void SegmentEncode(const Segment* s, uint8_t* out);
+void SegmentDecode(const uint8_t* in, Segment* s);
+// a move of any length as segments, longer ones split into equal parts
+void SegmentSplit(int dx, int dy, uint8_t flags, SegmentSink sink, void* arg);
+
+/*
+ * Ring of segments in wire format between one writer and one reader, a
+ * thread and the step ISR (motor.c): the writer only moves tail, the
+ * reader only head. A record takes SEGMENT_WIRE_SIZE bytes where a
+ * Segment takes 6 and a move held as ints 16, so a few KB hold hundreds
+ * of moves. length is a power of two.
+ */
+typedef struct SegmentQueue {
+	uint8_t* records;
+	unsigned length;
+	volatile unsigned head, tail; // records taken and put, running on
+	unsigned high; // the most records queued at once
+} SegmentQueue;
+
+void SegmentQueueInit(SegmentQueue* q, uint8_t* records, unsigned length);
+unsigned SegmentQueueCount(const SegmentQueue* q);
+// return 0 when the queue is full or empty
+int SegmentQueuePush(SegmentQueue* q, const Segment* s);
+int SegmentQueuePop(SegmentQueue* q, Segment* s);
+
+/*
+ * A path recorded on the firmware, grown at the top of the job arena
+ * (arena.h) as segments arrive, on the heap when it is full or not set.
+ * failed is set when the memory ran out and segments were lost.
+ */
+typedef struct SegmentPath {
+	Segment* items;
+	unsigned count;
+	unsigned capacity;
+	int failed;
+} SegmentPath;
+
+// matches SegmentSink
+void SegmentPathPush(void* arg, const Segment* s);
+void SegmentPathFree(SegmentPath* p);
+
+/*
+ * While a sink is set, MoveTo/MoveToRelative and the laser switches are
+ * recorded into it instead of driving the hardware.
+ */
+void SegmentSinkSet(SegmentSink sink, void* arg);
+void SegmentSinkGet(SegmentSink* sink, void** arg);
+int SegmentSinkActive(void);
+void SegmentSinkLaser(int enabled);
+void SegmentSinkMove(int dx, int dy, int silent);
+
+#endif // _SEGMENT_H